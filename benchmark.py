@@ -1,3 +1,5 @@
+import os
+import shutil
 import timeit
 
 BENCHMARK_PATH = 'examples/benchmark/'
@@ -13,6 +15,15 @@ LANGUAGES = [
 
 BENCHMARKS = [
     "fib",
+    "binary_trees",
+    "tree_memory",
+    "map",
+    "gc_pauses",
+    "strings",
+    "string_builder",
+    "deep_recursion",
+    "fibers",
+    "math",
 ]
 
 times = {}
@@ -20,10 +31,13 @@ times = {}
 def run_script(language, benchmark):
     global times
 
+    path = BENCHMARK_PATH + benchmark + language[2]
+    if not os.path.exists(path) or not shutil.which(language[1]):
+        return
+
     print("---")
     print(language[0].upper() + ":")
     results = []
-    path = BENCHMARK_PATH + benchmark + language[2]
     for i in range(ITERATE_COUNT):
         print(f"BENCH {i}")
         t = timeit.Timer(
@@ -45,9 +59,11 @@ def run_benchmark(benchmark):
 
     print(f"{benchmark.upper()} RESULTS")
     for i in LANGUAGES:
-        print(f"{i[0].title()} average:\t{round(times[i[0]] * 1000)}ms")
+        if i[0] in times:
+            print(f"{i[0].title()} average:\t{round(times[i[0]] * 1000)}ms")
     times = {}
 
 
-run_benchmark("fib")
+for benchmark in BENCHMARKS:
+    run_benchmark(benchmark)
 
@@ -13,11 +13,15 @@ void init_varr(VArr* arr) {
   arr->items = NULL;
   arr->cap = 0;
   arr->len = 0;
+  arr->obj = NULL;
 }
 
 void push_varr(hby_State* h, VArr* arr, Val val) {
   ensure_len(h, arr, arr->len + 1);
   arr->items[arr->len++] = val;
+  if (arr->obj != NULL) {
+    gc_barrier(h, arr->obj, val);
+  }
 }
 
 void insert_varr(hby_State* h, VArr* arr, Val val, int index) {
@@ -27,6 +31,9 @@ void insert_varr(hby_State* h, VArr* arr, Val val, int index) {
     arr->items[i] = arr->items[i - 1];
   }
   arr->items[index] = val;
+  if (arr->obj != NULL) {
+    gc_barrier(h, arr->obj, val);
+  }
 }
 
 void rem_varr(hby_State* h, VArr* arr, int index) {
@@ -36,7 +43,10 @@ void rem_varr(hby_State* h, VArr* arr, int index) {
   arr->len--;
 }
 
+// Clears the array but keeps its owner
 void free_varr(hby_State* h, VArr* arr) {
   release_arr(h, Val, arr->items, arr->cap);
-  init_varr(arr);
+  arr->items = NULL;
+  arr->cap = 0;
+  arr->len = 0;
 }
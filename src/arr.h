@@ -10,7 +10,7 @@ typedef struct {
   int cap;
   int len;
   Val* items;
-  GcObj* obj;
+  GcObj* obj; // Object that owns this array, for the write barrier
 } VArr;
 
 void init_varr(VArr* arr);
@@ -3,20 +3,33 @@
 #include <stdlib.h>
 #include "val.h"
 #include "mem.h"
+#include "obj.h"
 
 void init_chunk(Chunk* c) {
   c->len = 0;
   c->cap = 0;
   c->code = NULL;
+  c->linec = 0;
+  c->line_cap = 0;
   c->lines = NULL;
 
   init_varr(&c->consts);
+
+  c->cachec = 0;
+  c->cache_cap = 0;
+  c->caches = NULL;
+
+  c->globalc = 0;
+  c->global_cap = 0;
+  c->globals = NULL;
 }
 
 void free_chunk(hby_State* h, Chunk* c) {
   release_arr(h, uint8_t, c->code, c->cap);
-  release_arr(h, int, c->lines, c->cap);
+  release_arr(h, LineRun, c->lines, c->line_cap);
   free_varr(h, &c->consts);
+  release_arr(h, InlineCache, c->caches, c->cache_cap);
+  release_arr(h, int, c->globals, c->global_cap);
   init_chunk(c);
 }
 
@@ -25,17 +38,504 @@ void write_chunk(hby_State* h, Chunk* c, Bc bc, int line) {
     int old_cap = c->cap;
     c->cap = grow_cap(old_cap);
     c->code = grow_arr(h, uint8_t, c->code, old_cap, c->cap);
-    c->lines = grow_arr(h, int, c->lines, old_cap, c->cap);
   }
 
+  add_line_chunk(h, c, c->len, line);
   c->code[c->len] = bc;
-  c->lines[c->len] = line;
   c->len++;
 }
 
+void add_line_chunk(hby_State* h, Chunk* c, int index, int line) {
+  while (c->linec > 0 && c->lines[c->linec - 1].start >= index) {
+    c->linec--;
+  }
+  if (c->linec > 0 && c->lines[c->linec - 1].line == line) {
+    return;
+  }
+
+  if (c->line_cap < c->linec + 1) {
+    int old_cap = c->line_cap;
+    c->line_cap = grow_cap(old_cap);
+    c->lines = grow_arr(h, LineRun, c->lines, old_cap, c->line_cap);
+  }
+  c->lines[c->linec].start = index;
+  c->lines[c->linec].line = line;
+  c->linec++;
+}
+
+int get_line_chunk(Chunk* c, int index) {
+  // The last run starting at or before `index`
+  int lo = 0;
+  int hi = c->linec - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (c->lines[mid].start <= index) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return c->linec > 0 ? c->lines[lo].line : 0;
+}
+
+void trim_chunk(hby_State* h, Chunk* c) {
+  c->code = grow_arr(h, uint8_t, c->code, c->cap, c->len);
+  c->cap = c->len;
+  c->lines = grow_arr(h, LineRun, c->lines, c->line_cap, c->linec);
+  c->line_cap = c->linec;
+}
+
 int add_const_chunk(hby_State* h, Chunk* c, Val val) {
   push(h, val);
   push_varr(h, &c->consts, val);
   pop(h);
   return c->consts.len - 1;
 }
+
+int add_cache_chunk(hby_State* h, Chunk* c) {
+  if (c->cache_cap < c->cachec + 1) {
+    int old_cap = c->cache_cap;
+    c->cache_cap = grow_cap(old_cap);
+    c->caches = grow_arr(h, InlineCache, c->caches, old_cap, c->cache_cap);
+  }
+
+  InlineCache* cache = &c->caches[c->cachec];
+  for (int i = 0; i < cache_ways; i++) {
+    cache->entries[i].shape = 0;
+    cache->entries[i].slot = -1;
+    cache->entries[i].method = create_null();
+  }
+
+  return c->cachec++;
+}
+
+int add_global_chunk(hby_State* h, Chunk* c, int slot) {
+  for (int i = 0; i < c->globalc; i++) {
+    if (c->globals[i] == slot) {
+      return i;
+    }
+  }
+
+  if (c->global_cap < c->globalc + 1) {
+    int old_cap = c->global_cap;
+    c->global_cap = grow_cap(old_cap);
+    c->globals = grow_arr(h, int, c->globals, old_cap, c->global_cap);
+  }
+
+  c->globals[c->globalc] = slot;
+  return c->globalc++;
+}
+
+const IntrinsicInfo intrinsic_infos[intrinsic_count] = {
+  [intrinsic_abs] = {"abs", 1},
+  [intrinsic_sqrt] = {"sqrt", 1},
+  [intrinsic_floor] = {"floor", 1},
+  [intrinsic_min] = {"min", 2},
+  [intrinsic_max] = {"max", 2},
+  [intrinsic_sin] = {"sin", 1},
+  [intrinsic_cos] = {"cos", 1},
+};
+
+typedef struct {
+  int len; // Length with operands, 0 if it depends on them
+  int effect; // Values pushed minus values popped
+} BcInfo;
+
+static const BcInfo bc_infos[] = {
+  [bc_pop] = {1, -1},
+  [bc_get_global] = {3, 1},
+  [bc_get_local] = {2, 1},
+  [bc_set_local] = {2, 0},
+  [bc_get_local_long] = {3, 1},
+  [bc_set_local_long] = {3, 0},
+  [bc_get_upval] = {2, 1},
+  [bc_set_upval] = {2, 0},
+  [bc_close_upval] = {1, -1},
+  [bc_push_prop] = {5, 1},
+  [bc_get_prop] = {5, 0},
+  [bc_set_prop] = {5, -1},
+  [bc_get_subscript] = {1, -1},
+  [bc_set_subscript] = {1, -2},
+  [bc_push_subscript] = {1, 1},
+  [bc_destruct_array] = {2, 1},
+  [bc_get_static] = {3, 0},
+  [bc_init_prop] = {3, -1},
+  [bc_const] = {2, 1},
+  [bc_const_long] = {4, 1},
+  [bc_null] = {1, 1},
+  [bc_true] = {1, 1},
+  [bc_false] = {1, 1},
+  [bc_array] = {1, 1},
+  [bc_array_item] = {1, -1},
+  [bc_map] = {1, 1},
+  [bc_map_item] = {1, -2},
+  [bc_add] = {1, -1},
+  [bc_sub] = {1, -1},
+  [bc_mul] = {1, -1},
+  [bc_div] = {1, -1},
+  [bc_mod] = {1, -1},
+  [bc_eql] = {1, -1},
+  [bc_neql] = {1, -1},
+  [bc_gt] = {1, -1},
+  [bc_lt] = {1, -1},
+  [bc_gte] = {1, -1},
+  [bc_lte] = {1, -1},
+  [bc_cat] = {1, -1},
+  [bc_is] = {1, -1},
+  [bc_neg] = {1, 0},
+  [bc_not] = {1, 0},
+  [bc_ineq_jmp] = {3, -1},
+  [bc_switch_table] = {5, 0},
+  [bc_false_jmp] = {3, 0},
+  [bc_jmp] = {3, 0},
+  [bc_loop] = {3, 0},
+  [bc_call] = {2, 0},
+  [bc_tail_call] = {2, 0},
+  [bc_invoke] = {6, 0},
+  [bc_tail_invoke] = {6, 0},
+  [bc_intrinsic] = {5, 0},
+  [bc_invoke_len] = {6, 0},
+  [bc_for_prep] = {6, 0},
+  [bc_for_loop] = {7, 0},
+  [bc_for_in] = {6, 0},
+  [bc_closure] = {0, 1},
+  [bc_ret] = {1, -1},
+  [bc_struct] = {3, 1},
+  [bc_method] = {3, -1},
+  [bc_def_static] = {3, -1},
+  [bc_member] = {3, -1},
+  [bc_enum] = {0, 1},
+  [bc_inst] = {1, 0},
+  [bc_err] = {3, 0},
+  [bc_break] = {3, 0},
+  [bc_lt_nn_jmp] = {1, -1},
+  [bc_gt_nn_jmp] = {1, -1},
+  [bc_lte_nn_jmp] = {1, -1},
+  [bc_gte_nn_jmp] = {1, -1},
+  [bc_get_subscript_arr] = {1, -1},
+  [bc_set_subscript_arr] = {1, -2},
+  // Superinstructions count as their first instruction, so code can still be
+  // walked through the rest
+  [bc_get_local2] = {2, 1},
+  [bc_get_local_const] = {2, 1},
+  [bc_get_local_prop] = {2, 1},
+  [bc_add_ll] = {2, 1},
+  [bc_lt_ll_jmp] = {2, 1},
+  [bc_gt_ll_jmp] = {2, 1},
+  [bc_lte_ll_jmp] = {2, 1},
+  [bc_gte_ll_jmp] = {2, 1},
+  [bc_lt_lc_jmp] = {2, 1},
+  [bc_gt_lc_jmp] = {2, 1},
+  [bc_lte_lc_jmp] = {2, 1},
+  [bc_gte_lc_jmp] = {2, 1},
+  [bc_set_local_pop] = {2, 0},
+  [bc_pop_jmp] = {1, -1},
+  [bc_pop_loop] = {1, -1},
+};
+
+int bc_len(Chunk* c, int index) {
+  uint8_t bc = c->code[index];
+  if (bc >= bc_count) {
+    return -1;
+  }
+
+  if (bc_infos[bc].len != 0) {
+    return bc_infos[bc].len;
+  }
+
+  if (bc == bc_enum) {
+    // Two bytes for each name after the count
+    if (index + 3 >= c->len) {
+      return -1;
+    }
+    return 4 + c->code[index + 3] * 2;
+  }
+
+  // bc_closure, followed by two bytes for each upvalue
+  if (index + 2 >= c->len) {
+    return -1;
+  }
+  int constant = (c->code[index + 1] << 8) | c->code[index + 2];
+  if (constant >= c->consts.len || !is_fn(c->consts.items[constant])) {
+    return -1;
+  }
+  return 3 + as_fn(c->consts.items[constant])->upvalc * 2;
+}
+
+Bc unquicken_bc(Bc bc) {
+  switch (bc) {
+    case bc_lt_nn_jmp: return bc_lt;
+    case bc_gt_nn_jmp: return bc_gt;
+    case bc_lte_nn_jmp: return bc_lte;
+    case bc_gte_nn_jmp: return bc_gte;
+    case bc_get_subscript_arr: return bc_get_subscript;
+    case bc_set_subscript_arr: return bc_set_subscript;
+    case bc_get_local2:
+    case bc_get_local_const:
+    case bc_get_local_prop:
+    case bc_add_ll:
+    case bc_lt_ll_jmp:
+    case bc_gt_ll_jmp:
+    case bc_lte_ll_jmp:
+    case bc_gte_ll_jmp:
+    case bc_lt_lc_jmp:
+    case bc_gt_lc_jmp:
+    case bc_lte_lc_jmp:
+    case bc_gte_lc_jmp:
+      return bc_get_local;
+    case bc_set_local_pop: return bc_set_local;
+    case bc_pop_jmp:
+    case bc_pop_loop:
+      return bc_pop;
+    default: return bc;
+  }
+}
+
+static Bc bc_at(Chunk* c, int index) {
+  return index < c->len ? (Bc)c->code[index] : bc_count;
+}
+
+// The comparison and jump of a loop or if condition, on two locals or on a
+// local and a constant
+static Bc fused_cmp(Bc cmp, bool with_const) {
+  switch (cmp) {
+    case bc_lt: return with_const ? bc_lt_lc_jmp : bc_lt_ll_jmp;
+    case bc_gt: return with_const ? bc_gt_lc_jmp : bc_gt_ll_jmp;
+    case bc_lte: return with_const ? bc_lte_lc_jmp : bc_lte_ll_jmp;
+    case bc_gte: return with_const ? bc_gte_lc_jmp : bc_gte_ll_jmp;
+    default: return bc_count;
+  }
+}
+
+// The superinstruction for the sequence at `index`, or its first instruction
+// if there is none. Longer sequences go first
+static Bc fused_bc(Chunk* c, int index) {
+  Bc first = c->code[index];
+  int second_index = index + bc_len(c, index);
+  Bc second = bc_at(c, second_index);
+
+  switch (first) {
+    case bc_get_local: {
+      if (second != bc_get_local && second != bc_const) {
+        return second == bc_get_prop ? bc_get_local_prop : first;
+      }
+
+      // Both take one operand, so the rest is right behind them
+      Bc third = bc_at(c, second_index + 2);
+      Bc cmp = fused_cmp(third, second == bc_const);
+      if (cmp != bc_count && bc_at(c, second_index + 3) == bc_false_jmp) {
+        return cmp;
+      }
+      if (second == bc_const) {
+        return bc_get_local_const;
+      }
+      return third == bc_add ? bc_add_ll : bc_get_local2;
+    }
+    case bc_set_local:
+      return second == bc_pop ? bc_set_local_pop : first;
+    case bc_pop:
+      if (second == bc_jmp) {
+        return bc_pop_jmp;
+      }
+      return second == bc_loop ? bc_pop_loop : first;
+    default:
+      return first;
+  }
+}
+
+void fuse_chunk(Chunk* c) {
+  for (int i = 0; i < c->len;) {
+    int len = bc_len(c, i);
+    c->code[i] = fused_bc(c, i);
+    i += len;
+  }
+}
+
+// Depths before each instruction, -1 where nothing reaches yet
+typedef struct {
+  int* depths;
+  bool* starts; // Whether an instruction begins at each byte
+  int len;
+  int limit; // No instruction pushes more than one value
+  int pos; // Instruction being looked at
+  bool changed; // Raised a depth behind `pos`, so another pass is needed
+} StackScan;
+
+static bool reach(StackScan* s, int index, int depth) {
+  // Falling off the end or into an operand would run bytes that aren't code
+  if (index < 0 || index >= s->len || !s->starts[index] || depth < 1
+      || depth > s->limit) {
+    return false;
+  }
+  if (s->depths[index] < depth) {
+    s->depths[index] = depth;
+    s->changed |= index <= s->pos;
+  }
+  return true;
+}
+
+// Every case of the `bc_switch_table` at `index`
+static bool reach_cases(StackScan* s, Chunk* c, int index, int depth) {
+  int table = (c->code[index + 1] << 8) | c->code[index + 2];
+  if (table >= c->consts.len || !is_map(c->consts.items[table])) {
+    return false;
+  }
+
+  GcMap* map = as_map(c->consts.items[table]);
+  for (int i = 0; i < map->item_cap; i++) {
+    MapItem* item = &map->items[i];
+    if (is_null(item->key)) {
+      continue;
+    }
+    if (!is_num(item->val) || as_num(item->val) < 0
+        || as_num(item->val) > c->len
+        || !reach(s, index + 5 + (int)as_num(item->val), depth)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int max_stack_chunk(hby_State* h, Chunk* c, int start) {
+  StackScan s;
+  s.depths = allocate(h, int, c->len + 1);
+  s.starts = allocate(h, bool, c->len + 1);
+  s.len = c->len;
+  s.limit = start + c->len;
+  for (int i = 0; i <= c->len; i++) {
+    s.depths[i] = -1;
+    s.starts[i] = false;
+  }
+  s.depths[0] = start;
+
+  // Empty code would run off its end too
+  int max = c->len > 0 ? start : -1;
+  for (int i = 0; i < c->len && max != -1;) {
+    int len = bc_len(c, i);
+    if (len <= 0 || i + len > c->len) {
+      max = -1;
+    } else {
+      s.starts[i] = true;
+      i += len;
+    }
+  }
+
+  // Code like the step of a for loop is only reached by jumping back to it,
+  // so passes are repeated until nothing changes
+  s.changed = max != -1;
+  while (s.changed && max != -1) {
+    s.changed = false;
+    for (s.pos = 0; s.pos < c->len && max != -1;) {
+      int i = s.pos;
+      int len = bc_len(c, i);
+      int depth = s.depths[i];
+      if (depth == -1) {
+        s.pos += len;
+        continue;
+      }
+
+      uint8_t bc = c->code[i];
+      int after = depth + bc_infos[bc].effect;
+      bool falls = true;
+      int target = -1;
+      switch (bc) {
+        case bc_call: after = depth - c->code[i + 1]; break;
+        case bc_invoke:
+        case bc_invoke_len:
+          after = depth - c->code[i + 3];
+          break;
+        case bc_intrinsic:
+          if (c->code[i + 1] >= intrinsic_count) {
+            after = -1;
+          } else {
+            after = depth - c->code[i + 4];
+          }
+          break;
+        case bc_tail_call:
+        case bc_tail_invoke:
+        case bc_ret:
+        case bc_err:
+          falls = false;
+          break;
+        case bc_jmp:
+        case bc_ineq_jmp:
+        case bc_false_jmp:
+          target = i + 3 + ((c->code[i + 1] << 8) | c->code[i + 2]);
+          falls = bc != bc_jmp;
+          break;
+        case bc_loop:
+          target = i + 3 - ((c->code[i + 1] << 8) | c->code[i + 2]);
+          falls = false;
+          break;
+        case bc_switch_table:
+          target = i + 5 + ((c->code[i + 3] << 8) | c->code[i + 4]);
+          falls = false;
+          if (!reach_cases(&s, c, i, after)) {
+            after = -1;
+          }
+          break;
+        case bc_for_prep:
+          target = i + 6 + ((c->code[i + 4] << 8) | c->code[i + 5]);
+          break;
+        case bc_for_loop:
+          target = i + 7 - ((c->code[i + 5] << 8) | c->code[i + 6]);
+          break;
+        case bc_for_in: {
+          // Writes the cursor and loop variables above the iterated value,
+          // and pushes it again to call its `iter` or `next`
+          int slot = (c->code[i + 1] << 8) | c->code[i + 2];
+          int varc = c->code[i + 3];
+          if ((varc != 1 && varc != 2) || slot + 2 + varc > depth) {
+            after = -1;
+          } else if (depth + 1 > max) {
+            max = depth + 1;
+          }
+          target = i + 6 + ((c->code[i + 4] << 8) | c->code[i + 5]);
+          break;
+        }
+        case bc_break:
+          after = -1; // Always patched by the compiler
+          break;
+        case bc_lt_nn_jmp:
+        case bc_gt_nn_jmp:
+        case bc_lte_nn_jmp:
+        case bc_gte_nn_jmp:
+        case bc_get_subscript_arr:
+        case bc_set_subscript_arr:
+          after = -1; // Only made by the VM
+          break;
+        case bc_get_local2:
+        case bc_get_local_const:
+        case bc_get_local_prop:
+        case bc_add_ll:
+        case bc_lt_ll_jmp:
+        case bc_gt_ll_jmp:
+        case bc_lte_ll_jmp:
+        case bc_gte_ll_jmp:
+        case bc_lt_lc_jmp:
+        case bc_gt_lc_jmp:
+        case bc_lte_lc_jmp:
+        case bc_gte_lc_jmp:
+        case bc_set_local_pop:
+        case bc_pop_jmp:
+        case bc_pop_loop:
+          after = -1; // Only made by `fuse_chunk`, after this ran
+          break;
+        default:
+          break;
+      }
+
+      if (after < 1 || (falls && !reach(&s, i + len, after))
+          || (target != -1 && !reach(&s, target, after))) {
+        max = -1;
+      } else if (after > max) {
+        max = after;
+      }
+      s.pos += len;
+    }
+  }
+
+  release_arr(h, bool, s.starts, c->len + 1);
+  release_arr(h, int, s.depths, c->len + 1);
+  return max;
+}
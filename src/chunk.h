@@ -11,6 +11,8 @@ typedef enum {
   bc_get_global,
   bc_get_local,
   bc_set_local,
+  bc_get_local_long, // Locals past the first 256, with a 16 bit slot
+  bc_set_local_long,
   bc_get_upval,
   bc_set_upval,
   bc_close_upval,
@@ -24,6 +26,7 @@ typedef enum {
   bc_get_static,
   bc_init_prop,
   bc_const,
+  bc_const_long, // Constants past the first 256, with a 24 bit index
   bc_null,
   bc_true,
   bc_false,
@@ -47,11 +50,22 @@ typedef enum {
   bc_neg,
   bc_not,
   bc_ineq_jmp,
+  // Jumps by the entry for the value on the stack in a map of constant case
+  // labels to offsets, or by its operand if there is none. Made by
+  // `optimize_chunk` from a chain of `bc_ineq_jmp`
+  bc_switch_table,
   bc_false_jmp,
   bc_jmp,
   bc_loop,
   bc_call,
+  bc_tail_call,
   bc_invoke,
+  bc_tail_invoke, // `bc_invoke` that reuses the frame, like `bc_tail_call`
+  bc_intrinsic,
+  bc_invoke_len,
+  bc_for_prep,
+  bc_for_loop,
+  bc_for_in,
   bc_closure,
   bc_ret,
   bc_struct,
@@ -63,19 +77,130 @@ typedef enum {
   bc_err,
   // Not used in final bytecode
   bc_break,
+  // Quickened forms the VM rewrites instructions to once it has seen their
+  // operands. They turn back into the generic form when their guard fails,
+  // and are never dumped
+  bc_lt_nn_jmp, // `bc_lt` on numbers, fused with the `bc_false_jmp` after it
+  bc_gt_nn_jmp,
+  bc_lte_nn_jmp,
+  bc_gte_nn_jmp,
+  bc_get_subscript_arr, // `bc_get_subscript` on an array and a number
+  bc_set_subscript_arr,
+  // Superinstructions `fuse_chunk` puts in place of the first instruction of
+  // a common sequence. The rest of it stays behind, so jumps into the middle
+  // still work and the VM can turn it back when a guard fails
+  bc_get_local2, // `bc_get_local` twice
+  bc_get_local_const, // `bc_get_local` and `bc_const`
+  bc_get_local_prop, // `bc_get_local` and `bc_get_prop`
+  bc_add_ll, // `bc_get_local` twice and `bc_add`
+  bc_lt_ll_jmp, // `bc_get_local` twice, `bc_lt` and `bc_false_jmp`
+  bc_gt_ll_jmp,
+  bc_lte_ll_jmp,
+  bc_gte_ll_jmp,
+  bc_lt_lc_jmp, // `bc_get_local`, `bc_const`, `bc_lt` and `bc_false_jmp`
+  bc_gt_lc_jmp,
+  bc_lte_lc_jmp,
+  bc_gte_lc_jmp,
+  bc_set_local_pop, // `bc_set_local` and `bc_pop`
+  bc_pop_jmp, // `bc_pop` and `bc_jmp`
+  bc_pop_loop, // `bc_pop` and `bc_loop`
+  bc_count,
 } Bc;
 
+// How `bc_for_prep` and `bc_for_loop` compare the loop variable to the limit,
+// in the low bits of their flags
+typedef enum {
+  for_lt,
+  for_lte,
+  for_gt,
+  for_gte,
+} ForCmp;
+
+#define for_cmp_mask 3
+// The limit is a constant instead of a local
+#define for_const_limit 4
+
+// Calls to `math` the VM does itself, as long as the global wasn't replaced
+typedef enum {
+  intrinsic_abs,
+  intrinsic_sqrt,
+  intrinsic_floor,
+  intrinsic_min,
+  intrinsic_max,
+  intrinsic_sin,
+  intrinsic_cos,
+  intrinsic_count,
+} Intrinsic;
+
+typedef struct {
+  const char* name;
+  int argc;
+} IntrinsicInfo;
+
+extern const IntrinsicInfo intrinsic_infos[intrinsic_count];
+
+// How many receiver shapes one inline cache remembers before it gives up
+#define cache_ways 4
+
+// A name resolved against one struct shape
+typedef struct {
+  uint32_t shape; // The struct's shape when this was filled. 0 if unused
+  int slot; // Index of the field in the instance, -1 if it's a method
+  Val method; // The method, if `slot` is -1
+} CacheEntry;
+
+// Remembers what a property access or invoke resolved to. One per instruction
+typedef struct {
+  CacheEntry entries[cache_ways];
+} InlineCache;
+
+// The code from `start` up to the next run came from `line`
+typedef struct {
+  int start;
+  int line;
+} LineRun;
+
 typedef struct {
   int len;
   int cap;
   uint8_t* code;
-  int* lines;
+  int linec;
+  int line_cap;
+  LineRun* lines; // Ordered by `start`, only where the line changes
   VArr consts;
+
+  int cachec;
+  int cache_cap;
+  InlineCache* caches;
+
+  // Slots of the globals the code reads, see `Global`
+  int globalc;
+  int global_cap;
+  int* globals;
 } Chunk;
 
 void init_chunk(Chunk* c);
 void free_chunk(hby_State* h, Chunk* c);
 void write_chunk(hby_State* h, Chunk* c, Bc bc, int line);
+// Record that the code from `index` on came from `line`. Runs at or past
+// `index` are dropped, so code can be cut off and written again
+void add_line_chunk(hby_State* h, Chunk* c, int index, int line);
+// The line the code at `index` came from
+int get_line_chunk(Chunk* c, int index);
+// Shrink the code and line table to what they use, once nothing is added
+void trim_chunk(hby_State* h, Chunk* c);
 int add_const_chunk(hby_State* h, Chunk* c, Val val);
+int add_cache_chunk(hby_State* h, Chunk* c);
+int add_global_chunk(hby_State* h, Chunk* c, int slot);
+// Length of the instruction at `index` with its operands, -1 if it's malformed
+int bc_len(Chunk* c, int index);
+// The instruction a quickened or fused one was rewritten from
+Bc unquicken_bc(Bc bc);
+// Put superinstructions in place of common sequences, see `bc_get_local2`.
+// Only for valid code that wasn't fused or quickened yet
+void fuse_chunk(Chunk* c);
+// Most values the code keeps on the stack at once when it starts with `start`,
+// or -1 if the code is malformed
+int max_stack_chunk(hby_State* h, Chunk* c, int start);
 
 #endif // __HBY_CHUNK_H
@@ -7,12 +7,27 @@
 
 // #define hby_trace_exec
 // #define hby_print_bc
+// Print the code of every function when the state is freed, showing which
+// instructions the VM quickened
+// #define hby_print_quick
 
 // #define hby_stress_gc
 // #define hby_log_gc
 
+// #define hby_ic_stats
+// Count the instructions run, and which ones run right after each other.
+// Printed when the state is freed
+// #define hby_profile_bc
+
 #define nan_boxing
 
+// Use GCC/Clang labels-as-values for the interpreter's dispatch. Define
+// `hby_no_computed_goto` to fall back to the portable `switch`.
+#if defined(__GNUC__) && !defined(hby_no_computed_goto)
+# define hby_computed_goto
+#endif
+
 #define uint8_count (UINT8_MAX + 1)
+#define uint16_count (UINT16_MAX + 1)
 
 #endif // __HBY_COMMON_H
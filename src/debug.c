@@ -1,6 +1,7 @@
 #include "debug.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "tostr.h"
 #include "obj.h"
 #include "chunk.h"
@@ -19,6 +20,41 @@ static int const_bc(hby_State* h, const char* name, Chunk* c, int index) {
   return index + 2;
 }
 
+// A name or function, with a 16 bit index
+static int wide_bc(hby_State* h, const char* name, Chunk* c, int index) {
+  int constant = (c->code[index + 1] << 8) | c->code[index + 2];
+  printf(
+    "%-16s %4d '%s'\n",
+    name, constant, to_str(h, c->consts.items[constant])->chars);
+  return index + 3;
+}
+
+static int global_bc(hby_State* h, const char* name, Chunk* c, int index) {
+  uint16_t ref = (uint16_t)(c->code[index + 1] << 8);
+  ref |= c->code[index + 2];
+  int slot = c->globals[ref];
+  printf("%-16s %4d '%s'\n", name, slot, h->globals[slot].name->chars);
+  return index + 3;
+}
+
+static int const_long_bc(
+  hby_State* h, const char* name, Chunk* c, int index
+) {
+  int constant = (c->code[index + 1] << 16) | (c->code[index + 2] << 8);
+  constant |= c->code[index + 3];
+  printf(
+    "%-16s %4d '%s'\n",
+    name, constant, to_str(h, c->consts.items[constant])->chars);
+  return index + 4;
+}
+
+static int short_bc(const char* name, Chunk* c, int index) {
+  uint16_t slot = (uint16_t)(c->code[index + 1] << 8);
+  slot |= c->code[index + 2];
+  printf("%-16s %4d\n", name, slot);
+  return index + 3;
+}
+
 static int byte_bc(const char* name, Chunk* c, int index) {
   uint8_t slot = c->code[index + 1];
   printf("%-16s %4d\n", name, slot);
@@ -32,36 +68,52 @@ static int jmp_bc(const char* name, int sign, Chunk* c, int index) {
   return index + 3;
 }
 
+static int prop_bc(hby_State* h, const char* name, Chunk* c, int index) {
+  int constant = (c->code[index + 1] << 8) | c->code[index + 2];
+  uint16_t cache = (uint16_t)(c->code[index + 3] << 8);
+  cache |= c->code[index + 4];
+  printf(
+    "%-16s %4d '%s' (cache %d)\n",
+    name, constant, to_str(h, c->consts.items[constant])->chars, cache);
+  return index + 5;
+}
+
 static int invoke_bc(hby_State* h, const char* name, Chunk* c, int offset) {
-  uint8_t constant = c->code[offset + 1];
-  uint8_t argc = c->code[offset + 2];
+  int constant = (c->code[offset + 1] << 8) | c->code[offset + 2];
+  uint8_t argc = c->code[offset + 3];
+  uint16_t cache = (uint16_t)(c->code[offset + 4] << 8);
+  cache |= c->code[offset + 5];
   printf(
-    "%-16s (%d args) %4d '%s'\n",
-    name, argc, constant, to_str(h, c->consts.items[constant])->chars);
-  return offset + 3;
+    "%-16s (%d args) %4d '%s' (cache %d)\n",
+    name, argc, constant, to_str(h, c->consts.items[constant])->chars, cache);
+  return offset + 6;
 }
 
 
 int print_bc(hby_State* h, Chunk *c, int index) {
   printf("%04d ", index);
-  if (index > 0 && c->lines[index] == c->lines[index - 1]) {
+  int line = get_line_chunk(c, index);
+  if (index > 0 && line == get_line_chunk(c, index - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", c->lines[index]);
+    printf("%4d ", line);
   }
 
   uint8_t bc = c->code[index];
   switch (bc) {
     case bc_pop: return simple_bc("pop", index);
     case bc_close_upval: return simple_bc("close_upval", index);
-    case bc_get_global: return const_bc(h, "get_global", c, index);
+    case bc_get_global: return global_bc(h, "get_global", c, index);
     case bc_get_local: return byte_bc("get_local", c, index);
     case bc_set_local: return byte_bc("set_local", c, index);
+    case bc_get_local_long: return short_bc("get_local_long", c, index);
+    case bc_set_local_long: return short_bc("set_local_long", c, index);
     case bc_get_upval: return byte_bc("get_upval", c, index);
     case bc_set_upval: return byte_bc("set_upval", c, index);
-    case bc_get_prop: return const_bc(h, "get_prop", c, index);
-    case bc_set_prop: return const_bc(h, "set_prop", c, index);
-    case bc_init_prop: return const_bc(h, "init_prop", c, index);
+    case bc_push_prop: return prop_bc(h, "push_prop", c, index);
+    case bc_get_prop: return prop_bc(h, "get_prop", c, index);
+    case bc_set_prop: return prop_bc(h, "set_prop", c, index);
+    case bc_init_prop: return wide_bc(h, "init_prop", c, index);
     case bc_get_subscript: return simple_bc("get_subscript", index);
     case bc_set_subscript: return simple_bc("set_subscript", index);
     case bc_destruct_array: {
@@ -70,8 +122,9 @@ int print_bc(hby_State* h, Chunk *c, int index) {
       return index + 2;
     }
     case bc_push_subscript: return simple_bc("push_subscript", index);
-    case bc_get_static: return const_bc(h, "get_static", c, index);
+    case bc_get_static: return wide_bc(h, "get_static", c, index);
     case bc_const: return const_bc(h, "const", c, index);
+    case bc_const_long: return const_long_bc(h, "const_long", c, index);
     case bc_true: return simple_bc("true", index);
     case bc_false: return simple_bc("false", index);
     case bc_null: return simple_bc("null", index);
@@ -96,52 +149,132 @@ int print_bc(hby_State* h, Chunk *c, int index) {
     case bc_not: return simple_bc("not", index);
     case bc_jmp: return jmp_bc("jmp", 1, c, index);
     case bc_ineq_jmp: return jmp_bc("ineq_jmp", 1, c, index);
+    case bc_switch_table: {
+      int table = (c->code[index + 1] << 8) | c->code[index + 2];
+      int jmp = (c->code[index + 3] << 8) | c->code[index + 4];
+      printf(
+        "%-16s %4d %s else -> %d\n",
+        "switch_table", table, to_str(h, c->consts.items[table])->chars,
+        index + 5 + jmp);
+      return index + 5;
+    }
     case bc_false_jmp: return jmp_bc("false_jmp", 1, c, index);
     case bc_loop: return jmp_bc("loop", -1, c, index);
     case bc_call: return byte_bc("call", c, index);
+    case bc_tail_call: return byte_bc("tail_call", c, index);
     case bc_invoke: return invoke_bc(h, "invoke", c, index);
+    case bc_tail_invoke: return invoke_bc(h, "tail_invoke", c, index);
+    case bc_intrinsic: {
+      // The name is the intrinsic's, the id only indexes `intrinsic_infos`
+      int constant = (c->code[index + 2] << 8) | c->code[index + 3];
+      printf(
+        "%-16s (%d args) %4d '%s'\n",
+        "intrinsic", c->code[index + 4], constant,
+        to_str(h, c->consts.items[constant])->chars);
+      return index + 5;
+    }
+    case bc_invoke_len: return invoke_bc(h, "len", c, index);
+    case bc_for_prep:
+    case bc_for_loop: {
+      static const char* cmps[] = {"<", "<=", ">", ">="};
+      uint8_t limit = c->code[index + 2];
+      uint8_t flags = c->code[index + 3];
+      printf(
+        "%-16s %4d %s ", bc == bc_for_prep ? "for_prep" : "for_loop",
+        c->code[index + 1], cmps[flags & for_cmp_mask]);
+      if (flags & for_const_limit) {
+        printf("'%s'", to_str(h, c->consts.items[limit])->chars);
+      } else {
+        printf("local %d", limit);
+      }
+
+      if (bc == bc_for_prep) {
+        int jmp = (c->code[index + 4] << 8) | c->code[index + 5];
+        printf(" -> %d\n", index + 6 + jmp);
+        return index + 6;
+      }
+      int jmp = (c->code[index + 5] << 8) | c->code[index + 6];
+      printf(
+        " step '%s' -> %d\n",
+        to_str(h, c->consts.items[c->code[index + 4]])->chars,
+        index + 7 - jmp);
+      return index + 7;
+    }
+    case bc_for_in: {
+      int slot = (c->code[index + 1] << 8) | c->code[index + 2];
+      int jmp = (c->code[index + 4] << 8) | c->code[index + 5];
+      printf(
+        "%-16s %4d (%d vars) -> %d\n",
+        "for_in", slot, c->code[index + 3], index + 6 + jmp);
+      return index + 6;
+    }
     case bc_closure: {
-      index++;
-      uint8_t constant = c->code[index++];
+      int constant = (c->code[index + 1] << 8) | c->code[index + 2];
+      index += 3;
       printf(
         "%-16s %4d %s\n",
         "closure", constant, to_str(h, c->consts.items[constant])->chars);
 
       GcFn* fn = as_fn(c->consts.items[constant]);
       for (int j = 0; j < fn->upvalc; j++) {
-        int is_local = c->code[index++];
-        int uv_index = c->code[index++];
+        int uv_index = (c->code[index] << 8) | c->code[index + 1];
+        index += 2;
         printf(
           "%04d      |                     %s %d\n",
-          index - 2, is_local ? "local" : "upvalue", uv_index);
+          index - 2, uv_index & 0x8000 ? "local" : "upvalue",
+          uv_index & 0x7FFF);
       }
 
       return index;
     }
     case bc_ret: return simple_bc("ret", index);
-    case bc_struct: return const_bc(h, "struct", c, index);
-    case bc_member: return const_bc(h, "member", c, index);
-    case bc_method: return const_bc(h, "method", c, index);
+    case bc_struct: return wide_bc(h, "struct", c, index);
+    case bc_member: return wide_bc(h, "member", c, index);
+    case bc_method: return wide_bc(h, "method", c, index);
     case bc_enum: {
-      index++;
-      uint8_t name = c->code[index++];
-      uint8_t count = c->code[index++];
+      int name = (c->code[index + 1] << 8) | c->code[index + 2];
+      uint8_t count = c->code[index + 3];
+      index += 4;
       printf(
         "%-16s %4d '%s' %4d\n",
         "enum", name, as_cstr(c->consts.items[name]), count);
 
       for (int i = 0; i < count; i++) {
-        uint8_t name = c->code[index++];
+        int name = (c->code[index] << 8) | c->code[index + 1];
+        index += 2;
         printf(
           "%04d      |                   %s\n",
           index - 2, as_cstr(c->consts.items[name]));
       }
       return index;
     }
-    case bc_def_static: return const_bc(h, "def_static", c, index);
+    case bc_def_static: return wide_bc(h, "def_static", c, index);
     case bc_inst: return simple_bc("inst", index);
-    case bc_err: return const_bc(h, "err", c, index);
+    case bc_err: return wide_bc(h, "err", c, index);
     case bc_break: return simple_bc("break", index);
+    case bc_lt_nn_jmp: return simple_bc("lt_nn_jmp", index);
+    case bc_gt_nn_jmp: return simple_bc("gt_nn_jmp", index);
+    case bc_lte_nn_jmp: return simple_bc("lte_nn_jmp", index);
+    case bc_gte_nn_jmp: return simple_bc("gte_nn_jmp", index);
+    case bc_get_subscript_arr: return simple_bc("get_subscript_arr", index);
+    case bc_set_subscript_arr: return simple_bc("set_subscript_arr", index);
+    // Superinstructions print their first operand, the rest of the sequence
+    // follows as usual
+    case bc_get_local2: return byte_bc("get_local2", c, index);
+    case bc_get_local_const: return byte_bc("get_local_const", c, index);
+    case bc_get_local_prop: return byte_bc("get_local_prop", c, index);
+    case bc_add_ll: return byte_bc("add_ll", c, index);
+    case bc_lt_ll_jmp: return byte_bc("lt_ll_jmp", c, index);
+    case bc_gt_ll_jmp: return byte_bc("gt_ll_jmp", c, index);
+    case bc_lte_ll_jmp: return byte_bc("lte_ll_jmp", c, index);
+    case bc_gte_ll_jmp: return byte_bc("gte_ll_jmp", c, index);
+    case bc_lt_lc_jmp: return byte_bc("lt_lc_jmp", c, index);
+    case bc_gt_lc_jmp: return byte_bc("gt_lc_jmp", c, index);
+    case bc_lte_lc_jmp: return byte_bc("lte_lc_jmp", c, index);
+    case bc_gte_lc_jmp: return byte_bc("gte_lc_jmp", c, index);
+    case bc_set_local_pop: return byte_bc("set_local_pop", c, index);
+    case bc_pop_jmp: return simple_bc("pop_jmp", index);
+    case bc_pop_loop: return simple_bc("pop_loop", index);
   }
 
   printf("Unknown bytecode %d\n", bc);
@@ -155,3 +288,156 @@ void print_chunk(hby_State* h, Chunk* c, const char* name) {
     index = print_bc(h, c, index);
   }
 }
+
+#ifdef hby_profile_bc
+static const char* bc_names[bc_count] = {
+  [bc_pop] = "pop",
+  [bc_get_global] = "get_global",
+  [bc_get_local] = "get_local",
+  [bc_set_local] = "set_local",
+  [bc_get_local_long] = "get_local_long",
+  [bc_set_local_long] = "set_local_long",
+  [bc_get_upval] = "get_upval",
+  [bc_set_upval] = "set_upval",
+  [bc_close_upval] = "close_upval",
+  [bc_push_prop] = "push_prop",
+  [bc_get_prop] = "get_prop",
+  [bc_set_prop] = "set_prop",
+  [bc_get_subscript] = "get_subscript",
+  [bc_set_subscript] = "set_subscript",
+  [bc_push_subscript] = "push_subscript",
+  [bc_destruct_array] = "destruct_array",
+  [bc_get_static] = "get_static",
+  [bc_init_prop] = "init_prop",
+  [bc_const] = "const",
+  [bc_const_long] = "const_long",
+  [bc_null] = "null",
+  [bc_true] = "true",
+  [bc_false] = "false",
+  [bc_array] = "array",
+  [bc_array_item] = "array_item",
+  [bc_map] = "map",
+  [bc_map_item] = "map_item",
+  [bc_add] = "add",
+  [bc_sub] = "sub",
+  [bc_mul] = "mul",
+  [bc_div] = "div",
+  [bc_mod] = "mod",
+  [bc_eql] = "eql",
+  [bc_neql] = "neql",
+  [bc_gt] = "gt",
+  [bc_lt] = "lt",
+  [bc_gte] = "gte",
+  [bc_lte] = "lte",
+  [bc_cat] = "cat",
+  [bc_is] = "is",
+  [bc_neg] = "neg",
+  [bc_not] = "not",
+  [bc_ineq_jmp] = "ineq_jmp",
+  [bc_switch_table] = "switch_table",
+  [bc_false_jmp] = "false_jmp",
+  [bc_jmp] = "jmp",
+  [bc_loop] = "loop",
+  [bc_call] = "call",
+  [bc_tail_call] = "tail_call",
+  [bc_invoke] = "invoke",
+  [bc_tail_invoke] = "tail_invoke",
+  [bc_intrinsic] = "intrinsic",
+  [bc_invoke_len] = "invoke_len",
+  [bc_for_prep] = "for_prep",
+  [bc_for_loop] = "for_loop",
+  [bc_for_in] = "for_in",
+  [bc_closure] = "closure",
+  [bc_ret] = "ret",
+  [bc_struct] = "struct",
+  [bc_method] = "method",
+  [bc_def_static] = "def_static",
+  [bc_member] = "member",
+  [bc_enum] = "enum",
+  [bc_inst] = "inst",
+  [bc_err] = "err",
+  [bc_break] = "break",
+  [bc_lt_nn_jmp] = "lt_nn_jmp",
+  [bc_gt_nn_jmp] = "gt_nn_jmp",
+  [bc_lte_nn_jmp] = "lte_nn_jmp",
+  [bc_gte_nn_jmp] = "gte_nn_jmp",
+  [bc_get_subscript_arr] = "get_subscript_arr",
+  [bc_set_subscript_arr] = "set_subscript_arr",
+  [bc_get_local2] = "get_local2",
+  [bc_get_local_const] = "get_local_const",
+  [bc_get_local_prop] = "get_local_prop",
+  [bc_add_ll] = "add_ll",
+  [bc_lt_ll_jmp] = "lt_ll_jmp",
+  [bc_gt_ll_jmp] = "gt_ll_jmp",
+  [bc_lte_ll_jmp] = "lte_ll_jmp",
+  [bc_gte_ll_jmp] = "gte_ll_jmp",
+  [bc_lt_lc_jmp] = "lt_lc_jmp",
+  [bc_gt_lc_jmp] = "gt_lc_jmp",
+  [bc_lte_lc_jmp] = "lte_lc_jmp",
+  [bc_gte_lc_jmp] = "gte_lc_jmp",
+  [bc_set_local_pop] = "set_local_pop",
+  [bc_pop_jmp] = "pop_jmp",
+  [bc_pop_loop] = "pop_loop",
+};
+
+typedef struct {
+  size_t count;
+  int bcs[3];
+} BcSeq;
+
+static int cmp_seqs(const void* a, const void* b) {
+  size_t count_a = ((const BcSeq*)a)->count;
+  size_t count_b = ((const BcSeq*)b)->count;
+  return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+// Print the `top` most common of `seqc` sequences of `len` instructions
+static void print_seqs(BcSeq* seqs, int seqc, int len, size_t total, int top) {
+  qsort(seqs, seqc, sizeof(BcSeq), cmp_seqs);
+  for (int i = 0; i < seqc && i < top && seqs[i].count > 0; i++) {
+    printf("%12zu %5.2f%%  ", seqs[i].count, 100.0 * seqs[i].count / total);
+    for (int j = 0; j < len; j++) {
+      printf("%s%s", j > 0 ? " + " : "", bc_names[seqs[i].bcs[j]]);
+    }
+    printf("\n");
+  }
+}
+
+void print_bc_profile(hby_State* h) {
+  size_t total = 0;
+  for (int a = 0; a < bc_count; a++) {
+    total += h->bc_counts[a];
+  }
+  if (total == 0) {
+    return;
+  }
+
+  int seqc = bc_count * bc_count * bc_count;
+  BcSeq* seqs = malloc(sizeof(BcSeq) * seqc);
+  printf("== %zu INSTRUCTIONS ==\n", total);
+  for (int a = 0; a < bc_count; a++) {
+    seqs[a] = (BcSeq){h->bc_counts[a], {a}};
+  }
+  print_seqs(seqs, bc_count, 1, total, 20);
+
+  printf("== PAIRS ==\n");
+  for (int a = 0; a < bc_count; a++) {
+    for (int b = 0; b < bc_count; b++) {
+      seqs[a * bc_count + b] = (BcSeq){h->bc_pairs[a][b], {a, b}};
+    }
+  }
+  print_seqs(seqs, bc_count * bc_count, 2, total, 20);
+
+  printf("== TRIPLES ==\n");
+  for (int a = 0; a < bc_count; a++) {
+    for (int b = 0; b < bc_count; b++) {
+      for (int c = 0; c < bc_count; c++) {
+        int i = (a * bc_count + b) * bc_count + c;
+        seqs[i] = (BcSeq){h->bc_triples[a][b][c], {a, b, c}};
+      }
+    }
+  }
+  print_seqs(seqs, seqc, 3, total, 20);
+  free(seqs);
+}
+#endif
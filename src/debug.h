@@ -5,5 +5,9 @@
 
 void print_chunk(hby_State* h, Chunk* c, const char* name);
 int print_bc(hby_State* h, Chunk *c, int index);
+#ifdef hby_profile_bc
+// Print the instructions and sequences of them that ran most often
+void print_bc_profile(hby_State* h);
+#endif
 
 #endif // __HBY_DEBUG_H
@@ -0,0 +1,486 @@
+#include "dump.h"
+
+#include <string.h>
+#include "chunk.h"
+#include "map.h"
+#include "mem.h"
+
+// Layout, all integers little endian:
+//   header: "\x1bhby" u8(dump_version) u8(bc count)
+//   fn:     u32(arity) u8(variadic) u32(upvalc) str(name or u32(-1))
+//           u32(len) code[len] u32(runc) run[runc] u32(cachec)
+//           u32(globalc) str(global name)[globalc]
+//           u32(constc) const[constc]
+//   const:  u8(tag) then f64, str, fn or table
+//   table:  u32(count) then u8(tag) f64 or str, and f64(offset) for each case
+//   run:    u32(count) u32(line), `count` bytes of code on the same line
+//   str:    u32(len) chars[len]
+
+#define dump_magic "\x1bhby"
+#define dump_magic_len 4
+#define no_name UINT32_MAX
+
+typedef enum {
+  const_num,
+  const_str,
+  const_fn,
+  const_table, // Cases of a `bc_switch_table`
+} ConstTag;
+
+static void dump_u32(hby_State* h, StrBuf* buf, uint32_t n) {
+  uint8_t bytes[4] = {n & 0xFF, (n >> 8) & 0xFF, (n >> 16) & 0xFF, n >> 24};
+  append_strbuf(h, buf, (const char*)bytes, 4);
+}
+
+static void dump_num(hby_State* h, StrBuf* buf, double n) {
+  uint64_t bits;
+  memcpy(&bits, &n, sizeof(bits));
+  dump_u32(h, buf, (uint32_t)bits);
+  dump_u32(h, buf, (uint32_t)(bits >> 32));
+}
+
+static void dump_str(hby_State* h, StrBuf* buf, GcStr* str) {
+  dump_u32(h, buf, str->len);
+  append_strbuf(h, buf, str->chars, str->len);
+}
+
+static void dump_lines(hby_State* h, Chunk* c, StrBuf* buf) {
+  dump_u32(h, buf, c->linec);
+  for (int i = 0; i < c->linec; i++) {
+    int end = i + 1 < c->linec ? c->lines[i + 1].start : c->len;
+    dump_u32(h, buf, end - c->lines[i].start);
+    dump_u32(h, buf, c->lines[i].line);
+  }
+}
+
+static void dump_table(hby_State* h, GcMap* table, StrBuf* buf) {
+  int count = 0;
+  for (int i = 0; i < table->item_cap; i++) {
+    count += !is_null(table->items[i].key);
+  }
+
+  dump_u32(h, buf, count);
+  for (int i = 0; i < table->item_cap; i++) {
+    MapItem* item = &table->items[i];
+    if (is_null(item->key)) {
+      continue;
+    }
+    if (is_num(item->key)) {
+      append_char_strbuf(h, buf, const_num);
+      dump_num(h, buf, as_num(item->key));
+    } else {
+      append_char_strbuf(h, buf, const_str);
+      dump_str(h, buf, as_str(item->key));
+    }
+    dump_num(h, buf, as_num(item->val));
+  }
+}
+
+static void dump_chunk_fn(hby_State* h, GcFn* fn, StrBuf* buf) {
+  dump_u32(h, buf, fn->arity);
+  append_char_strbuf(h, buf, fn->variadic);
+  dump_u32(h, buf, fn->upvalc);
+  if (fn->name != NULL) {
+    dump_str(h, buf, fn->name);
+  } else {
+    dump_u32(h, buf, no_name);
+  }
+
+  Chunk* c = &fn->chunk;
+  dump_u32(h, buf, c->len);
+  int code_start = buf->len;
+  append_strbuf(h, buf, (const char*)c->code, c->len);
+  // Superinstructions and quickened code only mean something in this state
+  for (int i = 0; i < c->len; i += bc_len(c, i)) {
+    buf->chars[code_start + i] = unquicken_bc(c->code[i]);
+  }
+  dump_lines(h, c, buf);
+  dump_u32(h, buf, c->cachec);
+
+  // Slots only mean something in one state, so globals are saved by name
+  dump_u32(h, buf, c->globalc);
+  for (int i = 0; i < c->globalc; i++) {
+    dump_str(h, buf, h->globals[c->globals[i]].name);
+  }
+
+  dump_u32(h, buf, c->consts.len);
+  for (int i = 0; i < c->consts.len; i++) {
+    Val val = c->consts.items[i];
+    if (is_num(val)) {
+      append_char_strbuf(h, buf, const_num);
+      dump_num(h, buf, as_num(val));
+    } else if (is_str(val)) {
+      append_char_strbuf(h, buf, const_str);
+      dump_str(h, buf, as_str(val));
+    } else if (is_map(val)) {
+      append_char_strbuf(h, buf, const_table);
+      dump_table(h, as_map(val), buf);
+    } else {
+      append_char_strbuf(h, buf, const_fn);
+      dump_chunk_fn(h, as_fn(val), buf);
+    }
+  }
+}
+
+void dump_fn(hby_State* h, GcFn* fn, StrBuf* buf) {
+  append_strbuf(h, buf, dump_magic, dump_magic_len);
+  append_char_strbuf(h, buf, dump_version);
+  append_char_strbuf(h, buf, bc_break + 1);
+  dump_chunk_fn(h, fn, buf);
+}
+
+typedef struct {
+  hby_State* h;
+  GcStr* path;
+  const uint8_t* data;
+  size_t len;
+  size_t pos;
+  bool failed;
+} Loader;
+
+// Reading past the end marks the load as failed and yields zeroes, so callers
+// only need to check `failed` once they're done with a section
+static const uint8_t* load_bytes(Loader* l, size_t len) {
+  if (l->failed || len > l->len - l->pos) {
+    l->failed = true;
+    return NULL;
+  }
+
+  const uint8_t* bytes = l->data + l->pos;
+  l->pos += len;
+  return bytes;
+}
+
+static uint8_t load_u8(Loader* l) {
+  const uint8_t* bytes = load_bytes(l, 1);
+  return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t load_u32(Loader* l) {
+  const uint8_t* b = load_bytes(l, 4);
+  if (b == NULL) {
+    return 0;
+  }
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static double load_num(Loader* l) {
+  uint64_t bits = load_u32(l);
+  bits |= (uint64_t)load_u32(l) << 32;
+
+  double n;
+  memcpy(&n, &bits, sizeof(n));
+  return n;
+}
+
+static GcStr* load_str(Loader* l, uint32_t len) {
+  const uint8_t* chars = load_bytes(l, len);
+  return chars == NULL ? NULL : copy_str(l->h, (const char*)chars, len);
+}
+
+// Counts that can't fit in what's left of the data are corrupt. Checking them
+// up front avoids huge allocations
+static bool fits(Loader* l, uint32_t count, size_t size) {
+  if (l->failed || count > (l->len - l->pos) / size) {
+    l->failed = true;
+    return false;
+  }
+  return true;
+}
+
+static void load_table(Loader* l, Chunk* c) {
+  hby_State* h = l->h;
+  uint32_t count = load_u32(l);
+  if (!fits(l, count, 1 + 8 + 8)) {
+    return;
+  }
+
+  GcMap* table = create_map(h);
+  add_const_chunk(h, c, create_obj(table));
+  for (uint32_t i = 0; i < count && !l->failed; i++) {
+    Val key;
+    switch (load_u8(l)) {
+      case const_num:
+        key = create_num(load_num(l));
+        break;
+      case const_str: {
+        GcStr* str = load_str(l, load_u32(l));
+        if (str == NULL) {
+          return;
+        }
+        key = create_obj(str);
+        break;
+      }
+      default:
+        l->failed = true;
+        return;
+    }
+
+    push(h, key);
+    set_map(h, table, key, create_num(load_num(l)));
+    pop(h);
+  }
+}
+
+static bool is_const(Chunk* c, int index) {
+  return index < c->consts.len;
+}
+
+static bool is_name(Chunk* c, int index) {
+  return index < c->consts.len && is_str(c->consts.items[index]);
+}
+
+static bool is_num_const(Chunk* c, int index) {
+  return index < c->consts.len && is_num(c->consts.items[index]);
+}
+
+static int short_at(Chunk* c, int index) {
+  return (c->code[index] << 8) | c->code[index + 1];
+}
+
+// Whether every operand of the code indexes something that exists, since the
+// VM doesn't check them. The layout of the code must already be valid
+static bool check_operands(GcFn* fn) {
+  Chunk* c = &fn->chunk;
+  for (int i = 0; i < c->len; i += bc_len(c, i)) {
+    uint8_t* code = &c->code[i];
+    bool ok = true;
+    switch (code[0]) {
+      case bc_get_global:
+        ok = short_at(c, i + 1) < c->globalc;
+        break;
+      case bc_get_local:
+      case bc_set_local:
+        ok = code[1] < fn->slots;
+        break;
+      case bc_get_local_long:
+      case bc_set_local_long:
+        ok = short_at(c, i + 1) < fn->slots;
+        break;
+      case bc_get_upval:
+      case bc_set_upval:
+        ok = code[1] < fn->upvalc;
+        break;
+      case bc_push_prop:
+      case bc_get_prop:
+      case bc_set_prop:
+        ok = is_name(c, short_at(c, i + 1)) && short_at(c, i + 3) < c->cachec;
+        break;
+      case bc_invoke:
+      case bc_tail_invoke:
+      case bc_invoke_len:
+        ok = is_name(c, short_at(c, i + 1)) && short_at(c, i + 4) < c->cachec;
+        break;
+      case bc_get_static:
+      case bc_init_prop:
+      case bc_struct:
+      case bc_method:
+      case bc_def_static:
+      case bc_member:
+      case bc_err:
+        ok = is_name(c, short_at(c, i + 1));
+        break;
+      case bc_intrinsic:
+        ok = is_name(c, short_at(c, i + 2));
+        break;
+      case bc_enum:
+        // The enum's name, then a count of member names
+        ok = is_name(c, short_at(c, i + 1));
+        for (int j = 0; j < code[3] && ok; j++) {
+          ok = is_name(c, short_at(c, i + 4 + j * 2));
+        }
+        break;
+      case bc_const:
+        ok = is_const(c, code[1]);
+        break;
+      case bc_const_long:
+        ok = is_const(c, (code[1] << 16) | short_at(c, i + 2));
+        break;
+      case bc_for_prep:
+      case bc_for_loop:
+        ok = code[1] < fn->slots && (code[3] & for_const_limit
+          ? is_num_const(c, code[2])
+          : code[2] < fn->slots);
+        if (code[0] == bc_for_loop) {
+          ok = ok && is_num_const(c, code[4]);
+        }
+        break;
+      case bc_closure: {
+        // The top bit of each upvalue is set for locals
+        GcFn* inner = as_fn(c->consts.items[short_at(c, i + 1)]);
+        for (int j = 0; j < inner->upvalc && ok; j++) {
+          int index = short_at(c, i + 3 + j * 2);
+          ok = index & 0x8000
+            ? (index & 0x7FFF) < fn->slots
+            : index < fn->upvalc;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static GcFn* load_chunk_fn(Loader* l) {
+  hby_State* h = l->h;
+  GcFn* fn = create_fn(h, l->path);
+  push(h, create_obj(fn));
+
+  fn->arity = load_u32(l);
+  fn->variadic = load_u8(l);
+  fn->upvalc = load_u32(l);
+  if (fn->upvalc > uint8_count) {
+    l->failed = true;
+    return NULL;
+  }
+
+  uint32_t name_len = load_u32(l);
+  if (name_len != no_name) {
+    fn->name = load_str(l, name_len);
+    if (fn->name != NULL) {
+      gc_barrier(h, &fn->obj, create_obj(fn->name));
+    }
+  }
+
+  Chunk* c = &fn->chunk;
+  uint32_t len = load_u32(l);
+  if (len == 0 || !fits(l, len, 1)) {
+    l->failed = true;
+    return NULL;
+  }
+
+  c->code = allocate(h, uint8_t, len);
+  c->cap = len;
+  c->len = len;
+  memcpy(c->code, load_bytes(l, len), len);
+
+  uint32_t runc = load_u32(l);
+  uint32_t filled = 0;
+  if (!fits(l, runc, 4 + 4)) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < runc; i++) {
+    uint32_t count = load_u32(l);
+    int line = load_u32(l);
+    if (count > len - filled) {
+      l->failed = true;
+      return NULL;
+    }
+    add_line_chunk(h, c, filled, line);
+    filled += count;
+  }
+  trim_chunk(h, c);
+  if (filled != len) {
+    l->failed = true;
+    return NULL;
+  }
+
+  // Caches are rebuilt empty, see `write_cache` for the limit
+  uint32_t cachec = load_u32(l);
+  if (l->failed || cachec > UINT16_MAX + 1) {
+    l->failed = true;
+    return NULL;
+  }
+  for (uint32_t i = 0; i < cachec; i++) {
+    add_cache_chunk(h, c);
+  }
+
+  uint32_t globalc = load_u32(l);
+  if (!fits(l, globalc, 4)) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < globalc; i++) {
+    GcStr* name = load_str(l, load_u32(l));
+    if (name == NULL) {
+      return NULL;
+    }
+
+    push(h, create_obj(name));
+    if (add_global_chunk(h, c, find_global(h, name)) != (int)i) {
+      l->failed = true; // Each name should only be in the table once
+    }
+    pop(h);
+  }
+
+  uint32_t constc = load_u32(l);
+  if (!fits(l, constc, 1 + 4)) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < constc && !l->failed; i++) {
+    switch (load_u8(l)) {
+      case const_num:
+        add_const_chunk(h, c, create_num(load_num(l)));
+        break;
+      case const_str: {
+        GcStr* str = load_str(l, load_u32(l));
+        if (str != NULL) {
+          add_const_chunk(h, c, create_obj(str));
+        }
+        break;
+      }
+      case const_table:
+        load_table(l, c);
+        break;
+      case const_fn: {
+        GcFn* inner = load_chunk_fn(l);
+        if (inner != NULL) {
+          add_const_chunk(h, c, create_obj(inner));
+        }
+        break;
+      }
+      default:
+        l->failed = true;
+        break;
+    }
+  }
+
+  if (l->failed) {
+    return NULL;
+  }
+
+  // Also rejects code that would run off the chunk or the stack
+  fn->slots = max_stack_chunk(h, c, 1 + fn->arity + fn->variadic);
+  if (fn->slots == -1 || !check_operands(fn)) {
+    l->failed = true;
+    return NULL;
+  }
+  fuse_chunk(c);
+
+  pop(h);
+  return fn;
+}
+
+GcFn* load_fn(hby_State* h, const char* path, const char* data, size_t len) {
+  Loader l;
+  l.h = h;
+  l.data = (const uint8_t*)data;
+  l.len = len;
+  l.pos = 0;
+  l.failed = false;
+
+  const uint8_t* magic = load_bytes(&l, dump_magic_len);
+  if (magic == NULL || memcmp(magic, dump_magic, dump_magic_len) != 0
+      || load_u8(&l) != dump_version || load_u8(&l) != bc_break + 1) {
+    return NULL;
+  }
+
+  Val* top = h->top;
+  l.path = copy_str(h, path, strlen(path));
+  push(h, create_obj(l.path));
+
+  // The script has nothing to capture
+  GcFn* fn = load_chunk_fn(&l);
+  if (fn != NULL && (l.pos != l.len || fn->upvalc != 0)) {
+    fn = NULL;
+  }
+
+  // A failed load leaves its partial functions on the stack
+  h->top = top;
+  return fn;
+}
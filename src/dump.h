@@ -0,0 +1,19 @@
+#ifndef __HBY_DUMP_H
+#define __HBY_DUMP_H
+
+#include "common.h"
+#include "obj.h"
+#include "state.h"
+#include "tostr.h"
+
+// Bump whenever the bytecode or the dump layout changes, so that stale
+// caches are rejected instead of run
+#define dump_version 10
+
+// Serialize `fn` and every function nested in it into `buf`
+void dump_fn(hby_State* h, GcFn* fn, StrBuf* buf);
+// Rebuild a function serialized by `dump_fn`. Returns NULL if the data is
+// malformed or from another version
+GcFn* load_fn(hby_State* h, const char* path, const char* data, size_t len);
+
+#endif // __HBY_DUMP_H
@@ -17,6 +17,7 @@
 #define err_msg_bad_sub_set \
   "subscript assignment is not supported for that value"
 #define err_msg_bad_inst "cannot instance that value"
+#define err_msg_bad_iter "cannot iterate over that value"
 #define err_msg_undef_prop "undefined property '%s'"
 #define err_msg_undef_map_key "key '%s' is not defined on map"
 #define err_msg_undef_static_prop "undefined static property '%s'"
@@ -29,6 +30,13 @@
   "expected type '" type "' to be returned from '" callback "'"
 #define err_msg_unhandled_case "unhandled value in switch statement"
 #define err_msg_unreachable_reached "reached code marked as unreachable"
+#define err_msg_fiber_done "cannot resume a finished fiber"
+#define err_msg_fiber_running "cannot resume a fiber that is already running"
+#define err_msg_fiber_resume_argc \
+  "a started fiber can only be resumed with 0 or 1 values"
+#define err_msg_yield_argc "can only yield 0 or 1 values"
+#define err_msg_yield_main "cannot yield outside of a fiber"
+#define err_msg_yield_c "cannot yield across a call from C"
 
 // C API
 #define err_msg_invalid_stack_access "invalid stack access of slot %d (C API)"
@@ -38,7 +46,14 @@
   "internal value type which should not be accessible. report this error (C API)"
 #define err_msg_expected_type(fn, type, param) \
   "'" fn "()' expected type '" type "' for parameter '" param "' (C API)"
+#define err_msg_invalid_global_slot "invalid global slot %d (C API)"
 #define err_msg_expected_variadic "expected variadic function for 'pcall'"
+#define err_msg_dump_upvals \
+  "cannot dump a function that captures variables (C API)"
+#define err_msg_bad_dump "'%s' is not bytecode for this version"
+#define err_msg_write_cache "could not write '%s'"
+#define err_msg_budget_running "a budgeted call is already running (C API)"
+#define err_msg_not_suspended "there is no suspended call to resume (C API)"
 
 // STD
 #define err_msg_expect_arg_range(s, e) "expected " s "-" e "arguments"
@@ -70,9 +85,12 @@
   type " declaration must not be declared in a scope"
 #define err_msg_bad_else_case "'else' case must be the last case in a switch"
 #define err_msg_max_consts "too many constants in one chunk"
+#define err_msg_max_caches "too many property accesses in one chunk"
+#define err_msg_max_globals "too many global variables in one chunk"
 #define err_msg_max_locals "too many local variables in one chunk"
 #define err_msg_max_upvals "too many upvalues in one function"
 #define err_msg_max_breaks "too many break statements in one loop"
+#define err_msg_max_continues "too many continue statements in one loop"
 #define err_msg_max_cases "too many cases in one switch"
 #define err_msg_max_enum "too many values in one enum"
 #define err_msg_max_strfmt "too many nested formatted strings"
@@ -3,13 +3,17 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "vm.h"
+#include "dump.h"
+#include "lib.h"
 #include "state.h"
 #include "parser.h"
 #include "val.h"
 #include "obj.h"
 #include "tostr.h"
 #include "map.h"
+#include "mem.h"
 
 static Val val_at(hby_State* h, int index) {
   if (index == hby_registry_index) {
@@ -108,7 +112,86 @@ void hby_expect_type(hby_State* h, int index, hby_ValueType expect) {
   }
 }
 
+static void push_file_err(hby_State* h, const char* fmt, const char* path) {
+  int len = snprintf(NULL, 0, fmt, path);
+  char* msg = (char*)malloc(len + 1);
+  snprintf(msg, len + 1, fmt, path);
+  hby_push_lstr(h, msg, len);
+}
+
+// `name.hby` is cached as `name.hbc`, anything else gets `.hbc` appended
+static char* cache_path(const char* file_path) {
+  size_t len = strlen(file_path);
+  if (len >= 4 && strcmp(file_path + len - 4, ".hby") == 0) {
+    len -= 4;
+  }
+
+  char* path = (char*)malloc(len + 5);
+  memcpy(path, file_path, len);
+  memcpy(path + len, ".hbc", 5);
+  return path;
+}
+
+// A cache starts with the modification time and size of its source
+typedef struct {
+  int64_t mtime;
+  int64_t size;
+} SrcStamp;
+
+static bool stamp_src(const char* file_path, SrcStamp* stamp) {
+  struct stat st;
+  if (stat(file_path, &st) != 0) {
+    return false;
+  }
+
+  memset(stamp, 0, sizeof(*stamp));
+  stamp->mtime = (int64_t)st.st_mtime;
+  stamp->size = (int64_t)st.st_size;
+  return true;
+}
+
+static bool load_cache(hby_State* h, const char* file_path) {
+  SrcStamp stamp;
+  if (!stamp_src(file_path, &stamp)) {
+    return false;
+  }
+
+  char* path = cache_path(file_path);
+  FILE* file = fopen(path, "rb");
+  free(path);
+  if (file == NULL) {
+    return false;
+  }
+
+  fseek(file, 0L, SEEK_END);
+  long file_size = ftell(file);
+  rewind(file);
+
+  char* buf = NULL;
+  bool ok = file_size > (long)sizeof(stamp);
+  if (ok) {
+    buf = (char*)malloc(file_size);
+    ok = buf != NULL && fread(buf, 1, file_size, file) == (size_t)file_size
+      && memcmp(buf, &stamp, sizeof(stamp)) == 0;
+  }
+  fclose(file);
+
+  // A stale or broken cache is just ignored
+  if (ok && hby_load(
+      h, file_path, buf + sizeof(stamp), file_size - sizeof(stamp)) > 0) {
+    hby_pop(h, 1);
+    ok = false;
+  }
+
+  free(buf);
+  return ok;
+}
+
 int hby_compile_file(hby_State* h, const char* file_path) {
+  if (load_cache(h, file_path)) {
+    return 0;
+  }
+
   char* src = read_file(file_path);
   int errc = hby_compile(h, file_path, src);
   free(src);
@@ -127,6 +210,74 @@ int hby_compile(hby_State* h, const char* name, const char* src) {
   return 0;
 }
 
+int hby_cache_file(hby_State* h, const char* file_path) {
+  char* src = read_file(file_path);
+  int errc = hby_compile(h, file_path, src);
+  free(src);
+  if (errc > 0) {
+    return errc;
+  }
+
+  SrcStamp stamp;
+  char* path = cache_path(file_path);
+  FILE* file = NULL;
+  if (stamp_src(file_path, &stamp)) {
+    file = fopen(path, "wb");
+  }
+
+  if (file == NULL) {
+    hby_pop(h, 1);
+    push_file_err(h, err_msg_write_cache, path);
+    free(path);
+    return 1;
+  }
+  free(path);
+
+  hby_dump(h, -1);
+  size_t len;
+  const char* data = hby_get_str(h, -1, &len);
+  fwrite(&stamp, sizeof(stamp), 1, file);
+  fwrite(data, 1, len, file);
+  fclose(file);
+  hby_pop(h, 1);
+  return 0;
+}
+
+void hby_dump(hby_State* h, int index) {
+  Val val = val_at(h, index);
+  if (!is_closure(val)) {
+    hby_err(
+      h, "expected '%s', got '%s'",
+      hby_get_type_name(hby_type_function, NULL),
+      hby_get_type_name(hby_get_type(h, index), NULL));
+  }
+
+  GcFn* fn = as_closure(val)->fn;
+  if (fn->upvalc > 0) {
+    hby_err(h, err_msg_dump_upvals);
+  }
+
+  StrBuf buf;
+  init_strbuf(&buf);
+  dump_fn(h, fn, &buf);
+  push(h, create_obj(build_strbuf(h, &buf)));
+  free_strbuf(h, &buf);
+}
+
+int hby_load(hby_State* h, const char* name, const char* data, size_t len) {
+  GcFn* fn = load_fn(h, name, data, len);
+  if (fn == NULL) {
+    push_file_err(h, err_msg_bad_dump, name);
+    return 1;
+  }
+
+  push(h, create_obj(fn));
+  GcClosure* closure = create_closure(h, fn);
+  pop(h);
+  push(h, create_obj(closure));
+  return 0;
+}
+
 void hby_pop(hby_State* h, int c) {
   h->top -= c;
 }
@@ -140,22 +291,54 @@ void hby_set_global(hby_State* h, const char* name, int index) {
 
   GcStr* sname = get_name_or(h, val, name);
   push(h, create_obj(sname));
-  set_table(h, &h->globals, sname, val);
+  int slot = find_global(h, sname);
+  Global* global = &h->globals[slot];
+  global->val = val;
+  global->defined = true;
   pop(h);
 }
 
 bool hby_get_global(hby_State* h, const char* name) {
-  Val val;
-  if (get_table(&h->globals, copy_str(h, name, strlen(name)), &val)) {
-    push(h, val);
-    return true;
+  Val slot;
+  GcStr* sname = copy_str(h, name, strlen(name));
+  if (get_table(&h->global_slots, sname, &slot)) {
+    return hby_get_global_slot(h, (int)as_num(slot));
   }
   return false;
 }
 
-hby_ValueType hby_get_type(hby_State* h, int index) {
-  Val val = val_at(h, index);
+int hby_find_global(hby_State* h, const char* name) {
+  GcStr* sname = copy_str(h, name, strlen(name));
+  push(h, create_obj(sname));
+  int slot = find_global(h, sname);
+  pop(h);
+  return slot;
+}
 
+static Global* global_at(hby_State* h, int slot) {
+  if (slot < 0 || slot >= h->globalc) {
+    hby_err(h, err_msg_invalid_global_slot, slot);
+  }
+  return &h->globals[slot];
+}
+
+bool hby_get_global_slot(hby_State* h, int slot) {
+  Global* global = global_at(h, slot);
+  if (!global->defined) {
+    return false;
+  }
+
+  push(h, global->val);
+  return true;
+}
+
+void hby_set_global_slot(hby_State* h, int slot, int index) {
+  Global* global = global_at(h, slot);
+  global->val = val_at(h, index);
+  global->defined = true;
+}
+
+static hby_ValueType val_type(hby_State* h, Val val) {
   if (is_num(val)) {
     return hby_type_number;
   } else if (is_bool(val)) {
@@ -174,6 +357,7 @@ hby_ValueType hby_get_type(hby_State* h, int index) {
       case obj_udata: return hby_type_udata;
       case obj_arr: return hby_type_array;
       case obj_map: return hby_type_map;
+      case obj_fiber: return hby_type_fiber;
       default: break;
     }
   }
@@ -182,6 +366,17 @@ hby_ValueType hby_get_type(hby_State* h, int index) {
   return 0;
 }
 
+hby_ValueType hby_get_type(hby_State* h, int index) {
+  return val_type(h, val_at(h, index));
+}
+
+void fast_arg_err(hby_State* h, Val val, hby_ValueType expect) {
+  hby_err(
+    h, "expected '%s', got '%s'",
+    hby_get_type_name(expect, NULL),
+    hby_get_type_name(val_type(h, val), NULL));
+}
+
 
 bool hby_has_prop(hby_State* h, const char* name, int index) {
   Val val = val_at(h, index);
@@ -192,7 +387,7 @@ bool hby_has_prop(hby_State* h, const char* name, int index) {
       case obj_inst: {
         GcInst* inst = as_inst(val);
         Val val;
-        if (get_table(&inst->fields, str_name, &val)) {
+        if (get_field(inst, str_name, &val)) {
           return true;
         }
         if (get_table(&inst->_struct->methods, str_name, &val)) {
@@ -224,7 +419,7 @@ bool hby_get_prop(hby_State* h, const char* name, int index) {
       case obj_inst: {
         GcInst* inst = as_inst(val);
         Val val;
-        if (get_table(&inst->fields, str_name, &val)) {
+        if (get_field(inst, str_name, &val)) {
           push(h, val);
           return true;
         }
@@ -441,6 +636,9 @@ const char* hby_get_type_name(hby_ValueType type, size_t* len_out) {
     case hby_type_array:
       *len_out = 5;
       return "array";
+    case hby_type_fiber:
+      *len_out = 5;
+      return "fiber";
     default: break;
   }
 
@@ -477,8 +675,7 @@ void hby_call(hby_State* h, int argc) {
   vm_call(h, h->top[-1 - argc], argc);
 }
 
-bool hby_pcall(hby_State* h, int callback, int argc) {
-  GcAnyFn fn;
+static bool get_callback(hby_State* h, int callback, GcAnyFn* fn) {
   switch (hby_get_type(h, callback)) {
     case hby_type_function: {
       GcClosure* closure = as_closure(val_at(h, callback));
@@ -486,17 +683,36 @@ bool hby_pcall(hby_State* h, int callback, int argc) {
         hby_err(h, err_msg_expected_variadic);
         return false;
       }
-      fn.hby = closure;
-      break;
+      fn->hby = closure;
+      return true;
     }
-    case hby_type_cfunction: fn.c = as_c_fn(val_at(h, callback)); break;
+    case hby_type_cfunction: fn->c = as_c_fn(val_at(h, callback)); return true;
     default:
       hby_err(h, err_msg_expected_type("pcall", "function", "callback"));
       return false;
   }
+}
+
+bool hby_pcall(hby_State* h, int callback, int argc) {
+  GcAnyFn fn;
+  if (!get_callback(h, callback, &fn)) {
+    return false;
+  }
   return vm_pcall(h, fn, h->top[-1 - argc], argc) == hby_res_ok;
 }
 
+hby_Res hby_pcall_budget(hby_State* h, int callback, int argc, int budget) {
+  GcAnyFn fn;
+  if (!get_callback(h, callback, &fn)) {
+    return hby_res_runtime_err;
+  }
+  return vm_pcall_budget(h, fn, h->top[-1 - argc], argc, budget);
+}
+
+hby_Res hby_resume(hby_State* h, int budget) {
+  return vm_resume_budget(h, budget);
+}
+
 void hby_callon(hby_State* h, const char* mname, int argc) {
   vm_invoke(h, copy_str(h, mname, strlen(mname)), argc);
 }
@@ -550,6 +766,7 @@ void hby_struct_add_member(hby_State* h, hby_MethodType type, int index) {
     }
     case hby_method: {
       set_table(h, &s->methods, cfn->name, create_obj(cfn));
+      reshape_struct(h, s);
       break;
     }
   }
@@ -569,12 +786,25 @@ void hby_struct_add_members(hby_State* h, hby_StructMethod* members, int index)
   }
 }
 
+void add_fast_members(hby_State* h, FastMethod* members, int index) {
+  if (index < 0) {
+    index--;
+  }
+
+  for (FastMethod* method = members; method->name != NULL; method++) {
+    hby_push_cfunc(h, method->name, NULL, method->argc);
+    as_c_fn(*(h->top - 1))->fast = method->fn;
+    hby_struct_add_member(h, method->mtype, index);
+  }
+}
+
 void hby_udata_set_metastruct(hby_State* h, int index) {
   hby_expect_udata(h, index);
   hby_expect_struct(h, -1);
 
   GcUData* u = as_udata(val_at(h, index));
   u->metastruct = as_struct(pop(h));
+  gc_barrier(h, &u->obj, create_obj(u->metastruct));
 }
 
 void hby_udata_set_finalizer(hby_State* h, hby_CFn fn) {
@@ -583,6 +813,7 @@ void hby_udata_set_finalizer(hby_State* h, hby_CFn fn) {
 
   hby_push_cfunc(h, "gc", fn, 1);
   u->finalizer = as_c_fn(val_at(h, -1));
+  gc_barrier(h, &u->obj, create_obj(u->finalizer));
   pop(h);
 }
 
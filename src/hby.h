@@ -26,6 +26,7 @@ typedef enum {
   hby_res_ok = 0,
   hby_res_runtime_err,
   hby_res_compile_err,
+  hby_res_suspended, // Ran out of budget, see `hby_pcall_budget`
 } hby_Res;
 
 // Represents the various types in Hobbyscript
@@ -42,6 +43,7 @@ typedef enum {
   hby_type_array,
   hby_type_map,
   hby_type_udata,
+  hby_type_fiber,
   hby_type_count, // How many types there are
 } hby_ValueType;
 
@@ -63,17 +65,59 @@ typedef struct {
   int argc;
 } hby_CFnArgs;
 
+// Percentiles of the garbage collector's pause times, in microseconds
+typedef struct {
+  size_t count;
+  double p50;
+  double p90;
+  double p99;
+  double max;
+} hby_GcPauses;
+
+// State of the allocator for small objects
+typedef struct {
+  size_t pages; // Pages currently held
+  size_t page_size; // Bytes per page
+  size_t used_cells; // Cells holding objects
+  size_t free_cells; // Cells in held pages, ready to be reused
+  size_t released_pages; // Pages given back to the system so far
+} hby_AllocStats;
+
 // Create a Hobbyscript state
 hby_api hby_State* hby_create_state();
 // Free a Hobbyscript state
 hby_api void hby_free_state(hby_State* h);
 
+// Spend at most about `budget_us` microseconds collecting garbage, for example
+// in idle frame time. Returns true if a full collection cycle finished
+hby_api bool hby_gc_step(hby_State* h, int budget_us);
+// Get the percentiles of all garbage collector pauses so far
+hby_api void hby_gc_pauses(hby_State* h, hby_GcPauses* out);
+// Get the statistics of the small object allocator
+hby_api void hby_alloc_stats(hby_State* h, hby_AllocStats* out);
+// Choose whether empty pages are given back to the system. On by default
+hby_api void hby_release_pages(hby_State* h, bool release);
+
+// Limit how deeply calls can nest and how many values the stack can hold.
+// Going past either raises a stack overflow error
+hby_api void hby_stack_limits(hby_State* h, int max_frames, int max_slots);
+// Make sure `slots` more values can be pushed. C functions start out with
+// room for at least 20
+hby_api void hby_reserve(hby_State* h, int slots);
+
 // Set the CLI arguments
 hby_api void hby_cli_args(hby_State* h, int argc, const char** args);
 // Compile a file
 hby_api int hby_compile_file(hby_State* h, const char* file_path);
 // Compile a string
 hby_api int hby_compile(hby_State* h, const char* name, const char* src);
+// Compile a file and save its bytecode next to it as `.hbc`. Later calls to
+// `hby_compile_file` load that instead, as long as the source hasn't changed
+hby_api int hby_cache_file(hby_State* h, const char* file_path);
+// Push the bytecode of the function at `index` as a string
+hby_api void hby_dump(hby_State* h, int index);
+// Load bytecode made by `hby_dump`. Works like `hby_compile`
+hby_api int hby_load(hby_State* h, const char* name, const char* data, size_t len);
 
 // Throw an error
 hby_api void hby_err(hby_State* h, const char* fmt, ...);
@@ -89,6 +133,15 @@ hby_api void hby_set_global(hby_State* h, const char* name, int index);
 // Push the global variable `name` to the top of the stack
 // Returns false if the variable does not exist
 hby_api bool hby_get_global(hby_State* h, const char* name);
+// Get the slot of the global variable `name`, which can be used to read and
+// write it without looking up the name every time. The global doesn't need to
+// be set yet
+hby_api int hby_find_global(hby_State* h, const char* name);
+// Push the global variable in `slot` to the top of the stack
+// Returns false if the variable has not been set
+hby_api bool hby_get_global_slot(hby_State* h, int slot);
+// Set the global variable in `slot` to the value at `index`
+hby_api void hby_set_global_slot(hby_State* h, int slot, int index);
 // Get the type of the value at `index`
 hby_api hby_ValueType hby_get_type(hby_State* h, int index);
 
@@ -165,6 +218,12 @@ hby_api void hby_push_typestruct(hby_State* h, int index);
 hby_api void hby_call(hby_State* h, int argc);
 // Call a protected function
 hby_api bool hby_pcall(hby_State* h, int callback, int argc);
+// Call a protected function, suspending it once it made `budget` calls and
+// loop iterations. While it's suspended, the state can only be resumed
+hby_api hby_Res hby_pcall_budget(
+  hby_State* h, int callback, int argc, int budget);
+// Continue a suspended call with a new budget
+hby_api hby_Res hby_resume(hby_State* h, int budget);
 // Call a protected C function
 hby_api void hby_pccall(hby_State* h, hby_CFn fn, int argc); // TODO
 // Call a method on a value
@@ -209,6 +268,7 @@ hby_api void hby_add_enum(hby_State* h, const char* name, int index);
 #define hby_is_udata(h, index)        (hby_get_type(h, index) == hby_type_udata)
 #define hby_is_array(h, index)        (hby_get_type(h, index) == hby_type_array)
 #define hby_is_map(h, index)          (hby_get_type(h, index) == hby_type_map)
+#define hby_is_fiber(h, index)        (hby_get_type(h, index) == hby_type_fiber)
 
 #define hby_expect_num(h, index)       hby_expect_type(h, index, hby_type_number);
 #define hby_expect_bool(h, index)      hby_expect_type(h, index, hby_type_bool);
@@ -222,6 +282,7 @@ hby_api void hby_add_enum(hby_State* h, const char* name, int index);
 #define hby_expect_udata(h, index)     hby_expect_type(h, index, hby_type_udata);
 #define hby_expect_array(h, index)     hby_expect_type(h, index, hby_type_array);
 #define hby_expect_map(h, index)       hby_expect_type(h, index, hby_type_map);
+#define hby_expect_fiber(h, index)     hby_expect_type(h, index, hby_type_fiber);
 
 #ifdef __cplusplus
 }
@@ -249,6 +249,7 @@ static TokType get_keyword(Lexer* l) {
       if (l->cur - l->start > 1) {
         switch (l->start[1]) {
           case 'f': return check_keyword(l, 2, 0, "", tok_if);
+          case 'n': return check_keyword(l, 2, 0, "", tok_in);
           case 's': return check_keyword(l, 2, 0, "", tok_is);
         }
       }
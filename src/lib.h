@@ -3,11 +3,34 @@
 
 #include <stdbool.h>
 #include "hby.h"
+#include "obj.h"
+#include "val.h"
+
+// A member of a struct that is a fast native, see `FastCFn`
+typedef struct {
+  const char* name;
+  FastCFn fn;
+  int argc;
+  hby_MethodType mtype;
+} FastMethod;
+
+// Like `hby_struct_add_members`, for fast natives
+void add_fast_members(hby_State* h, FastMethod* members, int index);
+// Raise the error `hby_expect_type` would for an argument of a fast native
+void fast_arg_err(hby_State* h, Val val, hby_ValueType expect);
+
+static inline double fast_num(hby_State* h, const Val* args, int i) {
+  if (!is_num(args[i])) {
+    fast_arg_err(h, args[i], hby_type_number);
+  }
+  return as_num(args[i]);
+}
 
 bool open_arr(hby_State* h, int argc);
 bool open_map(hby_State* h, int argc);
 bool open_core(hby_State* h, int argc);
 bool open_ease(hby_State* h, int argc);
+bool open_fiber(hby_State* h, int argc);
 bool open_io(hby_State* h, int argc);
 bool open_math(hby_State* h, int argc);
 bool open_rng(hby_State* h, int argc);
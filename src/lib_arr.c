@@ -97,40 +97,17 @@ static bool arr_find(hby_State* h, int argc) {
   return true;
 }
 
-static int find_next_pow(int i) {
-  i--;
-  i |= i >> 1;
-  i |= i >> 2;
-  i |= i >> 4;
-  i |= i >> 8;
-  i |= i >> 16;
-  i++;
-
-  return i;
-}
-
 static bool arr_join(hby_State* h, int argc) {
   GcArr* arr = self(h);
 
-  int cap = 8;
-  int len = 0;
-  char* chars = allocate(h, char, cap);
-
+  StrBuf buf;
+  init_strbuf(&buf);
   for (int i = 0; i < arr->varr.len; i++) {
-    GcStr* str = to_str(h, arr->varr.items[i]);
-    if (len + str->len > cap) {
-      int pcap = cap;
-      cap = find_next_pow(len + str->len);
-      chars = grow_arr(h, char, chars, pcap, cap);
-    }
-
-    memcpy(chars + len, str->chars, str->len);
-    len += str->len;
+    append_val_strbuf(h, &buf, arr->varr.items[i]);
   }
 
-  chars = grow_arr(h, char, chars, cap, len + 1);
-  chars[len] = '\0';
-  hby_push_lstr(h, chars, len);
+  push(h, create_obj(build_strbuf(h, &buf)));
+  free_strbuf(h, &buf);
   return true;
 }
 
@@ -82,6 +82,7 @@ static bool core_pcall(hby_State* h, int argc) {
       hby_get_type_name(type, NULL));
   }
 
+  hby_reserve(h, argc);
   hby_push(h, 2);
   for (int i = 3; i <= argc; i++) {
     hby_push(h, i);
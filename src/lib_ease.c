@@ -4,25 +4,22 @@
 
 #define pi 3.14159265358979323846264338327950288419716939937510
 
-static bool ease_sine_in(hby_State* h, int argc) {
-  double x = hby_get_num(h, 1);
-  hby_push_num(h, 1 - cos((x * pi) / 2));
-  return true;
+static Val ease_sine_in(hby_State* h, const Val* args, int argc) {
+  double x = fast_num(h, args, 0);
+  return create_num(1 - cos((x * pi) / 2));
 }
 
-static bool ease_sine_out(hby_State* h, int argc) {
-  double x = hby_get_num(h, 1);
-  hby_push_num(h, sin((x * pi) / 2));
-  return true;
+static Val ease_sine_out(hby_State* h, const Val* args, int argc) {
+  double x = fast_num(h, args, 0);
+  return create_num(sin((x * pi) / 2));
 }
 
-static bool ease_sine_inout(hby_State* h, int argc) {
-  double x = hby_get_num(h, 1);
-  hby_push_num(h, -(cos(pi * x) - 1) / 2);
-  return true;
+static Val ease_sine_inout(hby_State* h, const Val* args, int argc) {
+  double x = fast_num(h, args, 0);
+  return create_num(-(cos(pi * x) - 1) / 2);
 }
 
-hby_StructMethod ease_mod[] = {
+FastMethod ease_mod[] = {
   {"sine_in", ease_sine_in, 1, hby_static_fn},
   {"sine_out", ease_sine_out, 1, hby_static_fn},
   {"sine_inout", ease_sine_inout, 1, hby_static_fn},
@@ -31,7 +28,7 @@ hby_StructMethod ease_mod[] = {
 
 bool open_ease(hby_State* h, int argc) {
   hby_push_struct(h, "ease");
-  hby_struct_add_members(h, ease_mod, -1);
+  add_fast_members(h, ease_mod, -1);
   hby_set_global(h, NULL, -1);
   hby_pop(h, 2);
 
@@ -0,0 +1,88 @@
+#include "lib.h"
+
+#include "errmsg.h"
+#include "hby.h"
+#include "obj.h"
+#include "state.h"
+#include "vm.h"
+
+static GcFiber* self(hby_State* h) {
+  return as_fiber(*(h->frame->base));
+}
+
+static bool fiber_new(hby_State* h, int argc) {
+  hby_ValueType type = hby_get_type(h, 1);
+  if (type != hby_type_function && type != hby_type_cfunction) {
+    hby_err(
+      h, err_msg_expect_2types,
+      hby_get_type_name(hby_type_function, NULL),
+      hby_get_type_name(hby_type_cfunction, NULL),
+      hby_get_type_name(type, NULL));
+  }
+
+  push(h, create_obj(create_fiber(h, h->frame->base[1])));
+  return true;
+}
+
+static bool fiber_yield(hby_State* h, int argc) {
+  if (argc > 1) {
+    hby_err(h, err_msg_yield_argc);
+  }
+
+  vm_yield(h);
+  if (argc == 0) {
+    return false;
+  }
+  hby_push(h, 1);
+  return true;
+}
+
+static bool fiber_resume(hby_State* h, int argc) {
+  GcFiber* fiber = self(h);
+  switch (fiber->status) {
+    case fiber_suspended: break;
+    case fiber_done: hby_err(h, err_msg_fiber_done); break;
+    default: hby_err(h, err_msg_fiber_running); break;
+  }
+
+  // Only the first resume has a function to pass more values to
+  if (is_null(fiber->fn) && argc > 1) {
+    hby_err(h, err_msg_fiber_resume_argc);
+  }
+
+  vm_resume(h, fiber, argc);
+  return true;
+}
+
+static bool fiber_status(hby_State* h, int argc) {
+  switch (self(h)->status) {
+    case fiber_suspended: hby_push_strcpy(h, "suspended"); break;
+    case fiber_running: hby_push_strcpy(h, "running"); break;
+    case fiber_normal: hby_push_strcpy(h, "normal"); break;
+    case fiber_done: hby_push_strcpy(h, "done"); break;
+  }
+  return true;
+}
+
+static bool fiber_is_done(hby_State* h, int argc) {
+  hby_push_bool(h, self(h)->status == fiber_done);
+  return true;
+}
+
+hby_StructMethod fiber_methods[] = {
+  {"new", fiber_new, 1, hby_static_fn},
+  {"yield", fiber_yield, -1, hby_static_fn},
+  {"resume", fiber_resume, -1, hby_method},
+  {"status", fiber_status, 0, hby_method},
+  {"done", fiber_is_done, 0, hby_method},
+  {NULL, NULL, 0, 0},
+};
+
+bool open_fiber(hby_State* h, int argc) {
+  hby_push_struct(h, "Fiber");
+  h->fiber_struct = as_struct(*(h->top - 1));
+  hby_struct_add_members(h, fiber_methods, -1);
+  hby_set_global(h, NULL, -1);
+
+  return false;
+}
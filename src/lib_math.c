@@ -1,5 +1,7 @@
 #include "hby.h"
 #include <math.h>
+#include "lib.h"
+#include "state.h"
 
 #define pi      3.14159265358979323846264338327950288419716939937510
 #define tau     (pi * 2)
@@ -9,145 +11,119 @@
 #define deg2rad (180 / pi)
 #define rad2deg (pi / 180)
 
-bool math_abs(hby_State* h, int argc) {
-  hby_push_num(h, fabs(hby_get_num(h, 1)));
-  return true;
+Val math_abs(hby_State* h, const Val* args, int argc) {
+  return create_num(fabs(fast_num(h, args, 0)));
 }
 
-bool math_acos(hby_State* h, int argc) {
-  hby_push_num(h, acos(hby_get_num(h, 1)));
-  return true;
+Val math_acos(hby_State* h, const Val* args, int argc) {
+  return create_num(acos(fast_num(h, args, 0)));
 }
 
-bool math_asin(hby_State* h, int argc) {
-  hby_push_num(h, asin(hby_get_num(h, 1)));
-  return true;
+Val math_asin(hby_State* h, const Val* args, int argc) {
+  return create_num(asin(fast_num(h, args, 0)));
 }
 
-bool math_atan(hby_State* h, int argc) {
-  hby_push_num(h, atan(hby_get_num(h, 1)));
-  return true;
+Val math_atan(hby_State* h, const Val* args, int argc) {
+  return create_num(atan(fast_num(h, args, 0)));
 }
 
-bool math_atan2(hby_State* h, int argc) {
-  hby_push_num(h, atan2(hby_get_num(h, 1), hby_get_num(h, 2)));
-  return true;
+Val math_atan2(hby_State* h, const Val* args, int argc) {
+  return create_num(atan2(fast_num(h, args, 0), fast_num(h, args, 1)));
 }
 
-bool math_ceil(hby_State* h, int argc) {
-  hby_push_num(h, ceil(hby_get_num(h, 1)));
-  return true;
+Val math_ceil(hby_State* h, const Val* args, int argc) {
+  return create_num(ceil(fast_num(h, args, 0)));
 }
 
-bool math_clamp(hby_State* h, int argc) {
-  double mi = hby_get_num(h, 1);
-  double ma = hby_get_num(h, 2);
-  double n = hby_get_num(h, 3);
+Val math_clamp(hby_State* h, const Val* args, int argc) {
+  double mi = fast_num(h, args, 0);
+  double ma = fast_num(h, args, 1);
+  double n = fast_num(h, args, 2);
 
-  hby_push_num(h, fmax(fmin(ma, n), mi));
-  return true;
+  return create_num(fmax(fmin(ma, n), mi));
 }
 
-bool math_cos(hby_State* h, int argc) {
-  hby_push_num(h, cos(hby_get_num(h, 1)));
-  return true;
+Val math_cos(hby_State* h, const Val* args, int argc) {
+  return create_num(cos(fast_num(h, args, 0)));
 }
 
-bool math_cosh(hby_State* h, int argc) {
-  hby_push_num(h, cosh(hby_get_num(h, 1)));
-  return true;
+Val math_cosh(hby_State* h, const Val* args, int argc) {
+  return create_num(cosh(fast_num(h, args, 0)));
 }
 
-bool math_exp(hby_State* h, int argc) {
-  hby_push_num(h, exp(hby_get_num(h, 1)));
-  return true;
+Val math_exp(hby_State* h, const Val* args, int argc) {
+  return create_num(exp(fast_num(h, args, 0)));
 }
 
-bool math_floor(hby_State* h, int argc) {
-  hby_push_num(h, floor(hby_get_num(h, 1)));
-  return true;
+Val math_floor(hby_State* h, const Val* args, int argc) {
+  return create_num(floor(fast_num(h, args, 0)));
 }
 
-bool math_frac(hby_State* h, int argc) {
+Val math_frac(hby_State* h, const Val* args, int argc) {
   double i;
-  hby_push_num(h, modf(hby_get_num(h, 1), &i));
-  return true;
+  return create_num(modf(fast_num(h, args, 0), &i));
 }
 
-bool math_isnan(hby_State* h, int argc) {
-  hby_push_bool(h, isnan(hby_get_num(h, 1)));
-  return true;
+Val math_isnan(hby_State* h, const Val* args, int argc) {
+  return create_bool(isnan(fast_num(h, args, 0)));
 }
 
-bool math_isinf(hby_State* h, int argc) {
-  hby_push_bool(h, isinf(hby_get_num(h, 1)));
-  return true;
+Val math_isinf(hby_State* h, const Val* args, int argc) {
+  return create_bool(isinf(fast_num(h, args, 0)));
 }
 
-bool math_lerp(hby_State* h, int argc) {
-  double a = hby_get_num(h, 1);
-  double b = hby_get_num(h, 2);
-  double t = hby_get_num(h, 3);
-  hby_push_num(h, (b - a) * t + a);
-  return true;
+Val math_lerp(hby_State* h, const Val* args, int argc) {
+  double a = fast_num(h, args, 0);
+  double b = fast_num(h, args, 1);
+  double t = fast_num(h, args, 2);
+  return create_num((b - a) * t + a);
 }
 
-bool math_log(hby_State* h, int argc) {
-  hby_push_num(h, log(hby_get_num(h, 1)));
-  return true;
+Val math_log(hby_State* h, const Val* args, int argc) {
+  return create_num(log(fast_num(h, args, 0)));
 }
 
-bool math_log10(hby_State* h, int argc) {
-  hby_push_num(h, log10(hby_get_num(h, 1)));
-  return true;
+Val math_log10(hby_State* h, const Val* args, int argc) {
+  return create_num(log10(fast_num(h, args, 0)));
 }
 
-bool math_max(hby_State* h, int argc) {
-  hby_push_num(h, fmax(hby_get_num(h, 1), hby_get_num(h, 2)));
-  return true;
+Val math_max(hby_State* h, const Val* args, int argc) {
+  return create_num(fmax(fast_num(h, args, 0), fast_num(h, args, 1)));
 }
 
-bool math_min(hby_State* h, int argc) {
-  hby_push_num(h, fmin(hby_get_num(h, 1), hby_get_num(h, 2)));
-  return true;
+Val math_min(hby_State* h, const Val* args, int argc) {
+  return create_num(fmin(fast_num(h, args, 0), fast_num(h, args, 1)));
 }
 
-bool math_pow(hby_State* h, int argc) {
-  hby_push_num(h, pow(hby_get_num(h, 1), hby_get_num(h, 2)));
-  return true;
+Val math_pow(hby_State* h, const Val* args, int argc) {
+  return create_num(pow(fast_num(h, args, 0), fast_num(h, args, 1)));
 }
 
-bool math_round(hby_State* h, int argc) {
-  hby_push_num(h, floor(hby_get_num(h, 1) + 0.5));
-  return true;
+Val math_round(hby_State* h, const Val* args, int argc) {
+  return create_num(floor(fast_num(h, args, 0) + 0.5));
 }
 
-bool math_sin(hby_State* h, int argc) {
-  hby_push_num(h, sin(hby_get_num(h, 1)));
-  return true;
+Val math_sin(hby_State* h, const Val* args, int argc) {
+  return create_num(sin(fast_num(h, args, 0)));
 }
 
-bool math_sinh(hby_State* h, int argc) {
-  hby_push_num(h, sinh(hby_get_num(h, 1)));
-  return true;
+Val math_sinh(hby_State* h, const Val* args, int argc) {
+  return create_num(sinh(fast_num(h, args, 0)));
 }
 
-bool math_sqrt(hby_State* h, int argc) {
-  hby_push_num(h, sqrt(hby_get_num(h, 1)));
-  return true;
+Val math_sqrt(hby_State* h, const Val* args, int argc) {
+  return create_num(sqrt(fast_num(h, args, 0)));
 }
 
-bool math_tan(hby_State* h, int argc) {
-  hby_push_num(h, tan(hby_get_num(h, 1)));
-  return true;
+Val math_tan(hby_State* h, const Val* args, int argc) {
+  return create_num(tan(fast_num(h, args, 0)));
 }
 
-bool math_tanh(hby_State* h, int argc) {
-  hby_push_num(h, tanh(hby_get_num(h, 1)));
-  return true;
+Val math_tanh(hby_State* h, const Val* args, int argc) {
+  return create_num(tanh(fast_num(h, args, 0)));
 }
 
-hby_StructMethod math_mod[] = {
+FastMethod math_mod[] = {
   {"abs", math_abs, 1, hby_static_fn},
   {"acos", math_acos, 1, hby_static_fn},
   {"asin", math_asin, 1, hby_static_fn},
@@ -179,7 +155,8 @@ hby_StructMethod math_mod[] = {
 
 bool open_math(hby_State* h, int argc) {
   hby_push_struct(h, "math");
-  hby_struct_add_members(h, math_mod, -1);
+  h->math_struct = as_struct(*(h->top - 1));
+  add_fast_members(h, math_mod, -1);
 
   hby_push_num(h, pi);
   hby_struct_add_const(h, "pi", -2);
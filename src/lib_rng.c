@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <time.h>
+#include "arr.h"
 #include "common.h"
 #include "errmsg.h"
 #include "hby.h"
@@ -53,58 +54,64 @@ static bool rng_new(hby_State* h, int argc) {
   return true;
 }
 
-static bool rng_seed(hby_State* h, int argc) {
+static Rng* self(hby_State* h, const Val* args) {
+  if (!is_udata(args[-1])) {
+    fast_arg_err(h, args[-1], hby_type_udata);
+  }
+  return (Rng*)as_udata(args[-1])->data;
+}
+
+static Val rng_seed(hby_State* h, const Val* args, int argc) {
   int seed = time(NULL);
   if (argc == 1) {
-    seed = hby_get_num(h, 1);
+    seed = fast_num(h, args, 0);
   } else if (argc > 1) {
     hby_err(h, err_msg_expect_arg_range("0", "1"));
   }
 
-  Rng* rng = (Rng*)hby_get_udata(h, 0);
+  Rng* rng = self(h, args);
   rng->a = wang_hash64(seed);
-  return false;
+  return create_null();
 }
 
-static bool rng_next(hby_State* h, int argc) {
-  Rng* rng = (Rng*)hby_get_udata(h, 0);
-  hby_push_num(h, next_double(rng));
-  return true;
+static Val rng_next(hby_State* h, const Val* args, int argc) {
+  return create_num(next_double(self(h, args)));
 }
 
-static bool rng_bool(hby_State* h, int argc) {
-  Rng* rng = (Rng*)hby_get_udata(h, 0);
-  hby_push_bool(h, next_double(rng) < 0.5);
-  return true;
+static Val rng_bool(hby_State* h, const Val* args, int argc) {
+  return create_bool(next_double(self(h, args)) < 0.5);
 }
 
-static bool rng_pick(hby_State* h, int argc) {
-  Rng* rng = (Rng*)hby_get_udata(h, 0);
-  hby_expect_array(h, 1);
-  int len = hby_len(h, 1);
-  int index = floor(range(rng, 0, len));
-  hby_array_get_index(h, 1, index);
-  return true;
+static Val rng_pick(hby_State* h, const Val* args, int argc) {
+  Rng* rng = self(h, args);
+  if (!is_arr(args[0])) {
+    fast_arg_err(h, args[0], hby_type_array);
+  }
+  VArr* arr = &as_arr(args[0])->varr;
+  int index = get_index(h, arr->len, floor(range(rng, 0, arr->len)));
+  return arr->items[index];
 }
 
-static bool rng_irange(hby_State* h, int argc) {
-  Rng* rng = (Rng*)hby_get_udata(h, 0);
-  int low = hby_get_num(h, 1);
-  int high = hby_get_num(h, 2) + 1;
-  hby_push_num(h, floor(range(rng, low, high)));
-  return true;
+static Val rng_irange(hby_State* h, const Val* args, int argc) {
+  Rng* rng = self(h, args);
+  int low = fast_num(h, args, 0);
+  int high = fast_num(h, args, 1) + 1;
+  return create_num(floor(range(rng, low, high)));
 }
 
-static bool rng_frange(hby_State* h, int argc) {
-  Rng* rng = (Rng*)hby_get_udata(h, 0);
-  int low = hby_get_num(h, 1);
-  int high = hby_get_num(h, 2);
-  hby_push_num(h, range(rng, low, high));
-  return true;
+static Val rng_frange(hby_State* h, const Val* args, int argc) {
+  Rng* rng = self(h, args);
+  int low = fast_num(h, args, 0);
+  int high = fast_num(h, args, 1);
+  return create_num(range(rng, low, high));
 }
 
 hby_StructMethod rng_struct[] = {
   {"new", rng_new, 0, hby_static_fn},
+  {NULL, NULL, 0, 0},
+};
+
+FastMethod rng_fast[] = {
   {"seed", rng_seed, -1, hby_method},
   {"next", rng_next, 0, hby_method},
   {"bool", rng_bool, 0, hby_method},
@@ -117,6 +124,7 @@ hby_StructMethod rng_struct[] = {
 bool open_rng(hby_State* h, int argc) {
   hby_push_struct(h, "Rng");
   hby_struct_add_members(h, rng_struct, -1);
+  add_fast_members(h, rng_fast, -1);
   hby_set_global(h, "Rng", -1);
 
   return false;
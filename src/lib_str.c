@@ -3,6 +3,8 @@
 #include "lib.h"
 #include "mem.h"
 #include "obj.h"
+#include "state.h"
+#include "tostr.h"
 #include "val.h"
 #include <stdio.h>
 
@@ -400,11 +402,98 @@ hby_StructMethod str_methods[] = {
   {NULL, NULL, 0, 0},
 };
 
+static bool sb_gc(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_get_udata(h, 1);
+  free_strbuf(h, buf);
+  return false;
+}
+
+static bool sb_new(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_push_udata(h, sizeof(StrBuf));
+  init_strbuf(buf);
+  hby_get_global(h, "StringBuilder");
+  hby_udata_set_metastruct(h, -2);
+  hby_udata_set_finalizer(h, sb_gc);
+  return true;
+}
+
+static bool sb_append(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_get_udata(h, 0);
+  append_val_strbuf(h, buf, *(h->frame->base + 1));
+  hby_push(h, 0);
+  return true;
+}
+
+static bool sb_append_num(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_get_udata(h, 0);
+  append_num_strbuf(h, buf, hby_get_num(h, 1));
+  hby_push(h, 0);
+  return true;
+}
+
+static bool sb_append_char(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_get_udata(h, 0);
+  int ascii = hby_get_num(h, 1);
+  if (ascii > UINT8_MAX || ascii < 0) {
+    hby_err(h, err_msg_invalid_ascii, ascii);
+  }
+
+  append_char_strbuf(h, buf, (char)ascii);
+  hby_push(h, 0);
+  return true;
+}
+
+static bool sb_reserve(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_get_udata(h, 0);
+  int extra = hby_get_num(h, 1);
+  if (extra > 0) {
+    reserve_strbuf(h, buf, extra);
+  }
+
+  hby_push(h, 0);
+  return true;
+}
+
+static bool sb_len(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_get_udata(h, 0);
+  hby_push_num(h, buf->len);
+  return true;
+}
+
+static bool sb_clear(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_get_udata(h, 0);
+  buf->len = 0; // Keep the capacity around for the next string
+  hby_push(h, 0);
+  return true;
+}
+
+static bool sb_build(hby_State* h, int argc) {
+  StrBuf* buf = (StrBuf*)hby_get_udata(h, 0);
+  push(h, create_obj(build_strbuf(h, buf)));
+  return true;
+}
+
+hby_StructMethod sb_methods[] = {
+  {"new", sb_new, 0, hby_static_fn},
+  {"append", sb_append, 1, hby_method},
+  {"append_num", sb_append_num, 1, hby_method},
+  {"append_char", sb_append_char, 1, hby_method},
+  {"reserve", sb_reserve, 1, hby_method},
+  {"len", sb_len, 0, hby_method},
+  {"clear", sb_clear, 0, hby_method},
+  {"build", sb_build, 0, hby_method},
+  {NULL, NULL, 0, 0},
+};
+
 bool open_str(hby_State* h, int argc) {
   hby_push_struct(h, "String");
   h->string_struct = as_struct(*(h->top - 1));
   hby_struct_add_members(h, str_methods, -1);
   hby_set_global(h, NULL, -1);
 
+  hby_push_struct(h, "StringBuilder");
+  hby_struct_add_members(h, sb_methods, -1);
+  hby_set_global(h, "StringBuilder", -1);
+
   return false;
 }
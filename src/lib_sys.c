@@ -2,7 +2,9 @@
 
 #include <string.h>
 #include <time.h>
+#include "errmsg.h"
 #include "hby.h"
+#include "mem.h"
 #include "state.h"
 
 static bool sys_clock(hby_State* h, int argc) {
@@ -21,6 +23,108 @@ static bool sys_getenv(hby_State* h, int argc) {
   return true;
 }
 
+static bool sys_gc(hby_State* h, int argc) {
+  gc(h);
+  return false;
+}
+
+// Bytes currently allocated by the state, including garbage not yet collected
+static bool sys_memory(hby_State* h, int argc) {
+  hby_push_num(h, (double)h->gc.alloced);
+  return true;
+}
+
+// Spends up to `budget` microseconds on the running collection cycle
+static bool sys_gcstep(hby_State* h, int argc) {
+  hby_push_bool(h, hby_gc_step(h, (int)hby_get_num(h, 1)));
+  return true;
+}
+
+static void set_stat(hby_State* h, const char* name, double val) {
+  hby_push_strcpy(h, name);
+  hby_push_num(h, val);
+  hby_map_set(h, -3, -2);
+  hby_pop(h, 1);
+}
+
+static bool sys_gcpauses(hby_State* h, int argc) {
+  hby_GcPauses pauses;
+  hby_gc_pauses(h, &pauses);
+
+  hby_push_map(h);
+  set_stat(h, "count", (double)pauses.count);
+  set_stat(h, "p50", pauses.p50);
+  set_stat(h, "p90", pauses.p90);
+  set_stat(h, "p99", pauses.p99);
+  set_stat(h, "max", pauses.max);
+  return true;
+}
+
+static bool sys_allocstats(hby_State* h, int argc) {
+  hby_AllocStats stats;
+  hby_alloc_stats(h, &stats);
+
+  hby_push_map(h);
+  set_stat(h, "pages", (double)stats.pages);
+  set_stat(h, "page_size", (double)stats.page_size);
+  set_stat(h, "used_cells", (double)stats.used_cells);
+  set_stat(h, "free_cells", (double)stats.free_cells);
+  set_stat(h, "released_pages", (double)stats.released_pages);
+  return true;
+}
+
+static bool sys_dump(hby_State* h, int argc) {
+  hby_dump(h, 1);
+  return true;
+}
+
+static bool sys_load(hby_State* h, int argc) {
+  size_t len;
+  const char* data = hby_get_str(h, 1, &len);
+  if (hby_load(h, "<load>", data, len) > 0) {
+    hby_err(h, "%s", hby_get_str(h, -1, NULL));
+  }
+  return true;
+}
+
+// Compiles a string of source into a function, like `import` does a file
+static bool sys_compile(hby_State* h, int argc) {
+  int errc = hby_compile(h, "<compile>", hby_get_str(h, 1, NULL));
+  if (errc > 0) {
+    hby_err(h, "%s", hby_get_str(h, -errc, NULL));
+  }
+  return true;
+}
+
+// `sys:budgetcall(callback, budget, fn, args...)` calls `fn` like `pcall`,
+// but resumes it every time it makes `budget` calls and loop iterations. Gives
+// the result and how many times the call was suspended
+static bool sys_budgetcall(hby_State* h, int argc) {
+  if (argc < 3) {
+    hby_err(h, err_msg_bad_argc, 3, argc);
+  }
+  int budget = (int)hby_get_num(h, 2);
+
+  hby_reserve(h, argc);
+  for (int i = 3; i <= argc; i++) {
+    hby_push(h, i);
+  }
+
+  int suspends = 0;
+  hby_Res res = hby_pcall_budget(h, 1, argc - 3, budget);
+  while (res == hby_res_suspended) {
+    suspends++;
+    res = hby_resume(h, budget);
+  }
+
+  hby_push_array(h);
+  hby_push(h, -2);
+  hby_array_add(h, -2);
+  hby_push_num(h, suspends);
+  hby_array_add(h, -2);
+  return true;
+}
+
 static bool sys_exit(hby_State* h, int argc) {
   exit(hby_get_num(h, 1));
   return false;
@@ -31,6 +135,15 @@ hby_StructMethod sys_mod[] = {
   {"command", sys_command, 1, hby_static_fn},
   {"getenv", sys_getenv, 1, hby_static_fn},
   {"exit", sys_exit, 1, hby_static_fn},
+  {"gc", sys_gc, 0, hby_static_fn},
+  {"memory", sys_memory, 0, hby_static_fn},
+  {"gcstep", sys_gcstep, 1, hby_static_fn},
+  {"gcpauses", sys_gcpauses, 0, hby_static_fn},
+  {"allocstats", sys_allocstats, 0, hby_static_fn},
+  {"dump", sys_dump, 1, hby_static_fn},
+  {"load", sys_load, 1, hby_static_fn},
+  {"compile", sys_compile, 1, hby_static_fn},
+  {"budgetcall", sys_budgetcall, -1, hby_static_fn},
   {NULL, NULL, 0, 0},
 };
 
@@ -7,6 +7,7 @@
 const char help_str[] =
   "usage: %s [options] [script] [-- args]\n"
   "  -h, --help     show help text\n"
+  "  -c             compile 'script' to a .hbc file instead of running it\n"
   "  -e stat        execute string 'stat'\n"
   "  -i             enter the REPL after executing 'script'\n"
   "  -v, --version  show version info\n"
@@ -19,6 +20,7 @@ const char help_str[] =
 #define doexpr_flag    bit_flag(2)
 #define replafter_flag bit_flag(3)
 #define version_flag   bit_flag(4)
+#define compile_flag   bit_flag(5)
 
 typedef struct {
   uint8_t flags;
@@ -106,6 +108,7 @@ static Args collect_args(int argc, const char* args[]) {
               break;
             case 'h': collected.flags |= help_flag; break;
             case 'i': collected.flags |= replafter_flag; break;
+            case 'c': collected.flags |= compile_flag; break;
             case 'v': collected.flags |= version_flag; break;
             case 'e':
               collected.flags |= doexpr_flag;
@@ -148,9 +151,23 @@ int main(int argc, const char* args[]) {
     return 0;
   }
 
+  if ((collected.flags & compile_flag) && collected.path == NULL) {
+    show_help(args[0]);
+    return 1;
+  }
+
   hby_State* h = hby_create_state();
   hby_cli_args(h, collected.argc, collected.args);
 
+  if (collected.flags & compile_flag) {
+    int errc = hby_cache_file(h, collected.path);
+    for (int i = errc - 1; i >= 0; i--) {
+      fprintf(stderr, "[error] %s\n", hby_get_str(h, -1 - i, NULL));
+    }
+    hby_free_state(h);
+    return errc > 0 ? 65 : 0;
+  }
+
   hby_push_cfunc(h, "on_error", on_error, -1);
   if (collected.flags & doexpr_flag) {
     int errc = hby_compile(h, "<cli>", collected.doexpr_str);
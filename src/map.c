@@ -1,18 +1,47 @@
 #include "map.h"
 
+#include <string.h>
 #include "mem.h"
 
 #define map_max_load 0.75
 
-static uint32_t hash_val(Val* val) {
-  if (is_str(*val)) {
-    return as_str(*val)->hash;
+// Finalizer from MurmurHash3. Spreads every input bit over the low bits the
+// table is indexed with.
+static inline uint32_t mix_hash(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (uint32_t)x;
+}
+
+static uint32_t hash_val(Val val) {
+  if (is_num(val)) {
+    double num = as_num(val);
+#ifndef nan_boxing
+    // `vals_eql` compares numbers with `==` here, which takes -0 for 0
+    if (num == 0) {
+      num = 0;
+    }
+#endif
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(double));
+    return mix_hash(bits);
+  } else if (is_obj(val)) {
+    // Strings are interned, so everything else can hash its address
+    if (is_str(val)) {
+      return as_str(val)->hash;
+    }
+    return mix_hash((uint64_t)(uintptr_t)as_obj(val));
+  } else if (is_bool(val)) {
+    return as_bool(val) ? 0x2c1b3c6d : 0x297a2d39;
   }
-  return 0;
+  return 0x7f4a7c15;
 }
 
-static MapItem* find_item(MapItem* items, int cap, Val k) {
-  uint32_t index = hash_val(&k) & (cap - 1);
+static MapItem* find_item(MapItem* items, int cap, Val k, uint32_t hash) {
+  uint32_t index = hash & (cap - 1);
 
   MapItem* tombstone = NULL;
 
@@ -48,9 +77,8 @@ static void adjust_cap(hby_State* h, GcMap* map, int cap) {
       continue;
     }
 
-    MapItem* dst = find_item(items, cap, item->key);
-    dst->key = item->key;
-    dst->val = item->val;
+    MapItem* dst = find_item(items, cap, item->key, item->hash);
+    *dst = *item;
     map->itemc++;
   }
 
@@ -64,7 +92,7 @@ bool get_map(GcMap* map, Val k, Val* out_v) {
     return false;
   }
 
-  MapItem* item = find_item(map->items, map->item_cap, k);
+  MapItem* item = find_item(map->items, map->item_cap, k, hash_val(k));
   if (is_null(item->key)) {
     return false;
   }
@@ -79,7 +107,8 @@ bool set_map(hby_State* h, GcMap* map, Val k, Val v) {
     adjust_cap(h, map, cap);
   }
 
-  MapItem* item = find_item(map->items, map->item_cap, k);
+  uint32_t hash = hash_val(k);
+  MapItem* item = find_item(map->items, map->item_cap, k, hash);
   bool is_new = is_null(item->key);
   if (is_new && is_null(item->val)) {
     map->itemc++;
@@ -87,6 +116,10 @@ bool set_map(hby_State* h, GcMap* map, Val k, Val v) {
 
   item->key = k;
   item->val = v;
+  item->hash = hash;
+
+  gc_barrier(h, &map->obj, k);
+  gc_barrier(h, &map->obj, v);
   return is_new;
 }
 
@@ -95,7 +128,7 @@ bool rem_map(hby_State* h, GcMap* map, Val k) {
     return false;
   }
 
-  MapItem* item = find_item(map->items, map->item_cap, k);
+  MapItem* item = find_item(map->items, map->item_cap, k, hash_val(k));
   if (is_null(item->key)) {
     return false;
   }
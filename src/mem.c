@@ -1,4 +1,6 @@
+#include <limits.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "mem.h"
 #include "chunk.h"
@@ -18,18 +20,53 @@
 #endif
 
 #define gc_grow_factor 2
+// Bytes allocated between minor collections
+#define gc_nursery_size (256 * 1024)
+// Bytes allocated between steps of a major cycle
+#define gc_step_size (32 * 1024)
+// Objects marked or swept per step. Outpaces the allocation of objects that
+// are at least 16 bytes large, so cycles always finish
+#ifdef hby_stress_gc
+# define gc_step_work 16
+#else
+# define gc_step_work 2048
+#endif
+// Objects handled between clock checks in `hby_gc_step`
+#define gc_budget_work 256
+// In stress mode, every nth collection is a major one
+#define gc_stress_major_every 8
 
-void* reallocate(hby_State* h, void* ptr, size_t plen, size_t len) {
+static void gc_step(hby_State* h);
+
+// Accounts for an allocation, which may start collecting garbage
+static void count_alloc(hby_State* h, size_t plen, size_t len) {
   h->gc.alloced += len - plen;
   if (len > plen) {
+    h->gc.young_alloced += len - plen;
 #ifdef hby_stress_gc
-    gc(h);
+    size_t gcs = h->gc.minor_gcs + h->gc.major_gcs;
+    if (h->gc.phase != gc_phase_idle
+        || gcs % gc_stress_major_every == gc_stress_major_every - 1) {
+      gc_step(h);
+    }
+    minor_gc(h);
 #else
-    if (h->gc.alloced > h->gc.next_gc) {
-      gc(h);
+    h->gc.debt += len - plen;
+    if (h->gc.phase == gc_phase_idle
+        ? h->gc.alloced > h->gc.next_gc
+        : h->gc.debt > gc_step_size) {
+      h->gc.debt = 0;
+      gc_step(h);
+    }
+    if (h->gc.young_alloced > gc_nursery_size) {
+      minor_gc(h);
     }
 #endif
   }
+}
+
+void* reallocate(hby_State* h, void* ptr, size_t plen, size_t len) {
+  count_alloc(h, plen, len);
 
   if (len == 0) {
     free(ptr);
@@ -44,6 +81,88 @@ void* reallocate(hby_State* h, void* ptr, size_t plen, size_t len) {
   return res;
 }
 
+static uint64_t gc_clock() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Pauses are kept in a histogram with 8 buckets per power of 2 nanoseconds
+static int pause_bucket(uint64_t ns) {
+  if (ns < 16) {
+    return (int)ns;
+  }
+
+  int e = 4;
+  while (e < 40 && (ns >> (e + 1)) != 0) {
+    e++;
+  }
+  int sub = (int)((ns >> (e - 3)) & 7);
+  int bucket = 16 + (e - 4) * 8 + sub;
+  return bucket < gc_pause_buckets ? bucket : gc_pause_buckets - 1;
+}
+
+// Largest pause in nanoseconds that falls into `bucket`
+static uint64_t pause_bucket_max(int bucket) {
+  if (bucket < 16) {
+    return bucket;
+  }
+
+  int e = (bucket - 16) / 8 + 4;
+  uint64_t sub = (bucket - 16) % 8;
+  return ((8 + sub + 1) << (e - 3)) - 1;
+}
+
+static void record_pause(hby_State* h, uint64_t start) {
+  uint64_t ns = gc_clock() - start;
+  h->gc.pauses[pause_bucket(ns)]++;
+  h->gc.pausec++;
+  if (ns > h->gc.max_pause) {
+    h->gc.max_pause = ns;
+  }
+}
+
+// Pause time in microseconds that `p` of the pauses didn't exceed
+static double pause_percentile(hby_State* h, double p) {
+  if (h->gc.pausec == 0) {
+    return 0;
+  }
+
+  size_t target = (size_t)(p * h->gc.pausec);
+  size_t seen = 0;
+  for (int i = 0; i < gc_pause_buckets; i++) {
+    seen += h->gc.pauses[i];
+    if (seen > target || seen == h->gc.pausec) {
+      uint64_t ns = pause_bucket_max(i);
+      return (ns < h->gc.max_pause ? ns : h->gc.max_pause) / 1000.0;
+    }
+  }
+  return h->gc.max_pause / 1000.0;
+}
+
+void* alloc_cell(hby_State* h, size_t size) {
+  count_alloc(h, 0, slab_cell_size(size));
+  return slab_alloc(&h->gc.slab, size);
+}
+
+void free_cell(hby_State* h, void* ptr, size_t size) {
+  h->gc.alloced -= slab_cell_size(size);
+  slab_free(&h->gc.slab, ptr, size);
+}
+
+void hby_alloc_stats(hby_State* h, hby_AllocStats* out) {
+  Slab* slab = &h->gc.slab;
+  out->pages = slab->pagec;
+  out->page_size = slab_page_size;
+  out->used_cells = slab->used_cellc;
+  out->free_cells = slab->free_cellc;
+  out->released_pages = slab->released_pagec;
+}
+
+void hby_release_pages(hby_State* h, bool release) {
+  h->gc.slab.release_pages = release;
+}
+
 static void free_obj(hby_State* h, GcObj* obj) {
 #ifdef hby_log_gc
   printf("%p free type %d\n", (void*)obj, obj->type);
@@ -51,7 +170,7 @@ static void free_obj(hby_State* h, GcObj* obj) {
 
   switch (obj->type) {
     case obj_method: {
-      release(h, GcMethod, obj);
+      release_obj(h, GcMethod, obj);
       break;
     }
     case obj_struct: {
@@ -59,74 +178,98 @@ static void free_obj(hby_State* h, GcObj* obj) {
       free_table(h, &s->staticm);
       free_table(h, &s->methods);
       free_table(h, &s->members);
-      release(h, GcStruct, obj);
+      free_varr(h, &s->defaults);
+      release_obj(h, GcStruct, obj);
       break;
     }
     case obj_inst: {
       GcInst* inst = (GcInst*)obj;
-      free_table(h, &inst->fields);
-      release(h, GcInst, obj);
+      free_cell(h, obj, sizeof(GcInst) + sizeof(Val) * inst->fieldc);
       break;
     }
     case obj_upval:
-      release(h, GcUpval, obj);
+      release_obj(h, GcUpval, obj);
       break;
     case obj_closure: {
       GcClosure* closure = (GcClosure*)obj;
-      release_arr(h, GcUpval*, closure->upvals, closure->upvalc);
-      release(h, GcClosure, obj);
+      free_cell(
+        h, obj, sizeof(GcClosure) + sizeof(GcUpval*) * closure->upvalc);
       break;
     }
     case obj_c_fn:
-      release(h, GcCFn, obj);
+      release_obj(h, GcCFn, obj);
       break;
     case obj_fn: {
       GcFn* fn = (GcFn*)obj;
       free_chunk(h, &fn->chunk);
-      release(h, GcFn, obj);
+      release_obj(h, GcFn, obj);
       break;
     }
     case obj_enum: {
       GcEnum* _enum = (GcEnum*)obj;
       free_table(h, &_enum->vals);
-      release(h, GcEnum, obj);
+      release_obj(h, GcEnum, obj);
       break;
     }
     case obj_arr: {
       GcArr* arr = (GcArr*)obj;
       free_varr(h, &arr->varr);
-      release(h, GcArr, obj);
+      release_obj(h, GcArr, obj);
       break;
     }
     case obj_map: {
       GcMap* map = (GcMap*)obj;
       release_arr(h, MapItem, map->items, map->item_cap);
-      release(h, GcMap, obj);
+      release_obj(h, GcMap, obj);
       break;
     }
     case obj_str: {
       GcStr* str = (GcStr*)obj;
-      release_arr(h, char, str->chars, str->len + 1);
-      release(h, GcStr, obj);
+      if (str->chars == str->inline_chars) {
+        free_cell(h, obj, sizeof(GcStr) + str->len + 1);
+      } else {
+        release_arr(h, char, str->chars, str->len + 1);
+        release_obj(h, GcStr, obj);
+      }
       break;
     }
     case obj_udata: {
       GcUData* udata = (GcUData*)obj;
       reallocate(h, udata->data, udata->size, 0);
-      release(h, GcUData, obj);
+      release_obj(h, GcUData, obj);
+      break;
+    }
+    case obj_fiber: {
+      GcFiber* fiber = (GcFiber*)obj;
+      release_arr(h, CallFrame, fiber->frame_stack, fiber->frame_cap);
+      release_arr(h, Val, fiber->stack, fiber->stack_cap);
+      release_obj(h, GcFiber, obj);
       break;
     }
   }
 }
 
 void mark_obj(hby_State* h, GcObj* obj) {
-  if (obj == NULL || obj->marked) {
+  if (obj == NULL) {
     return;
   }
+
+  // Minor collections have their own mark, so they can run in the middle of a
+  // major mark phase. They treat old objects as reachable without tracing them
+  if (h->gc.minor) {
+    if (obj->old || obj->minor_marked) {
+      return;
+    }
+    obj->minor_marked = true;
+  } else {
+    if (obj->marked) {
+      return;
+    }
+    obj->marked = true;
+  }
 #ifdef hby_log_gc
   printf("%p mark %d\n", (void*)obj, obj->type);
 #endif
-  obj->marked = true;
 
   if (h->gc.gray_cap < h->gc.grayc + 1) {
     h->gc.gray_cap = grow_cap(h->gc.gray_cap);
@@ -140,6 +283,46 @@ void mark_obj(hby_State* h, GcObj* obj) {
   h->gc.gray_stack[h->gc.grayc++] = obj;
 }
 
+static void remember_obj(hby_State* h, GcObj* obj) {
+  if (h->gc.remembered_cap < h->gc.rememberedc + 1) {
+    h->gc.remembered_cap = grow_cap(h->gc.remembered_cap);
+    h->gc.remembered = (GcObj**)realloc(
+      h->gc.remembered, sizeof(GcObj*) * h->gc.remembered_cap);
+    if (h->gc.remembered == NULL) {
+      exit(1);
+    }
+  }
+
+  obj->remembered = true;
+  h->gc.remembered[h->gc.rememberedc++] = obj;
+}
+
+void barrier_slow(hby_State* h, GcObj* obj, GcObj* target) {
+  if (obj->old && !obj->remembered && !target->old) {
+    remember_obj(h, obj);
+  }
+  if (h->gc.phase == gc_phase_mark && obj->marked && !target->marked) {
+    mark_obj(h, target);
+  }
+}
+
+void barrier_back(hby_State* h, GcObj* obj) {
+  if (obj->old && !obj->remembered) {
+    remember_obj(h, obj);
+  }
+  if (h->gc.phase == gc_phase_mark && obj->marked) {
+    obj->marked = false;
+    mark_obj(h, obj);
+  }
+}
+
+static void forget_remembered(hby_State* h) {
+  for (int i = 0; i < h->gc.rememberedc; i++) {
+    h->gc.remembered[i]->remembered = false;
+  }
+  h->gc.rememberedc = 0;
+}
+
 void mark_val(hby_State* h, Val val) {
   if (is_obj(val)) {
     mark_obj(h, as_obj(val));
@@ -152,6 +335,26 @@ static void mark_arr(hby_State* h, VArr* arr) {
   }
 }
 
+static void mark_stacks(
+    hby_State* h, Val* stack, Val* top, CallFrame* frame_stack,
+    CallFrame* frame, GcUpval* open_upvals) {
+  for (Val* slot = stack; slot < top; slot++) {
+    mark_val(h, *slot);
+  }
+
+  for (; frame > frame_stack; frame--) {
+    if (frame->type == call_type_c) {
+      mark_obj(h, (GcObj*)frame->fn.c);
+    } else {
+      mark_obj(h, (GcObj*)frame->fn.hby);
+    }
+  }
+
+  for (GcUpval* upval = open_upvals; upval != NULL; upval = upval->next) {
+    mark_obj(h, (GcObj*)upval);
+  }
+}
+
 static void blacken_obj(hby_State* h, GcObj* obj) {
 #ifdef hby_log_gc
   printf("%p blacken %d\n", (void*)obj, obj->type);
@@ -170,12 +373,15 @@ static void blacken_obj(hby_State* h, GcObj* obj) {
       mark_table(h, &s->staticm);
       mark_table(h, &s->methods);
       mark_table(h, &s->members);
+      mark_arr(h, &s->defaults);
       break;
     }
     case obj_inst: {
       GcInst* inst = (GcInst*)obj;
       mark_obj(h, (GcObj*)inst->_struct);
-      mark_table(h, &inst->fields);
+      for (int i = 0; i < inst->fieldc; i++) {
+        mark_val(h, inst->fields[i]);
+      }
       break;
     }
     case obj_closure: {
@@ -211,6 +417,10 @@ static void blacken_obj(hby_State* h, GcObj* obj) {
     case obj_upval: {
       GcUpval* up = (GcUpval*)obj;
       mark_val(h, up->closed);
+      // An open upvalue's value lives on the stack of its fiber
+      if (up->loc != &up->closed) {
+        mark_obj(h, (GcObj*)up->fiber);
+      }
       break;
     }
     case obj_udata: {
@@ -219,33 +429,42 @@ static void blacken_obj(hby_State* h, GcObj* obj) {
       mark_obj(h, (GcObj*)udata->finalizer);
       break;
     }
+    case obj_fiber: {
+      GcFiber* fiber = (GcFiber*)obj;
+      mark_val(h, fiber->fn);
+      mark_obj(h, (GcObj*)fiber->caller);
+      mark_obj(h, (GcObj*)fiber->err);
+      // The stacks of the running fiber are marked as roots instead
+      mark_stacks(
+        h, fiber->stack, fiber->top, fiber->frame_stack, fiber->frame,
+        fiber->open_upvals);
+      break;
+    }
     case obj_str:
       break;
   }
 }
 
 static void mark_roots(hby_State* h) {
-  for (Val* slot = h->stack; slot < h->top; slot++) {
-    mark_val(h, *slot);
-  }
-
-  for (CallFrame* frame = h->frame; frame > h->frame_stack; frame--) {
-    if (frame->type == call_type_c) {
-      mark_obj(h, (GcObj*)frame->fn.c);
-    } else {
-      mark_obj(h, (GcObj*)frame->fn.hby);
-    }
-  }
-
-  for (GcUpval* upval = h->open_upvals; upval != NULL; upval = upval->next) {
-    mark_obj(h, (GcObj*)upval);
+  mark_stacks(
+    h, h->stack, h->top, h->frame_stack, h->frame, h->open_upvals);
+  mark_obj(h, (GcObj*)h->fiber);
+  mark_obj(h, (GcObj*)h->budget_fiber);
+  // Kept even if the global is replaced, since intrinsics compare against it
+  mark_obj(h, (GcObj*)h->math_struct);
+  mark_obj(h, (GcObj*)h->budget_callback.hby);
+
+  mark_table(h, &h->global_slots);
+  for (int i = 0; i < h->globalc; i++) {
+    mark_obj(h, (GcObj*)h->globals[i].name);
+    mark_val(h, h->globals[i].val);
   }
-
-  mark_table(h, &h->globals);
   mark_table(h, &h->global_consts);
   mark_table(h, &h->files);
   mark_obj(h, (GcObj*)h->args);
   mark_obj(h, (GcObj*)h->registry);
+  mark_obj(h, (GcObj*)h->iter_str);
+  mark_obj(h, (GcObj*)h->next_str);
   mark_compiler_roots(h->parser);
 }
 
@@ -254,6 +473,7 @@ static void trace_refs(hby_State* h) {
     GcObj* obj = h->gc.gray_stack[--h->gc.grayc];
     blacken_obj(h, obj);
   }
+  h->gc.gray_old = 0;
 }
 
 static void sweep(hby_State* h, GcObj** list) {
@@ -279,6 +499,31 @@ static void sweep(hby_State* h, GcObj** list) {
   }
 }
 
+// Frees unreached young objects and promotes the rest to the old list. Minor
+// collections keep the major marks, which belong to a running mark phase
+static void sweep_young(hby_State* h) {
+  GcObj* obj = h->gc.young;
+  while (obj != NULL) {
+    GcObj* next = obj->next;
+    if (h->gc.minor ? obj->minor_marked : obj->marked) {
+      if (h->gc.minor) {
+        obj->minor_marked = false;
+      } else {
+        obj->marked = false;
+      }
+      obj->old = true;
+      obj->next = h->gc.objs;
+      h->gc.objs = obj;
+    } else {
+      free_obj(h, obj);
+    }
+    obj = next;
+  }
+
+  h->gc.young = NULL;
+  h->gc.young_alloced = 0;
+}
+
 static void finalize_udata(hby_State* h, bool need_unmarked) {
   GcObj* obj = h->gc.udata;
   while (obj != NULL) {
@@ -287,40 +532,235 @@ static void finalize_udata(hby_State* h, bool need_unmarked) {
       push(h, create_obj(udata->finalizer));
       push(h, create_obj(udata));
       hby_call(h, 1);
+      pop(h); // Result
     }
     obj = obj->next;
   }
 }
 
-void gc(hby_State* h) {
+// Collects only the young objects. Old objects are assumed reachable, and the
+// remembered set stands in for their references to young objects
+void minor_gc(hby_State* h) {
   if (!h->gc.can_gc) {
     return;
   }
 
 #ifdef hby_log_gc
-  printf("-- GC BEGIN --\n");
+  printf("-- MINOR GC BEGIN --\n");
   size_t before = h->gc.alloced;
 #endif
 
+  uint64_t start = gc_clock();
+  h->gc.minor = true;
+  // Young objects still gray in a major mark phase are kept too, so the gray
+  // stack never points to freed objects. Old ones are covered by the
+  // remembered set, and the ones below `gray_old` survived an earlier minor
+  int base = h->gc.grayc;
+  for (int i = h->gc.gray_old; i < base; i++) {
+    GcObj* gray = h->gc.gray_stack[i];
+    if (!gray->old) {
+      gray->minor_marked = true;
+      blacken_obj(h, gray);
+    }
+  }
+
+  mark_roots(h);
+  for (int i = 0; i < h->gc.rememberedc; i++) {
+    blacken_obj(h, h->gc.remembered[i]);
+  }
+
+  // Only trace what this collection pushed
+  while (h->gc.grayc > base) {
+    GcObj* obj = h->gc.gray_stack[--h->gc.grayc];
+    blacken_obj(h, obj);
+  }
+  // Only young strings can be freed, so the rest of the table is left alone
+  for (GcObj* obj = h->gc.young; obj != NULL; obj = obj->next) {
+    if (obj->type == obj_str && !obj->minor_marked) {
+      rem_table(&h->strs, (GcStr*)obj);
+    }
+  }
+
+  // Every survivor is promoted, so no old object points to a young one anymore
+  forget_remembered(h);
+  sweep_young(h);
+  h->gc.gray_old = base;
+  h->gc.minor = false;
+  h->gc.minor_gcs++;
+  record_pause(h, start);
+
+#ifdef hby_log_gc
+  printf(
+    "COLLECTED %zu BYTES (FROM %zu TO %zu)\n",
+    before - h->gc.alloced, before, h->gc.alloced);
+  printf("-- MINOR GC END --\n");
+#endif
+}
+
+static void start_cycle(hby_State* h) {
+#ifdef hby_log_gc
+  printf("-- GC CYCLE BEGIN --\n");
+#endif
+  h->gc.phase = gc_phase_mark;
+  h->gc.cycle_start = h->gc.alloced;
+  mark_roots(h);
+}
+
+// Blackens up to `work` gray objects. Returns how much work is left
+static int mark_some(hby_State* h, int work) {
+  while (h->gc.grayc > 0 && work > 0) {
+    GcObj* obj = h->gc.gray_stack[--h->gc.grayc];
+    blacken_obj(h, obj);
+    work--;
+  }
+  if (h->gc.gray_old > h->gc.grayc) {
+    h->gc.gray_old = h->gc.grayc;
+  }
+  return work;
+}
+
+// Ends the mark phase without interruption. The roots aren't covered by the
+// write barrier, so they are marked again here
+static void finish_mark(hby_State* h) {
   mark_roots(h);
   trace_refs(h);
-  rem_black_table(h, &h->strs);
 
+  // Finalizers run Hobby code, which must not start a nested collection while
+  // the marks are still live
+  h->gc.can_gc = false;
   finalize_udata(h, true);
+  h->gc.can_gc = true;
+
+  // Keep anything the finalizers stored
+  mark_roots(h);
+  trace_refs(h);
+  rem_black_table(h, &h->strs);
 
+  forget_remembered(h);
   sweep(h, &h->gc.udata);
-  sweep(h, &h->gc.objs);
 
+  // Old objects are swept incrementally from a separate list, so objects
+  // promoted from now on are never mistaken for garbage
+  h->gc.sweeping = h->gc.objs;
+  h->gc.objs = NULL;
+  sweep_young(h);
+  h->gc.phase = gc_phase_sweep;
+}
+
+// Sweeps up to `work` old objects. Returns how much work is left
+static int sweep_some(hby_State* h, int work) {
+  while (h->gc.sweeping != NULL && work > 0) {
+    GcObj* obj = h->gc.sweeping;
+    h->gc.sweeping = obj->next;
+    if (obj->marked) {
+      obj->marked = false;
+      obj->next = h->gc.objs;
+      h->gc.objs = obj;
+    } else {
+      free_obj(h, obj);
+    }
+    work--;
+  }
+  return work;
+}
+
+static void finish_cycle(hby_State* h) {
+  h->gc.phase = gc_phase_idle;
+  h->gc.major_gcs++;
   h->gc.next_gc = h->gc.alloced * gc_grow_factor;
 
 #ifdef hby_log_gc
   printf(
     "COLLECTED %zu BYTES (FROM %zu TO %zu) NEXT AT %zu\n",
-    before - h->gc.alloced, before, h->gc.alloced, h->gc.next_gc);
-  printf("-- GC END --\n");
+    h->gc.cycle_start - h->gc.alloced, h->gc.cycle_start, h->gc.alloced,
+    h->gc.next_gc);
+  printf("-- GC CYCLE END --\n");
 #endif
 }
 
+// Advances the running cycle by roughly `work` objects. Returns how much work
+// is left, which is only more than 0 if the cycle finished
+static int gc_work(hby_State* h, int work) {
+  if (h->gc.phase == gc_phase_mark) {
+    work = mark_some(h, work);
+    if (h->gc.grayc > 0) {
+      return 0;
+    }
+    finish_mark(h);
+  }
+
+  work = sweep_some(h, work);
+  if (h->gc.sweeping == NULL) {
+    finish_cycle(h);
+  }
+  return work;
+}
+
+static void gc_step(hby_State* h) {
+  if (!h->gc.can_gc) {
+    return;
+  }
+
+  uint64_t start = gc_clock();
+  if (h->gc.phase == gc_phase_idle) {
+    start_cycle(h);
+  }
+  gc_work(h, gc_step_work);
+  record_pause(h, start);
+}
+
+void gc(hby_State* h) {
+  if (!h->gc.can_gc) {
+    return;
+  }
+
+  uint64_t start = gc_clock();
+  // Finish the running cycle, since it may have missed garbage
+  while (h->gc.phase != gc_phase_idle) {
+    gc_work(h, INT_MAX);
+  }
+
+  start_cycle(h);
+  while (h->gc.phase != gc_phase_idle) {
+    gc_work(h, INT_MAX);
+  }
+  record_pause(h, start);
+}
+
+bool hby_gc_step(hby_State* h, int budget_us) {
+  if (!h->gc.can_gc) {
+    return false;
+  }
+
+  uint64_t start = gc_clock();
+  if (h->gc.phase == gc_phase_idle) {
+    // Not worth starting a cycle this far from the next one, but the nursery
+    // can be emptied ahead of time
+    if (h->gc.alloced < h->gc.next_gc / 2) {
+      if (h->gc.young != NULL) {
+        minor_gc(h);
+      }
+      return false;
+    }
+    start_cycle(h);
+  }
+
+  uint64_t deadline = start + (uint64_t)budget_us * 1000;
+  while (h->gc.phase != gc_phase_idle && gc_clock() < deadline) {
+    gc_work(h, gc_budget_work);
+  }
+  record_pause(h, start);
+  return h->gc.phase == gc_phase_idle;
+}
+
+void hby_gc_pauses(hby_State* h, hby_GcPauses* out) {
+  out->count = h->gc.pausec;
+  out->p50 = pause_percentile(h, 0.5);
+  out->p90 = pause_percentile(h, 0.9);
+  out->p99 = pause_percentile(h, 0.99);
+  out->max = h->gc.max_pause / 1000.0;
+}
+
 static void free_linked_list(hby_State* h, GcObj* head) {
   GcObj* obj = head;
   while (obj != NULL) {
@@ -334,5 +774,8 @@ void free_objs(hby_State* h) {
   finalize_udata(h, false);
   free_linked_list(h, h->gc.udata);
   free_linked_list(h, h->gc.objs);
+  free_linked_list(h, h->gc.sweeping);
+  free_linked_list(h, h->gc.young);
   free(h->gc.gray_stack);
+  free(h->gc.remembered);
 }
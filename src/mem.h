@@ -14,10 +14,37 @@
   reallocate(h, ptr, sizeof(T) * (plen), 0)
 
 void* reallocate(hby_State* h, void* ptr, size_t plen, size_t len);
+// Objects live in the slab, see `slab.h`
+void* alloc_cell(hby_State* h, size_t size);
+void free_cell(hby_State* h, void* ptr, size_t size);
+#define release_obj(h, T, ptr) free_cell(h, ptr, sizeof(T))
 void free_objs(hby_State* h);
 
 void gc(hby_State* h);
+void minor_gc(hby_State* h);
 void mark_obj(hby_State* h, GcObj* obj);
 void mark_val(hby_State* h, Val val);
+void barrier_slow(hby_State* h, GcObj* obj, GcObj* target);
+// For objects changed without `gc_barrier`, traces all of them again
+void barrier_back(hby_State* h, GcObj* obj);
+
+// Whether the running collection didn't reach this object. Minor collections
+// never free old objects
+static inline bool unreached(hby_State* h, GcObj* obj) {
+  if (h->gc.minor) {
+    return !obj->old && !obj->minor_marked;
+  }
+  return !obj->marked;
+}
+
+// Write barrier. Must be called after storing `val` inside `obj`, so minor
+// collections can find young objects that are only referenced by old ones, and
+// a running mark phase doesn't miss objects stored into already marked ones
+static inline void gc_barrier(hby_State* h, GcObj* obj, Val val) {
+  if (((obj->old && !obj->remembered)
+      || (obj->marked && h->gc.phase == gc_phase_mark)) && is_obj(val)) {
+    barrier_slow(h, obj, as_obj(val));
+  }
+}
 
 #endif // __HBY_MEM_H
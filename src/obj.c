@@ -11,12 +11,15 @@
 #define alloc_obj(h, ctype, hbytype) (ctype*)alloc_obj_impl(h, sizeof(ctype), hbytype)
 
 static GcObj* alloc_obj_impl(hby_State* h, size_t size, ObjType type) {
-  GcObj* obj = (GcObj*)reallocate(h, NULL, 0, size);
+  GcObj* obj = (GcObj*)alloc_cell(h, size);
   obj->type = type;
   obj->marked = false;
+  obj->minor_marked = false;
+  obj->old = false;
+  obj->remembered = false;
 
-  obj->next = h->gc.objs;
-  h->gc.objs = obj;
+  obj->next = h->gc.young;
+  h->gc.young = obj;
 
 #ifdef hby_log_gc
   printf("%p allocated %zu for type %d\n", (void*)obj, size, type);
@@ -40,43 +43,66 @@ GcMethod* create_c_method(hby_State* h, Val owner, GcCFn* fn) {
 }
 
 GcInst* create_inst(hby_State* h, GcStruct* s) {
-  GcInst* inst = alloc_obj(h, GcInst, obj_inst);
+  int fieldc = s->defaults.len;
+  GcInst* inst = (GcInst*)alloc_obj_impl(
+    h, sizeof(GcInst) + sizeof(Val) * fieldc, obj_inst);
   inst->_struct = s;
-
-  push(h, create_obj(inst));
-  init_table(&inst->fields);
-  copy_table(h, &s->members, &inst->fields);
-  pop(h);
+  inst->fieldc = fieldc;
+  for (int i = 0; i < fieldc; i++) {
+    inst->fields[i] = s->defaults.items[i];
+  }
   return inst;
 }
 
 GcStruct* create_struct(hby_State* h, GcStr* name) {
   GcStruct* s = alloc_obj(h, GcStruct, obj_struct);
   s->name = name;
+  reshape_struct(h, s);
   init_table(&s->staticm);
   init_table(&s->methods);
   init_table(&s->members);
+  init_varr(&s->defaults);
+  s->staticm.obj = (GcObj*)s;
+  s->methods.obj = (GcObj*)s;
+  s->members.obj = (GcObj*)s;
+  s->defaults.obj = (GcObj*)s;
   return s;
 }
 
+void reshape_struct(hby_State* h, GcStruct* s) {
+  s->shape = h->next_shape++;
+}
+
+void add_struct_member(hby_State* h, GcStruct* s, GcStr* name, Val val) {
+  int slot = member_slot(s, name);
+  if (slot != -1) {
+    s->defaults.items[slot] = val;
+    gc_barrier(h, (GcObj*)s, val);
+    return;
+  }
+
+  push_varr(h, &s->defaults, val);
+  set_table(h, &s->members, name, create_num(s->defaults.len - 1));
+  reshape_struct(h, s);
+}
+
 GcUpval* create_upval(hby_State* h, Val* loc) {
   GcUpval* upval = alloc_obj(h, GcUpval, obj_upval);
   upval->loc = loc;
   upval->closed = create_null();
   upval->next = NULL;
+  upval->fiber = NULL;
   return upval;
 }
 
 GcClosure* create_closure(hby_State* h, GcFn* fn) {
-  GcUpval** upvals = allocate(h, GcUpval*, fn->upvalc);
-  for (int i = 0; i < fn->upvalc; i++) {
-    upvals[i] = NULL;
-  }
-
-  GcClosure* closure = alloc_obj(h, GcClosure, obj_closure);
+  GcClosure* closure = (GcClosure*)alloc_obj_impl(
+    h, sizeof(GcClosure) + sizeof(GcUpval*) * fn->upvalc, obj_closure);
   closure->fn = fn;
-  closure->upvals = upvals;
   closure->upvalc = fn->upvalc;
+  for (int i = 0; i < fn->upvalc; i++) {
+    closure->upvals[i] = NULL;
+  }
   return closure;
 }
 
@@ -85,6 +111,7 @@ GcCFn* create_c_fn(hby_State* h, GcStr* name, hby_CFn fn, int arity) {
   c_fn->arity = arity;
   c_fn->name = name;
   c_fn->fn = fn;
+  c_fn->fast = NULL;
   return c_fn;
 }
 
@@ -95,7 +122,9 @@ GcFn* create_fn(hby_State* h, GcStr* file_path) {
   fn->name = NULL;
   fn->path = file_path;
   fn->upvalc = 0;
+  fn->slots = 0;
   init_chunk(&fn->chunk);
+  fn->chunk.consts.obj = (GcObj*)fn;
   return fn;
 }
 
@@ -103,12 +132,14 @@ GcEnum* create_enum(hby_State* h, GcStr* name) {
   GcEnum* _enum = alloc_obj(h, GcEnum, obj_enum);
   _enum->name = name;
   init_table(&_enum->vals);
+  _enum->vals.obj = (GcObj*)_enum;
   return _enum;
 }
 
 GcArr* create_arr(hby_State* h) {
   GcArr* arr = alloc_obj(h, GcArr, obj_arr);
   init_varr(&arr->varr);
+  arr->varr.obj = (GcObj*)arr;
   return arr;
 }
 
@@ -121,9 +152,13 @@ GcMap* create_map(hby_State* h) {
 }
 
 GcUData* create_udata(hby_State* h, size_t size) {
-  GcUData* udata = (GcUData*)reallocate(h, NULL, 0, sizeof(GcUData));
+  GcUData* udata = (GcUData*)alloc_cell(h, sizeof(GcUData));
   udata->obj.type = obj_udata;
+  // Userdata is only finalized by full collections, so it starts out old
   udata->obj.marked = false;
+  udata->obj.minor_marked = false;
+  udata->obj.old = true;
+  udata->obj.remembered = false;
   udata->obj.next = h->gc.udata;
   h->gc.udata = (GcObj*)udata;
 
@@ -140,11 +175,37 @@ GcUData* create_udata(hby_State* h, size_t size) {
   return udata;
 }
 
-static GcStr* alloc_str(hby_State* h, char* chars, int len, uint32_t hash) {
-  GcStr* str = alloc_obj(h, GcStr, obj_str);
+GcFiber* create_fiber(hby_State* h, Val fn) {
+  GcFiber* fiber = alloc_obj(h, GcFiber, obj_fiber);
+  fiber->status = fiber_suspended;
+  fiber->fn = fn;
+  fiber->caller = NULL;
+  fiber->err = NULL;
+  // The stacks are made on the first resume, so idle fibers stay small
+  fiber->frame_stack = NULL;
+  fiber->frame = NULL;
+  fiber->frame_cap = 0;
+  fiber->stack = NULL;
+  fiber->top = NULL;
+  fiber->stack_cap = 0;
+  fiber->open_upvals = NULL;
+  return fiber;
+}
+
+// Copies `chars` inline, or adopts them if `adopt` is true
+static GcStr* alloc_str(
+    hby_State* h, char* chars, int len, uint32_t hash, bool adopt) {
+  size_t size = sizeof(GcStr) + (adopt ? 0 : len + 1);
+  GcStr* str = (GcStr*)alloc_obj_impl(h, size, obj_str);
   str->len = len;
-  str->chars = chars;
   str->hash = hash;
+  if (adopt) {
+    str->chars = chars;
+  } else {
+    str->chars = str->inline_chars;
+    memcpy(str->chars, chars, len);
+    str->chars[len] = '\0';
+  }
 
   push(h, create_obj(str));
   set_table(h, &h->strs, str, create_null());
@@ -168,10 +229,7 @@ GcStr* copy_str(hby_State* h, const char* chars, int len) {
     return interned;
   }
 
-  char* copy = allocate(h, char, len + 1);
-  memcpy(copy, chars, len);
-  copy[len] = '\0';
-  return alloc_str(h, copy, len, hash);
+  return alloc_str(h, (char*)chars, len, hash, false);
 }
 
 GcStr* take_str(hby_State* h, char* chars, int len) {
@@ -181,5 +239,12 @@ GcStr* take_str(hby_State* h, char* chars, int len) {
     release_arr(h, char, chars, len + 1);
     return interned;
   }
-  return alloc_str(h, chars, len, hash);
+
+  if (len >= str_adopt_len) {
+    return alloc_str(h, chars, len, hash, true);
+  }
+
+  GcStr* str = alloc_str(h, chars, len, hash, false);
+  release_arr(h, char, chars, len + 1);
+  return str;
 }
@@ -21,11 +21,15 @@ typedef enum {
   obj_arr,
   obj_map,
   obj_udata,
+  obj_fiber,
 } ObjType;
 
 struct GcObj {
   ObjType type;
   bool marked; // Marked by the GC as reachable?
+  bool minor_marked; // Marked by the running minor collection?
+  bool old; // Survived a collection. Minor collections don't trace these
+  bool remembered; // Old object in the remembered set
   struct GcObj* next; // Linked list kept for GCing objects
 };
 
@@ -35,6 +39,7 @@ typedef struct GcUpval {
   Val* loc; 
   Val closed; // When the upvalue is popped off the stack, it is moved here
   struct GcUpval* next; // Next upvalue. Only used when it is on the stack
+  struct GcFiber* fiber; // Whose stack the value is on while it's open
 } GcUpval;
 
 typedef struct GcFn {
@@ -45,19 +50,26 @@ typedef struct GcFn {
   GcStr* name; // Name of this function
   GcStr* path; // The path to the file that contains this function
   int upvalc; // Number of captured upvalues
+  int slots; // Most stack slots a call uses, see `max_stack_chunk`
 } GcFn;
 
 typedef struct GcClosure {
   GcObj obj; // Object header
   GcFn* fn; // Wrapped object
-  GcUpval** upvals; // Captured upvalues
   int upvalc;
+  GcUpval* upvals[]; // Captured upvalues
 } GcClosure;
 
+// A native that never calls back into the VM. It reads its arguments in
+// place and returns its result, so calling it doesn't need a frame. The
+// receiver is at `args[-1]`
+typedef Val (*FastCFn)(hby_State* h, const Val* args, int argc);
+
 typedef struct GcCFn {
   GcObj obj; // Object header
   int arity; // Number of arguments. -1 means it's varadic
   hby_CFn fn; // The function ptr
+  FastCFn fast; // Called instead of `fn` if set
   GcStr* name; // Name of the function. Only used for stack traces and printing
 } GcCFn;
 
@@ -71,9 +83,15 @@ typedef struct {
 typedef struct GcStruct {
   GcObj obj; // Object header
   GcStr* name; // Struct name
+  // Changes whenever the members or methods do, so inline caches filled
+  // against an older layout miss
+  uint32_t shape;
 
   Table staticm; // Static methods
-  Table members; // Variables defined by the struct. Copied down to instances
+  // Names of the variables defined by the struct, mapped to their slot in
+  // an instance. Shared by every instance, so instances only store values
+  Table members;
+  VArr defaults; // Initial value of each slot. Copied down to instances
   Table methods; // Methods defined by the struct. Referenced by instances
 } GcStruct;
 
@@ -85,6 +103,7 @@ typedef struct GcArr {
 typedef struct {
   Val key;
   Val val;
+  uint32_t hash; // Hash of `key`, kept so growing doesn't rehash every key
 } MapItem;
 
 typedef struct {
@@ -97,7 +116,8 @@ typedef struct {
 typedef struct {
   GcObj obj; // Object header
   GcStruct* _struct; // The struct this instance is a child of
-  Table fields; // Struct members
+  int fieldc; // Number of slots in `fields`
+  Val fields[]; // Struct members, indexed by their slot in `_struct`
 } GcInst;
 
 typedef struct {
@@ -113,19 +133,68 @@ typedef union {
   GcCFn* c;
 } GcAnyFn;
 
+typedef enum {
+  fiber_suspended, // Not started yet, or yielded
+  fiber_running,
+  fiber_normal, // Resumed another fiber and waits for it
+  fiber_done, // Returned or raised an error
+} FiberStatus;
+
+// A call stack of its own, which can stop in the middle and continue later.
+// The stacks of the running fiber are in `hby_State`, the others keep theirs
+// here
+typedef struct GcFiber {
+  GcObj obj; // Object header
+  FiberStatus status;
+  Val fn; // Called on the first resume
+  struct GcFiber* caller; // The fiber that resumed this one
+  GcStr* err; // The error that ended the fiber, if any
+  struct CallFrame* frame_stack;
+  struct CallFrame* frame;
+  int frame_cap;
+  Val* stack;
+  Val* top;
+  int stack_cap;
+  GcUpval* open_upvals;
+} GcFiber;
+
 typedef struct {
   GcObj obj; // Object header
   Val owner; // The owner of this function
   GcAnyFn fn; // The wrapped function
 } GcMethod;
 
+// Strings adopted by `take_str` at least this long keep their buffer, shorter
+// ones are copied inline
+#define str_adopt_len 1024
+
 struct GcStr {
   GcObj obj; // Object header
   int len; // Length of the string
-  char* chars; // String data
   uint32_t hash; // String hash
+  char* chars; // String data. Points to `inline_chars` unless adopted
+  char inline_chars[];
 };
 
+// Slot of the member `name` in instances of `s`, or -1. Slots are handed out
+// in order, so an instance made before a member was added won't have it.
+static inline int member_slot(GcStruct* s, GcStr* name) {
+  Val slot;
+  if (!get_table(&s->members, name, &slot)) {
+    return -1;
+  }
+  return (int)as_num(slot);
+}
+
+static inline bool get_field(GcInst* inst, GcStr* name, Val* out) {
+  int slot = member_slot(inst->_struct, name);
+  if (slot == -1 || slot >= inst->fieldc) {
+    return false;
+  }
+  *out = inst->fields[slot];
+  return true;
+}
+
 static inline bool obj_of_type(Val val, ObjType type) {
   return is_obj(val) && as_obj(val)->type == type;
 }
@@ -145,6 +214,7 @@ static inline bool obj_of_type(Val val, ObjType type) {
 #define is_map(v)     obj_of_type(v, obj_map)
 #define is_str(v)     obj_of_type(v, obj_str)
 #define is_udata(v)   obj_of_type(v, obj_udata)
+#define is_fiber(v)   obj_of_type(v, obj_fiber)
 
 #define as_struct(v)  ((GcStruct*)as_obj(v))
 #define as_method(v)  ((GcMethod*)as_obj(v))
@@ -157,10 +227,28 @@ static inline bool obj_of_type(Val val, ObjType type) {
 #define as_arr(v)     ((GcArr*)as_obj(v))
 #define as_map(v)     ((GcMap*)as_obj(v))
 #define as_udata(v)   ((GcUData*)as_obj(v))
+#define as_fiber(v)   ((GcFiber*)as_obj(v))
 #define as_str(v)     ((GcStr*)as_obj(v))
 #define as_cstr(v)    (as_str(v)->chars)
 
+// Hash of a number or string constant, matching `same_const`
+static inline uint32_t const_hash(Val val) {
+  if (is_str(val)) {
+    return as_str(val)->hash;
+  }
+
+  double num = as_num(val);
+  uint64_t bits;
+  memcpy(&bits, &num, sizeof(double));
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
 GcStruct* create_struct(hby_State* h, GcStr* name);
+void reshape_struct(hby_State* h, GcStruct* s);
+void add_struct_member(hby_State* h, GcStruct* s, GcStr* name, Val val);
 GcMethod* create_method(hby_State* h, Val owner, GcClosure* fn);
 GcMethod* create_c_method(hby_State* h, Val owner, GcCFn* fn);
 GcInst* create_inst(hby_State* h, GcStruct* s);
@@ -172,6 +260,7 @@ GcEnum* create_enum(hby_State* h, GcStr* name);
 GcArr* create_arr(hby_State* h);
 GcMap* create_map(hby_State* h);
 GcUData* create_udata(hby_State* h, size_t size);
+GcFiber* create_fiber(hby_State* h, Val fn);
 GcStr* copy_str(hby_State* h, const char* chars, int len);
 GcStr* take_str(hby_State* h, char* chars, int len);
 
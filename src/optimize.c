@@ -0,0 +1,765 @@
+#include "optimize.h"
+
+#include <math.h>
+#include <string.h>
+#include "map.h"
+#include "mem.h"
+#include "obj.h"
+#include "state.h"
+#include "vm.h"
+
+// Passes are repeated while they find something, since folding one
+// expression can make another constant. This bounds jumps that form a cycle
+#define max_rounds 8
+// Switches with fewer constant cases compare them one by one
+#define min_table_cases 4
+
+// An instruction of the chunk being optimized. Nothing is moved until the
+// code is written again at the end, instructions are only marked removed
+typedef struct {
+  int start; // Offset in the code before optimizing
+  int len;
+  Bc bc; // Differs from the code when the instruction was changed
+  int operand; // The constant of a folded `bc_const` or `bc_switch_table`
+  bool folded; // Written from `bc` and `operand` instead of copied
+  int target; // Instruction jumped to, -1 if it doesn't jump
+  int jumps_in; // Jumps landing here
+  bool live;
+  bool reached;
+  int new_start;
+} Insn;
+
+typedef struct {
+  hby_State* h;
+  Chunk* c;
+  int len;
+  Insn* insns; // Has one more entry for the end of the code
+  int* const_index; // Open addressing over the numbers and strings in `c`
+  int const_cap; // 0 until a value is folded
+} Opt;
+
+// Where the offset of a jump is in its instruction, -1 if it doesn't jump
+static int jmp_operand(Bc bc) {
+  switch (bc) {
+    case bc_jmp:
+    case bc_loop:
+    case bc_false_jmp:
+    case bc_ineq_jmp:
+      return 1;
+    case bc_switch_table: return 3;
+    case bc_for_prep: return 4;
+    case bc_for_loop: return 5;
+    case bc_for_in: return 4;
+    default: return -1;
+  }
+}
+
+static bool jmps_back(Bc bc) {
+  return bc == bc_loop || bc == bc_for_loop;
+}
+
+static bool falls_through(Bc bc) {
+  switch (bc) {
+    case bc_jmp:
+    case bc_loop:
+    case bc_ret:
+    case bc_err:
+    case bc_tail_call:
+    case bc_tail_invoke:
+    case bc_switch_table:
+      return false;
+    default:
+      return true;
+  }
+}
+
+static bool decode(Opt* o) {
+  Chunk* c = o->c;
+  int* at = allocate(o->h, int, c->len + 1); // Offset to instruction
+  for (int i = 0; i <= c->len; i++) {
+    at[i] = -1;
+  }
+
+  o->len = 0;
+  for (int i = 0; i < c->len;) {
+    int len = bc_len(c, i);
+    if (len <= 0 || i + len > c->len) {
+      release_arr(o->h, int, at, c->len + 1);
+      return false;
+    }
+
+    // Only this pass makes tables, and their cases aren't followed
+    if (c->code[i] == bc_switch_table) {
+      release_arr(o->h, int, at, c->len + 1);
+      return false;
+    }
+
+    Insn* in = &o->insns[o->len];
+    in->start = i;
+    in->len = len;
+    in->bc = c->code[i];
+    in->folded = false;
+    in->live = true;
+    at[i] = o->len++;
+    i += len;
+  }
+  at[c->len] = o->len;
+
+  Insn* end = &o->insns[o->len];
+  end->start = c->len;
+  end->len = 0;
+  end->bc = bc_count;
+  end->live = true;
+
+  bool valid = true;
+  for (int i = 0; i < o->len; i++) {
+    Insn* in = &o->insns[i];
+    in->target = -1;
+    int operand = jmp_operand(in->bc);
+    if (operand == -1) {
+      continue;
+    }
+
+    int jmp = (c->code[in->start + operand] << 8)
+      | c->code[in->start + operand + 1];
+    int next = in->start + in->len;
+    int to = jmps_back(in->bc) ? next - jmp : next + jmp;
+    if (to < 0 || to > c->len || at[to] == -1) {
+      valid = false;
+      break;
+    }
+    in->target = at[to];
+  }
+
+  release_arr(o->h, int, at, c->len + 1);
+  return valid;
+}
+
+// The first instruction left at or after `i`
+static int next_live(Opt* o, int i) {
+  while (!o->insns[i].live) {
+    i++;
+  }
+  return i;
+}
+
+static void count_jumps(Opt* o) {
+  for (int i = 0; i <= o->len; i++) {
+    o->insns[i].jumps_in = 0;
+  }
+  for (int i = 0; i < o->len; i++) {
+    Insn* in = &o->insns[i];
+    if (in->live && in->target != -1) {
+      in->target = next_live(o, in->target);
+      o->insns[in->target].jumps_in++;
+    }
+  }
+}
+
+// Jumps to a removed instruction go on to the next one left
+static void remove_insn(Opt* o, int i) {
+  Insn* in = &o->insns[i];
+  in->live = false;
+  if (in->jumps_in > 0) {
+    o->insns[next_live(o, i)].jumps_in += in->jumps_in;
+  }
+  if (in->target != -1) {
+    o->insns[next_live(o, in->target)].jumps_in--;
+  }
+}
+
+static void set_target(Opt* o, Insn* in, int target) {
+  o->insns[next_live(o, in->target)].jumps_in--;
+  in->target = target;
+  o->insns[target].jumps_in++;
+}
+
+// Whether `from` can be made to jump to `to`. Conditional jumps only go
+// forward, `bc_for_loop` only back, and the distance must fit the operand,
+// which it keeps doing as the code only shrinks
+static bool can_jump(Opt* o, int from, int to) {
+  Insn* in = &o->insns[from];
+  int next = in->start + in->len;
+  int dist = o->insns[to].start - next;
+  switch (in->bc) {
+    case bc_jmp:
+    case bc_loop:
+      break;
+    case bc_for_loop:
+      if (to > from) {
+        return false;
+      }
+      break;
+    default:
+      if (to <= from) {
+        return false;
+      }
+      break;
+  }
+  return dist <= UINT16_MAX && -dist <= UINT16_MAX;
+}
+
+//
+// CONSTANT FOLDING
+//
+
+// The constant a `bc_const` or `bc_const_long` pushes
+static int const_index(Opt* o, Insn* in) {
+  uint8_t* code = &o->c->code[in->start];
+  if (in->folded) {
+    return in->operand;
+  } else if (in->bc == bc_const_long) {
+    return (code[1] << 16) | (code[2] << 8) | code[3];
+  }
+  return code[1];
+}
+
+// The value an instruction pushes, if it's a number, string, bool or null
+// known while compiling
+static bool const_val(Opt* o, Insn* in, Val* out) {
+  switch (in->bc) {
+    case bc_null: *out = create_null(); return true;
+    case bc_true: *out = create_bool(true); return true;
+    case bc_false: *out = create_bool(false); return true;
+    case bc_const:
+    case bc_const_long: {
+      Val val = o->c->consts.items[const_index(o, in)];
+      *out = val;
+      return is_num(val) || is_str(val);
+    }
+    default:
+      return false;
+  }
+}
+
+// The entry of `val` in the constant index, or the empty one it would go
+// in. Grows the index first, so the entry can always be filled
+static int* find_const(Opt* o, Val val) {
+  VArr* consts = &o->c->consts;
+  if ((consts->len + 1) * 4 > o->const_cap * 3) {
+    release_arr(o->h, int, o->const_index, o->const_cap);
+    o->const_cap = grow_cap(o->const_cap);
+    while ((consts->len + 1) * 4 > o->const_cap * 3) {
+      o->const_cap = grow_cap(o->const_cap);
+    }
+    o->const_index = allocate(o->h, int, o->const_cap);
+    for (int i = 0; i < o->const_cap; i++) {
+      o->const_index[i] = -1;
+    }
+    // The first of equal constants is kept, as the compiler would use it
+    for (int i = consts->len - 1; i >= 0; i--) {
+      Val item = consts->items[i];
+      if (is_num(item) || is_str(item)) {
+        *find_const(o, item) = i;
+      }
+    }
+  }
+
+  uint32_t mask = o->const_cap - 1;
+  uint32_t i = const_hash(val) & mask;
+  while (o->const_index[i] != -1
+      && !same_const(consts->items[o->const_index[i]], val)) {
+    i = (i + 1) & mask;
+  }
+  return &o->const_index[i];
+}
+
+// Make `in` push `val`, in place of instructions `room` bytes long. Fails
+// if there is no room for another constant, or for the long form of its index
+static bool set_val(Opt* o, Insn* in, Val val, int room) {
+  Bc bc = bc_const;
+  int index = 0;
+  if (is_null(val)) {
+    bc = bc_null;
+  } else if (is_bool(val)) {
+    bc = as_bool(val) ? bc_true : bc_false;
+  } else {
+    int* entry = find_const(o, val);
+    index = *entry == -1 ? o->c->consts.len : *entry;
+    if (index > UINT8_MAX) {
+      bc = bc_const_long;
+    }
+    if ((index > UINT8_MAX && room < 4) || index > 0xFFFFFF) {
+      return false;
+    }
+    if (*entry == -1) {
+      *entry = add_const_chunk(o->h, o->c, val);
+    }
+  }
+
+  in->bc = bc;
+  in->operand = index;
+  in->len = bc == bc_const ? 2 : bc == bc_const_long ? 4 : 1;
+  in->folded = true;
+  return true;
+}
+
+// Operations that could fail at runtime are left for the VM to report
+static bool fold_unary(Bc op, Val a, Val* out) {
+  switch (op) {
+    case bc_neg:
+      if (!is_num(a)) {
+        return false;
+      }
+      *out = create_num(-as_num(a));
+      return true;
+    case bc_not:
+      *out = create_bool(is_false(a));
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool fold_binary(hby_State* h, Bc op, Val a, Val b, Val* out) {
+  switch (op) {
+    case bc_eql: *out = create_bool(vals_eql(a, b)); return true;
+    case bc_neql: *out = create_bool(!vals_eql(a, b)); return true;
+    case bc_cat:
+      if ((!is_num(a) && !is_str(a)) || (!is_num(b) && !is_str(b))) {
+        return false;
+      }
+      push(h, a);
+      push(h, b);
+      vm_concat(h);
+      *out = pop(h);
+      return true;
+    default:
+      break;
+  }
+
+  if (!is_num(a) || !is_num(b)) {
+    return false;
+  }
+  double x = as_num(a);
+  double y = as_num(b);
+  switch (op) {
+    case bc_add: *out = create_num(x + y); return true;
+    case bc_sub: *out = create_num(x - y); return true;
+    case bc_mul: *out = create_num(x * y); return true;
+    case bc_div: *out = create_num(x / y); return true;
+    case bc_mod: *out = create_num(fmod(x, y)); return true;
+    case bc_gt: *out = create_bool(x > y); return true;
+    case bc_lt: *out = create_bool(x < y); return true;
+    case bc_gte: *out = create_bool(x >= y); return true;
+    case bc_lte: *out = create_bool(x <= y); return true;
+    default: return false;
+  }
+}
+
+// A constant condition. The jump either always happens or never does
+static bool fold_cond(Opt* o, int i, int jmp, Val val) {
+  Insn* in = &o->insns[jmp];
+  if (!is_false(val)) {
+    // The pop after it would drop the value, so neither is needed
+    int pop = next_live(o, jmp + 1);
+    remove_insn(o, jmp);
+    if (pop < o->len && o->insns[pop].bc == bc_pop
+        && o->insns[pop].jumps_in == 0) {
+      remove_insn(o, pop);
+      remove_insn(o, i);
+    }
+    return true;
+  }
+
+  // Jump past the pop at the target too, so nothing has to be pushed
+  int target = next_live(o, in->target);
+  in->bc = bc_jmp;
+  if (target < o->len && o->insns[target].bc == bc_pop) {
+    int after = next_live(o, target + 1);
+    if (can_jump(o, jmp, after)) {
+      set_target(o, in, after);
+      remove_insn(o, i);
+    }
+  }
+  return true;
+}
+
+// Fold the instructions starting at `i`, if they compute a constant
+static bool fold_at(Opt* o, int i) {
+  Val a;
+  if (!const_val(o, &o->insns[i], &a)) {
+    return false;
+  }
+
+  // Nothing may jump between the instructions folded together
+  int j = next_live(o, i + 1);
+  if (j == o->len || o->insns[j].jumps_in > 0) {
+    return false;
+  }
+
+  Val res;
+  Bc op = o->insns[j].bc;
+  if (op == bc_false_jmp) {
+    return fold_cond(o, i, j, a);
+  }
+  if (fold_unary(op, a, &res)) {
+    int room = o->insns[i].len + o->insns[j].len;
+    if (!set_val(o, &o->insns[i], res, room)) {
+      return false;
+    }
+    remove_insn(o, j);
+    return true;
+  }
+
+  Val b;
+  int k = next_live(o, j + 1);
+  if (!const_val(o, &o->insns[j], &b) || k == o->len
+      || o->insns[k].jumps_in > 0) {
+    return false;
+  }
+
+  push(o->h, a);
+  push(o->h, b);
+  bool folded = fold_binary(o->h, o->insns[k].bc, a, b, &res);
+  if (folded) {
+    push(o->h, res);
+    int room = o->insns[i].len + o->insns[j].len + o->insns[k].len;
+    folded = set_val(o, &o->insns[i], res, room);
+    pop(o->h);
+  }
+  pop(o->h);
+  pop(o->h);
+
+  if (folded) {
+    remove_insn(o, j);
+    remove_insn(o, k);
+  }
+  return folded;
+}
+
+static bool fold(Opt* o) {
+  bool changed = false;
+  int prev = -1;
+  int i = next_live(o, 0);
+  while (i < o->len) {
+    if (!fold_at(o, i)) {
+      prev = i;
+      i = next_live(o, i + 1);
+      continue;
+    }
+
+    // The result may be an operand of the instruction before, as in
+    // `1 + 2 * 3`, so that one is looked at again
+    changed = true;
+    if (prev != -1) {
+      i = prev;
+      prev = -1;
+    } else {
+      i = next_live(o, i);
+    }
+  }
+  return changed;
+}
+
+// The compiler gives literals long indices before it knows how many
+// constants come first, so some of them fit a byte after all
+static void shorten_consts(Opt* o) {
+  for (int i = 0; i < o->len; i++) {
+    Insn* in = &o->insns[i];
+    int index = in->bc == bc_const_long ? const_index(o, in) : -1;
+    if (index != -1 && index <= UINT8_MAX) {
+      in->bc = bc_const;
+      in->operand = index;
+      in->len = 2;
+      in->folded = true;
+    }
+  }
+}
+
+//
+// JUMPS
+//
+
+// Jumps to an unconditional jump go straight to where that one goes. A
+// `bc_false_jmp` to another one also takes it, since the value is the same
+static bool thread_jumps(Opt* o) {
+  bool changed = false;
+  for (int i = 0; i < o->len; i++) {
+    Insn* in = &o->insns[i];
+    if (!in->live || in->target == -1) {
+      continue;
+    }
+
+    int target = next_live(o, in->target);
+    for (int steps = 0; steps < o->len && target < o->len; steps++) {
+      Insn* to = &o->insns[target];
+      bool same_cond = in->bc == bc_false_jmp && to->bc == bc_false_jmp;
+      if (to->bc != bc_jmp && to->bc != bc_loop && !same_cond) {
+        break;
+      }
+
+      int next = next_live(o, to->target);
+      if (next == target || !can_jump(o, i, next)) {
+        break;
+      }
+      target = next;
+    }
+
+    if (target != next_live(o, in->target)) {
+      set_target(o, in, target);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// A jump to the instruction right after it does nothing
+static bool drop_empty_jumps(Opt* o) {
+  bool changed = false;
+  for (int i = 0; i < o->len; i++) {
+    Insn* in = &o->insns[i];
+    if (in->live && (in->bc == bc_jmp || in->bc == bc_false_jmp)
+        && next_live(o, in->target) == next_live(o, i + 1)) {
+      remove_insn(o, i);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static bool remove_unreached(Opt* o) {
+  int* work = allocate(o->h, int, o->len + 1);
+  int workc = 0;
+  for (int i = 0; i <= o->len; i++) {
+    o->insns[i].reached = false;
+  }
+
+  int first = next_live(o, 0);
+  o->insns[first].reached = true;
+  work[workc++] = first;
+  while (workc > 0) {
+    int i = work[--workc];
+    if (i == o->len) {
+      continue;
+    }
+
+    Insn* in = &o->insns[i];
+    int next[2] = {-1, -1};
+    if (falls_through(in->bc)) {
+      next[0] = next_live(o, i + 1);
+    }
+    if (in->target != -1) {
+      next[1] = next_live(o, in->target);
+    }
+    for (int n = 0; n < 2; n++) {
+      if (next[n] != -1 && !o->insns[next[n]].reached) {
+        o->insns[next[n]].reached = true;
+        work[workc++] = next[n];
+      }
+    }
+  }
+  release_arr(o->h, int, work, o->len + 1);
+
+  bool changed = false;
+  for (int i = 0; i < o->len; i++) {
+    if (o->insns[i].live && !o->insns[i].reached) {
+      o->insns[i].live = false;
+      changed = true;
+    }
+  }
+  count_jumps(o);
+  return changed;
+}
+
+//
+// SWITCH TABLES
+//
+
+// A case label a table can hold
+static bool table_label(Opt* o, Insn* in, Val* out) {
+  if (!const_val(o, in, out)) {
+    return false;
+  }
+  if (!is_num(*out)) {
+    return is_str(*out);
+  }
+  double num = as_num(*out);
+  return num == floor(num);
+}
+
+// A case compiles to its label, a `bc_ineq_jmp` to the next case and the
+// `bc_pop` of the value switched on. The jump of the case at `label`, or -1
+static int case_jmp(Opt* o, int label) {
+  int jmp = next_live(o, label + 1);
+  if (jmp == o->len || o->insns[jmp].bc != bc_ineq_jmp
+      || o->insns[jmp].jumps_in > 0) {
+    return -1;
+  }
+  return jmp;
+}
+
+// Put one `bc_switch_table` in place of the cases starting at `first`. The
+// chain stops at the first label that isn't constant, which is compared
+// like before since it could have effects
+static void make_table(Opt* o, int first) {
+  int casec = 0;
+  int label = first;
+  Val val;
+  while (label < o->len && table_label(o, &o->insns[label], &val)
+      && o->insns[label].jumps_in == (casec == 0 ? 0 : 1)) {
+    int jmp = case_jmp(o, label);
+    if (jmp == -1) {
+      break;
+    }
+    casec++;
+    label = next_live(o, o->insns[jmp].target);
+  }
+  if (casec < min_table_cases || o->c->consts.len > UINT16_MAX) {
+    return;
+  }
+
+  // Cases go to the index of their body's instruction until the code is
+  // written, see `place_cases`
+  GcMap* table = create_map(o->h);
+  int index = add_const_chunk(o->h, o->c, create_obj(table));
+  label = first;
+  for (int i = 0; i < casec; i++) {
+    table_label(o, &o->insns[label], &val);
+    int jmp = case_jmp(o, label);
+    int next = next_live(o, o->insns[jmp].target);
+
+    // The first of equal labels is the one that matches
+    Val body;
+    if (!get_map(table, val, &body)) {
+      set_map(o->h, table, val, create_num(next_live(o, jmp + 1)));
+    }
+
+    if (i > 0) {
+      remove_insn(o, label);
+    }
+    remove_insn(o, jmp);
+    label = next;
+  }
+
+  Insn* in = &o->insns[first];
+  in->bc = bc_switch_table;
+  in->operand = index;
+  in->len = 5;
+  in->folded = true;
+  in->target = label;
+  o->insns[label].jumps_in++;
+}
+
+static void place_cases(Opt* o, Insn* in) {
+  GcMap* table = as_map(o->c->consts.items[in->operand]);
+  int next = in->new_start + in->len;
+  for (int i = 0; i < table->item_cap; i++) {
+    MapItem* item = &table->items[i];
+    if (!is_null(item->key)) {
+      int body = next_live(o, (int)as_num(item->val));
+      item->val = create_num(o->insns[body].new_start - next);
+    }
+  }
+}
+
+//
+// OUTPUT
+//
+
+static void write_code(Opt* o) {
+  Chunk* c = o->c;
+  uint8_t* code = allocate(o->h, uint8_t, c->len);
+  int* lines = allocate(o->h, int, c->len);
+  memcpy(code, c->code, c->len);
+  for (int i = 0; i < c->len; i++) {
+    lines[i] = get_line_chunk(c, i);
+  }
+  c->linec = 0;
+
+  int pos = 0;
+  for (int i = 0; i <= o->len; i++) {
+    Insn* in = &o->insns[i];
+    if (in->live) {
+      in->new_start = pos;
+      pos += in->len;
+    }
+  }
+
+  for (int i = 0; i < o->len; i++) {
+    Insn* in = &o->insns[i];
+    if (!in->live) {
+      continue;
+    }
+
+    int at = in->new_start;
+    if (in->folded) {
+      c->code[at] = in->bc;
+      if (in->bc == bc_const) {
+        c->code[at + 1] = in->operand;
+      } else if (in->bc == bc_const_long) {
+        c->code[at + 1] = (in->operand >> 16) & 0xFF;
+        c->code[at + 2] = (in->operand >> 8) & 0xFF;
+        c->code[at + 3] = in->operand & 0xFF;
+      } else if (in->bc == bc_switch_table) {
+        c->code[at + 1] = (in->operand >> 8) & 0xFF;
+        c->code[at + 2] = in->operand & 0xFF;
+        place_cases(o, in);
+      }
+    } else {
+      memcpy(&c->code[at], &code[in->start], in->len);
+      c->code[at] = in->bc;
+    }
+    for (int b = 0; b < in->len; b++) {
+      int line = lines[in->folded ? in->start : in->start + b];
+      add_line_chunk(o->h, c, at + b, line);
+    }
+
+    if (in->target == -1) {
+      continue;
+    }
+
+    // Threading can turn a forward jump into a backward one and back
+    int next = at + in->len;
+    int to = o->insns[next_live(o, in->target)].new_start;
+    if (in->bc == bc_jmp || in->bc == bc_loop) {
+      c->code[at] = to >= next ? bc_jmp : bc_loop;
+    }
+    int jmp = jmps_back(c->code[at]) ? next - to : to - next;
+    int operand = at + jmp_operand(c->code[at]);
+    c->code[operand] = (jmp >> 8) & 0xFF;
+    c->code[operand + 1] = jmp & 0xFF;
+  }
+
+  release_arr(o->h, uint8_t, code, c->len);
+  release_arr(o->h, int, lines, c->len);
+  c->len = pos;
+}
+
+void optimize_chunk(hby_State* h, Chunk* c) {
+  // Folding strings uses the stack
+  reserve_call(h, 8);
+
+  Opt o;
+  o.h = h;
+  o.c = c;
+  o.const_index = NULL;
+  o.const_cap = 0;
+  int cap = c->len + 1;
+  o.insns = allocate(h, Insn, cap);
+  if (!decode(&o)) {
+    release_arr(h, Insn, o.insns, cap);
+    return;
+  }
+
+  shorten_consts(&o);
+  count_jumps(&o);
+  bool changed = true;
+  for (int round = 0; changed && round < max_rounds; round++) {
+    changed = fold(&o);
+    changed |= thread_jumps(&o);
+    changed |= remove_unreached(&o);
+    changed |= drop_empty_jumps(&o);
+  }
+
+  // Last, since the other passes only follow one target
+  for (int i = 0; i < o.len; i++) {
+    if (o.insns[i].live) {
+      make_table(&o, i);
+    }
+  }
+
+  write_code(&o);
+  release_arr(h, Insn, o.insns, cap);
+  release_arr(h, int, o.const_index, o.const_cap);
+}
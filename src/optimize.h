@@ -0,0 +1,13 @@
+#ifndef __HBY_OPTIMIZE_H
+#define __HBY_OPTIMIZE_H
+
+#include "common.h"
+#include "chunk.h"
+#include "hby.h"
+
+// Fold constant expressions, remove code that can never run, shorten chains
+// of jumps and constant indices, and turn switches on constants into jump
+// tables. Only for valid code that wasn't fused or quickened yet
+void optimize_chunk(hby_State* h, Chunk* c);
+
+#endif // __HBY_OPTIMIZE_H
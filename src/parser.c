@@ -8,6 +8,7 @@
 #include "chunk.h"
 #include "lexer.h"
 #include "obj.h"
+#include "optimize.h"
 
 #ifdef hby_print_bc
 # include "debug.h"
@@ -42,27 +43,38 @@ typedef struct Loop {
   struct Loop* enclosing;
 
   bool is_for;
+  // Run by `bc_for_loop` at the end, so continues jump forward to it
+  bool counted;
 
   int start; // The starting bytecode index of the loop
   int scope; // The scope depth that the loop lives in
 
   int breaks[uint8_count]; // Bytecode indices to break statements
   int breakc; // The amount of break statements
+  int continues[uint8_count]; // Jumps of continue statements in counted loops
+  int continuec;
 
   bool named; // Is this loop named?
   Tok name; // What is the name?
 } Loop;
 
+// Locals past the first 256 are read and set with the `_long` instructions.
+// A closure keeps the top bit of an upvalue's operand for whether it's local
+#define max_locals (1 << 15)
+// `bc_const_long` has a 24 bit index
+#define max_consts (1 << 24)
+
 // Represents a runtime value, at compile time
 typedef struct {
   Tok name;
   int depth; // Scope depth
   bool captured; // Is this value captured by a closure?
   bool is_const; // Is this variable a constant?
+  int enum_at; // Offset of the `bc_enum` that made this constant, or -1
 } Local;
 
 typedef struct {
-  uint8_t index; // The index that the upvalue lives on the stack
+  int index; // The index that the upvalue lives on the stack
   // Is this upvalue on a stack, or do we need to steal it from
   // an outer closure?
   bool is_local; 
@@ -80,13 +92,25 @@ typedef struct Compiler {
   GcFn* fn; // The function we're compiling to
   FnType type; // Type of function
 
-  Local locals[uint8_count]; // Representation of the local scope's variables
+  Local* locals; // Representation of the local scope's variables
   int localc; // Number of local variables
+  int local_cap;
 
   Upval upvals[uint8_count]; // Captured upvalues
 
+  // Where each number and string constant is, so it's only added once. An
+  // open addressed table of refs, see `const_at`. -1 where empty
+  int* const_index;
+  int const_cap;
+  int constc;
+  // Literals that didn't fit in the first 256 constants. They go after the
+  // rest once the function is done, see `bc_const_long`
+  VArr long_consts;
+
   int scope; // Current scope depth
   Loop* loop; // Innermost loop
+  int last_call; // Last `bc_call` or `bc_invoke`, for tail calls
+  int math_read; // Offset of the last read of the global `math`, for intrinsics
 } Compiler;
 
 static Chunk* cur_chunk(Parser* p) {
@@ -173,18 +197,181 @@ static void write_2bc(Parser* p, uint8_t byte1, uint8_t byte2) {
   write_bc(p, byte2);
 }
 
-static uint8_t create_const(Parser* p, Val val) {
-  int c = add_const_chunk(p->h, cur_chunk(p), val);
-  if (c > UINT8_MAX) {
+//
+// CONSTANTS
+//
+
+// A constant of the function being compiled. Below `uint16_count` it's an
+// index into the chunk's constants, else into `long_consts`
+static Val const_at(Compiler* compiler, int ref) {
+  if (ref < uint16_count) {
+    return compiler->fn->chunk.consts.items[ref];
+  }
+  return compiler->long_consts.items[ref - uint16_count];
+}
+
+// The entry of `val` in the index, or the empty one it would go in
+static int* find_const(Compiler* compiler, Val val) {
+  uint32_t mask = compiler->const_cap - 1;
+  uint32_t i = const_hash(val) & mask;
+  while (compiler->const_index[i] != -1
+      && !same_const(const_at(compiler, compiler->const_index[i]), val)) {
+    i = (i + 1) & mask;
+  }
+  return &compiler->const_index[i];
+}
+
+// Only numbers and strings are looked up. Anything else is never the same
+static bool indexed_const(Val val) {
+  return is_num(val) || is_str(val);
+}
+
+// Where `val` already is, -1 if it isn't a constant yet
+static int lookup_const(Compiler* compiler, Val val) {
+  if (compiler->const_cap == 0 || !indexed_const(val)) {
+    return -1;
+  }
+  return *find_const(compiler, val);
+}
+
+static void index_const(Parser* p, Val val, int ref) {
+  Compiler* compiler = p->compiler;
+  if (!indexed_const(val)) {
+    return;
+  }
+
+  if ((compiler->constc + 1) * 4 > compiler->const_cap * 3) {
+    int old_cap = compiler->const_cap;
+    int* old = compiler->const_index;
+    compiler->const_cap = grow_cap(old_cap);
+    compiler->const_index = allocate(p->h, int, compiler->const_cap);
+    for (int i = 0; i < compiler->const_cap; i++) {
+      compiler->const_index[i] = -1;
+    }
+    for (int i = 0; i < old_cap; i++) {
+      if (old[i] != -1) {
+        *find_const(compiler, const_at(compiler, old[i])) = old[i];
+      }
+    }
+    release_arr(p->h, int, old, old_cap);
+  }
+
+  int* entry = find_const(compiler, val);
+  if (*entry == -1) {
+    compiler->constc++;
+  }
+  *entry = ref;
+}
+
+// Index of `val` that fits in a byte, -1 if those are all taken
+static int short_const(Parser* p, Val val) {
+  int ref = lookup_const(p->compiler, val);
+  if (ref != -1 && ref < uint8_count) {
+    return ref;
+  }
+
+  Chunk* chunk = cur_chunk(p);
+  if (chunk->consts.len > UINT8_MAX) {
+    return -1;
+  }
+  int index = add_const_chunk(p->h, chunk, val);
+  index_const(p, val, index);
+  return index;
+}
+
+// Index of a name or function, which instructions take as 16 bits
+static uint16_t wide_const(Parser* p, Val val) {
+  int ref = lookup_const(p->compiler, val);
+  if (ref != -1 && ref < uint16_count) {
+    return ref;
+  }
+
+  Chunk* chunk = cur_chunk(p);
+  if (chunk->consts.len > UINT16_MAX) {
+    err(p, err_msg_max_consts);
+    return 0;
+  }
+  int index = add_const_chunk(p->h, chunk, val);
+  index_const(p, val, index);
+  return index;
+}
+
+static int long_const(Parser* p, Val val) {
+  VArr* longs = &p->compiler->long_consts;
+  if (longs->len >= max_consts - uint16_count) {
     err(p, err_msg_max_consts);
     return 0;
   }
-  return (uint8_t)c;
+
+  push(p->h, val);
+  push_varr(p->h, longs, val);
+  pop(p->h);
+  int ref = uint16_count + longs->len - 1;
+  index_const(p, val, ref);
+  return ref;
+}
+
+// Literals in `long_consts` go after the other constants, now that there
+// will be no more of those
+static void place_long_consts(Parser* p) {
+  Chunk* chunk = cur_chunk(p);
+  VArr* longs = &p->compiler->long_consts;
+  if (longs->len == 0) {
+    return;
+  }
+
+  int start = chunk->consts.len;
+  for (int i = 0; i < longs->len; i++) {
+    add_const_chunk(p->h, chunk, longs->items[i]);
+  }
+
+  uint8_t* code = chunk->code;
+  for (int i = 0, len; i < chunk->len; i += len) {
+    len = bc_len(chunk, i);
+    if (len <= 0) {
+      return;
+    }
+    if (code[i] != bc_const_long) {
+      continue;
+    }
+
+    // The operand is still a ref, see `const_at`. Only the ones into
+    // `long_consts` move
+    int ref = (code[i + 1] << 16) | (code[i + 2] << 8) | code[i + 3];
+    if (ref >= uint16_count) {
+      int index = start + ref - uint16_count;
+      code[i + 1] = (index >> 16) & 0xFF;
+      code[i + 2] = (index >> 8) & 0xFF;
+      code[i + 3] = index & 0xFF;
+    }
+  }
+}
+
+// Each property access and invoke gets its own inline cache in the chunk
+static void write_cache(Parser* p) {
+  int cache = add_cache_chunk(p->h, cur_chunk(p));
+  if (cache > UINT16_MAX) {
+    err(p, err_msg_max_caches);
+  }
+
+  write_bc(p, (cache >> 8) & 0xFF);
+  write_bc(p, cache & 0xFF);
+}
+
+// An instruction with a 16 bit constant index, see `wide_const`
+static void write_wide(Parser* p, uint8_t byte, uint16_t index) {
+  write_bc(p, byte);
+  write_2bc(p, (index >> 8) & 0xFF, index & 0xFF);
+}
+
+static void write_prop(Parser* p, uint8_t byte, uint16_t name) {
+  write_wide(p, byte, name);
+  write_cache(p);
 }
 
 static void write_err(Parser* p, const char* msg) {
-  write_bc(p, bc_err);
-  write_bc(p, create_const(p, create_obj(copy_str(p->h, msg, strlen(msg)))));
+  Val val = create_obj(copy_str(p->h, msg, strlen(msg)));
+  write_wide(p, bc_err, wide_const(p, val));
 }
 
 static void write_loop(Parser* p, int loop_start) {
@@ -222,8 +409,50 @@ static void write_ret(Parser* p) {
   write_bc(p, bc_ret);
 }
 
+// Return the expression just compiled
+static void write_ret_expr(Parser* p) {
+  // A call right before returning can reuse the frame. The `bc_ret` stays,
+  // since jumps out of the expression can still land on it
+  Chunk* chunk = cur_chunk(p);
+  int call = p->compiler->last_call;
+  if (call != -1 && call < chunk->len
+      && (chunk->code[call] == bc_call || chunk->code[call] == bc_invoke)
+      && call + bc_len(chunk, call) == chunk->len) {
+    chunk->code[call] = chunk->code[call] == bc_call
+      ? bc_tail_call
+      : bc_tail_invoke;
+  }
+  write_bc(p, bc_ret);
+}
+
+// Push the literal `val`. Once the first 256 constants are taken, new ones
+// take `bc_const_long`
 static void write_const(Parser* p, Val val) {
-  write_2bc(p, bc_const, create_const(p, val));
+  int ref = lookup_const(p->compiler, val);
+  if (ref == -1) {
+    ref = short_const(p, val);
+  }
+  if (ref == -1) {
+    ref = long_const(p, val);
+  }
+
+  if (ref < uint8_count) {
+    write_2bc(p, bc_const, ref);
+    return;
+  }
+  write_2bc(p, bc_const_long, (ref >> 16) & 0xFF);
+  write_2bc(p, (ref >> 8) & 0xFF, ref & 0xFF);
+}
+
+static Local* push_local(Parser* p) {
+  Compiler* compiler = p->compiler;
+  if (compiler->local_cap < compiler->localc + 1) {
+    int old_cap = compiler->local_cap;
+    compiler->local_cap = grow_cap(old_cap);
+    compiler->locals = grow_arr(
+      p->h, Local, compiler->locals, old_cap, compiler->local_cap);
+  }
+  return &compiler->locals[compiler->localc++];
 }
 
 static void init_compiler(Parser* p, Compiler* compiler, FnType type) {
@@ -232,15 +461,24 @@ static void init_compiler(Parser* p, Compiler* compiler, FnType type) {
   compiler->fn = NULL;
   compiler->type = type;
 
+  compiler->locals = NULL;
   compiler->localc = 0;
+  compiler->local_cap = 0;
   compiler->scope = 0;
 
+  compiler->const_index = NULL;
+  compiler->const_cap = 0;
+  compiler->constc = 0;
+  init_varr(&compiler->long_consts);
+
   GcStr* path = copy_str(p->h, p->file_path, strlen(p->file_path));
   push(p->h, create_obj(path));
   compiler->fn = create_fn(p->h, path);
   pop(p->h);
 
   compiler->loop = NULL;
+  compiler->last_call = -1;
+  compiler->math_read = -1;
 
   p->compiler = compiler;
 
@@ -250,11 +488,14 @@ static void init_compiler(Parser* p, Compiler* compiler, FnType type) {
     } else {
       compiler->fn->name = copy_str(p->h, "anonymous", 9);
     }
+    gc_barrier(p->h, &compiler->fn->obj, create_obj(compiler->fn->name));
   }
 
-  Local* local = &p->compiler->locals[p->compiler->localc++];
+  Local* local = push_local(p);
   local->depth = 0;
   local->captured = false;
+  local->is_const = false;
+  local->enum_at = -1;
 
   if (type != FnType_fn) {
     local->name.start = "self";
@@ -268,13 +509,25 @@ static void init_compiler(Parser* p, Compiler* compiler, FnType type) {
 static GcFn* end_compiler(Parser* p) {
   write_ret(p);
   GcFn* fn = p->compiler->fn;
+  if (p->errc == 0) {
+    place_long_consts(p);
+    optimize_chunk(p->h, &fn->chunk);
+  }
+  fn->slots = max_stack_chunk(p->h, &fn->chunk, 1 + fn->arity + fn->variadic);
+  fuse_chunk(&fn->chunk);
+  // Nothing is written to the chunk after this
+  trim_chunk(p->h, &fn->chunk);
 
 #ifdef hby_print_bc
   print_chunk(
     p->h, cur_chunk(p), fn->name != NULL ? fn->name->chars : "<script>");
 #endif
 
-  p->compiler = p->compiler->enclosing;
+  Compiler* compiler = p->compiler;
+  release_arr(p->h, Local, compiler->locals, compiler->local_cap);
+  release_arr(p->h, int, compiler->const_index, compiler->const_cap);
+  free_varr(p->h, &compiler->long_consts);
+  p->compiler = compiler->enclosing;
   return fn;
 }
 
@@ -299,7 +552,10 @@ static void begin_loop(Parser* p, Loop* loop) {
   loop->scope = p->compiler->scope;
   loop->enclosing = p->compiler->loop;
   loop->named = false;
+  loop->is_for = false;
+  loop->counted = false;
   loop->breakc = 0;
+  loop->continuec = 0;
 
   p->compiler->loop = loop;
 }
@@ -345,8 +601,23 @@ static void end_scope(Parser* p) {
   p->compiler->localc -= discarded;
 }
 
-static uint8_t ident_const(Parser* p, Tok* name) {
-  return create_const(p, create_obj(copy_str(p->h, name->start, name->len)));
+static uint16_t ident_const(Parser* p, Tok* name) {
+  return wide_const(p, create_obj(copy_str(p->h, name->start, name->len)));
+}
+
+// Globals are resolved to their slot here, so reading one doesn't need a lookup
+static uint16_t global_ref(Parser* p, Tok* name) {
+  GcStr* str = copy_str(p->h, name->start, name->len);
+  push(p->h, create_obj(str));
+  int slot = find_global(p->h, str);
+  pop(p->h);
+
+  int ref = add_global_chunk(p->h, cur_chunk(p), slot);
+  if (ref > UINT16_MAX) {
+    err(p, err_msg_max_globals);
+    return 0;
+  }
+  return (uint16_t)ref;
 }
 
 static int resolve_local(Parser* p, Compiler* compiler, Tok* name) {
@@ -362,7 +633,7 @@ static int resolve_local(Parser* p, Compiler* compiler, Tok* name) {
   return -1;
 }
 
-static int add_upvalue(Parser* p, Compiler* compiler, uint8_t index, bool is_local) {
+static int add_upvalue(Parser* p, Compiler* compiler, int index, bool is_local) {
   int upvalc = compiler->fn->upvalc;
 
   for (int i = 0; i < upvalc; i++) {
@@ -378,7 +649,9 @@ static int add_upvalue(Parser* p, Compiler* compiler, uint8_t index, bool is_loc
   }
 
   compiler->upvals[upvalc].is_local = is_local;
-  compiler->upvals[upvalc].is_const = compiler->locals[index].is_const;
+  compiler->upvals[upvalc].is_const = is_local
+    ? compiler->enclosing->locals[index].is_const
+    : compiler->enclosing->upvals[index].is_const;
   compiler->upvals[upvalc].index = index;
   return compiler->fn->upvalc++;
 }
@@ -393,13 +666,13 @@ static int resolve_upval(Parser* p, Compiler* compiler, Tok* name) {
   int local = resolve_local(p, compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].captured = true;
-    return add_upvalue(p, compiler, (uint8_t)local, true);
+    return add_upvalue(p, compiler, local, true);
   }
 
   // Steal upvalues from the outer scope.
   int upval = resolve_upval(p, compiler->enclosing, name);
   if (upval != -1) {
-    return add_upvalue(p, compiler, (uint8_t)upval, false);
+    return add_upvalue(p, compiler, upval, false);
   }
 
   // Could not find variable to capture
@@ -407,16 +680,17 @@ static int resolve_upval(Parser* p, Compiler* compiler, Tok* name) {
 }
 
 static void add_local(Parser* p, Tok name, bool is_const) {
-  if (p->compiler->localc == uint8_count) {
+  if (p->compiler->localc == max_locals) {
     err(p, err_msg_max_locals);
     return;
   }
 
-  Local* local = &p->compiler->locals[p->compiler->localc++];
+  Local* local = push_local(p);
   local->name = name;
   local->depth = -1;
   local->captured = false;
   local->is_const = is_const;
+  local->enum_at = -1;
 }
 
 static void decl_var(Parser* p, bool is_const) {
@@ -595,6 +869,7 @@ static uint8_t arg_list(Parser* p) {
 
 static void call_expr(Parser* p, bool can_assign) {
   uint8_t argc = arg_list(p);
+  p->compiler->last_call = cur_chunk(p)->len;
   write_2bc(p, bc_call, argc);
 }
 
@@ -608,7 +883,7 @@ static void instance_expr(Parser* p, bool can_assign) {
     expect(p, tok_eql, err_msg_expect("="));
 
     expr(p);
-    write_2bc(p, bc_init_prop, ident_const(p, &name));
+    write_wide(p, bc_init_prop, ident_const(p, &name));
 
     if (!consume(p, tok_comma) && !check(p, tok_rbrace)) {
       err(p, err_msg_expect(","));
@@ -620,30 +895,38 @@ static void instance_expr(Parser* p, bool can_assign) {
 
 static void dot_expr(Parser* p, bool can_assign) {
   expect(p, tok_ident, err_msg_expect("."));
-  uint8_t name = ident_const(p, &p->prev);
+  Tok member = p->prev;
+  uint16_t name = ident_const(p, &member);
 
 #define shorthand_op(op) \
   do { \
-    write_2bc(p, bc_push_prop, name); \
+    write_prop(p, bc_push_prop, name); \
     expr(p); \
     write_bc(p, op); \
-    write_2bc(p, bc_set_prop, name); \
+    write_prop(p, bc_set_prop, name); \
   } while (false)
 #define compound_op(op) \
   do { \
-    write_2bc(p, bc_push_prop, name); \
-    write_2bc(p, bc_const, create_const(p, create_num(1))); \
+    write_prop(p, bc_push_prop, name); \
+    write_const(p, create_num(1)); \
     write_bc(p, op); \
-    write_2bc(p, bc_set_prop, name); \
+    write_prop(p, bc_set_prop, name); \
   } while (false)
 
   if (can_assign && consume(p, tok_eql)) {
     expr(p);
-    write_2bc(p, bc_set_prop, name);
+    write_prop(p, bc_set_prop, name);
   } else if (consume(p, tok_lparen)) {
     uint8_t argc = arg_list(p);
-    write_2bc(p, bc_invoke, name);
+    // Arrays and strings get their length without a call
+    bool len = argc == 0 && member.len == 3
+      && memcmp(member.start, "len", 3) == 0;
+    if (!len) {
+      p->compiler->last_call = cur_chunk(p)->len;
+    }
+    write_wide(p, len ? bc_invoke_len : bc_invoke, name);
     write_bc(p, argc);
+    write_cache(p);
   } else if (can_assign && consume(p, tok_plus_eql)) {
     shorthand_op(bc_add);
   } else if (can_assign && consume(p, tok_minus_eql)) {
@@ -659,7 +942,7 @@ static void dot_expr(Parser* p, bool can_assign) {
   } else if (can_assign && consume(p, tok_minus_minus)) {
     compound_op(bc_sub);
   } else {
-    write_2bc(p, bc_get_prop, name);
+    write_prop(p, bc_get_prop, name);
   }
 
 #undef shorthand_op
@@ -680,7 +963,7 @@ static void subscript_expr(Parser* p, bool can_assign) {
 #define compound_op(op) \
   do { \
     write_bc(p, bc_push_subscript); \
-    write_2bc(p, bc_const, create_const(p, create_num(1))); \
+    write_const(p, create_num(1)); \
     write_bc(p, op); \
     write_bc(p, bc_set_subscript); \
   } while (false)
@@ -709,10 +992,38 @@ static void subscript_expr(Parser* p, bool can_assign) {
 #undef compound_op
 }
 
+static int find_intrinsic(Parser* p, Tok* name) {
+  // Only right after reading the global, so `math` isn't anything else
+  if (p->compiler->math_read != cur_chunk(p)->len - 3) {
+    return -1;
+  }
+
+  for (int i = 0; i < intrinsic_count; i++) {
+    const char* intrinsic = intrinsic_infos[i].name;
+    if ((int)strlen(intrinsic) == name->len
+        && memcmp(intrinsic, name->start, name->len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 static void static_dot_expr(Parser* p, bool can_assign) {
   expect(p, tok_ident, err_msg_expect_ident);
-  uint8_t name = ident_const(p, &p->prev);
-  write_2bc(p, bc_get_static, name);
+  Tok member = p->prev;
+  uint16_t name = ident_const(p, &member);
+
+  // `math` stays on the stack, so the VM can check it's still the real one
+  int intrinsic = find_intrinsic(p, &member);
+  if (intrinsic != -1 && consume(p, tok_lparen)) {
+    uint8_t argc = arg_list(p);
+    write_2bc(p, bc_intrinsic, intrinsic);
+    write_2bc(p, (name >> 8) & 0xFF, name & 0xFF);
+    write_bc(p, argc);
+    return;
+  }
+
+  write_wide(p, bc_get_static, name);
 }
 
 static void function(Parser* p, FnType type, bool is_lambda);
@@ -739,6 +1050,24 @@ static void check_const(Parser* p, uint8_t setter, int arg) {
   }
 }
 
+// Globals take a 16 bit reference, everything else a byte. Locals past the
+// first 256 use the long form of the instruction
+static void write_var(Parser* p, uint8_t op, int arg) {
+  if (arg > UINT8_MAX && op == bc_get_local) {
+    op = bc_get_local_long;
+  } else if (arg > UINT8_MAX && op == bc_set_local) {
+    op = bc_set_local_long;
+  }
+
+  if (op == bc_get_global || op == bc_get_local_long
+      || op == bc_set_local_long) {
+    write_2bc(p, op, (arg >> 8) & 0xFF);
+    write_bc(p, arg & 0xFF);
+  } else {
+    write_2bc(p, op, (uint8_t)arg);
+  }
+}
+
 static void named_var(Parser* p, Tok name, bool can_assign) {
   if (p->in_expr_stat && consume(p, tok_comma)) { // Multiple assignment
     Tok names[UINT8_MAX];
@@ -766,17 +1095,12 @@ static void named_var(Parser* p, Tok name, bool can_assign) {
       } else if ((arg = resolve_upval(p, p->compiler, &names[i])) != -1) {
         setter = bc_set_upval;
       } else {
-        arg = ident_const(p, &names[i]);
-        GcStr* name = as_str(cur_chunk(p)->consts.items[arg]);
-        Val v;
-        if (get_table(&p->h->global_consts, name, &v)) {
-          err(p, err_msg_assign_const);
-        }
-        setter = bc_get_global;
+        err(p, err_msg_assign_global);
+        return;
       }
 
       write_2bc(p, bc_destruct_array, i);
-      write_2bc(p, setter, (uint8_t)arg);
+      write_var(p, setter, arg);
       write_bc(p, bc_pop);
     }
 
@@ -792,32 +1116,35 @@ static void named_var(Parser* p, Tok name, bool can_assign) {
     getter = bc_get_upval;
     setter = bc_set_upval;
   } else {
-    arg = ident_const(p, &name);
+    arg = global_ref(p, &name);
     getter = bc_get_global;
     setter = bc_get_global;
+    if (name.len == 4 && memcmp(name.start, "math", 4) == 0) {
+      p->compiler->math_read = cur_chunk(p)->len;
+    }
   }
 
 #define shorthand_op(op) \
   do { \
     check_const(p, setter, arg); \
-    write_2bc(p, getter, (uint8_t)arg); \
+    write_var(p, getter, arg); \
     expr(p); \
     write_bc(p, op); \
-    write_2bc(p, setter, (uint8_t)arg); \
+    write_var(p, setter, arg); \
   } while (false)
 #define compound_op(op) \
   do { \
     check_const(p, setter, arg); \
-    write_2bc(p, getter, (uint8_t)arg); \
-    write_2bc(p, bc_const, create_const(p, create_num(1))); \
+    write_var(p, getter, arg); \
+    write_const(p, create_num(1)); \
     write_bc(p, op); \
-    write_2bc(p, setter, (uint8_t)arg); \
+    write_var(p, setter, arg); \
   } while (false)
 
   if (can_assign && consume(p, tok_eql)) {
     check_const(p, setter, arg);
     expr(p);
-    write_2bc(p, setter, (uint8_t)arg);
+    write_var(p, setter, arg);
   } else if (can_assign && consume(p, tok_plus_eql)) {
     shorthand_op(bc_add);
   } else if (can_assign && consume(p, tok_minus_eql)) {
@@ -833,7 +1160,7 @@ static void named_var(Parser* p, Tok name, bool can_assign) {
   } else if (can_assign && consume(p, tok_minus_minus)) {
     compound_op(bc_sub);
   } else {
-    write_2bc(p, getter, (uint8_t)arg);
+    write_var(p, getter, arg);
   }
 
 #undef shorthand_op
@@ -959,6 +1286,7 @@ ParseRule rules[] = {
   [tok_case]        = {NULL, NULL, Prec_none},
   [tok_break]       = {NULL, NULL, Prec_none},
   [tok_continue]    = {NULL, NULL, Prec_none},
+  [tok_in]          = {NULL, NULL, Prec_none},
   [tok_unreachable] = {unreachable_expr, NULL, Prec_none},
   [tok_plus_eql]    = {NULL, NULL, Prec_none},
   [tok_minus_eql]   = {NULL, NULL, Prec_none},
@@ -1045,8 +1373,8 @@ static void var_decl(Parser* p, bool is_const) {
       write_2bc(p, bc_destruct_array, i);
       mark_init(p);
 
-      uint8_t local = resolve_local(p, p->compiler, &names[i]);
-      write_2bc(p, bc_set_local, local);
+      int local = resolve_local(p, p->compiler, &names[i]);
+      write_var(p, bc_set_local, local);
       write_bc(p, bc_pop);
     }
     write_bc(p, bc_pop); // The expression result
@@ -1059,7 +1387,12 @@ static void var_decl(Parser* p, bool is_const) {
 }
 
 static void function(Parser* p, FnType type, bool is_lambda) {
-  mark_init(p);
+  // A local being defined can refer to the function it's set to, but others
+  // keep the scope they were declared in
+  Compiler* outer = p->compiler;
+  if (outer->localc > 0 && outer->locals[outer->localc - 1].depth == -1) {
+    mark_init(p);
+  }
 
   Compiler compiler;
   init_compiler(p, &compiler, type);
@@ -1089,7 +1422,7 @@ static void function(Parser* p, FnType type, bool is_lambda) {
 
   if (consume(p, tok_rarrow)) {
     expr(p);
-    write_bc(p, bc_ret);
+    write_ret_expr(p);
 
     if (!is_lambda) {
       // When a function is not a lambda, it doesn't check for a semicolon.
@@ -1102,11 +1435,15 @@ static void function(Parser* p, FnType type, bool is_lambda) {
   }
 
   GcFn* fn = end_compiler(p);
-  write_2bc(p, bc_closure, create_const(p, create_obj(fn)));
+  write_wide(p, bc_closure, wide_const(p, create_obj(fn)));
 
   for (int i = 0; i < fn->upvalc; i++) {
-    write_bc(p, compiler.upvals[i].is_local ? 1 : 0);
-    write_bc(p, compiler.upvals[i].index);
+    // The top bit tells locals from upvalues of the enclosing function
+    int index = compiler.upvals[i].index;
+    if (compiler.upvals[i].is_local) {
+      index |= 0x8000;
+    }
+    write_2bc(p, (index >> 8) & 0xFF, index & 0xFF);
   }
 }
 
@@ -1116,29 +1453,29 @@ static void function_decl(Parser* p) {
   function(p, FnType_fn, false);
 }
 
-static uint8_t method(Parser* p, bool is_static) {
+static uint16_t method(Parser* p, bool is_static) {
   expect(p, tok_ident, err_msg_expect_ident);
 
   Tok name = p->prev;
   p->last_name_valid = true;
   p->last_name = name;
 
-  uint8_t name_const = ident_const(p, &name);
+  uint16_t name_const = ident_const(p, &name);
 
   FnType type = is_static ? FnType_fn : FnType_method;
   function(p, type, false);
   if (!is_static) {
-    write_2bc(p, bc_method, name_const);
+    write_wide(p, bc_method, name_const);
   }
   return name_const;
 }
 
 static void sub_struct_decl(Parser* p, bool all_static);
-static void enum_body(Parser* p, uint8_t name_const);
+static void enum_body(Parser* p, uint16_t name_const);
 
 static void struct_body(Parser* p, bool all_static) {
   bool is_static = all_static;
-  uint8_t static_name = 0;
+  uint16_t static_name = 0;
 
   if (consume(p, tok_fn)) { // Member functions
     static_name = method(p, all_static);
@@ -1153,7 +1490,7 @@ static void struct_body(Parser* p, bool all_static) {
       write_bc(p, bc_null);
     }
 
-    write_2bc(p, bc_member, ident_const(p, &name));
+    write_wide(p, bc_member, ident_const(p, &name));
     expect(p, tok_semicolon, err_msg_expect(";"));
   } else if (consume(p, tok_const)) { // Static consts
     expect(p, tok_ident, err_msg_expect_ident);
@@ -1174,7 +1511,7 @@ static void struct_body(Parser* p, bool all_static) {
     } else if (consume(p, tok_struct)) { // Static structs
       expect(p, tok_ident, err_msg_expect_ident);
       static_name = ident_const(p, &p->prev);
-      write_2bc(p, bc_struct, static_name);
+      write_wide(p, bc_struct, static_name);
       sub_struct_decl(p, true);
     } else {
       err(p, err_msg_bad_static_member);
@@ -1188,7 +1525,7 @@ static void struct_body(Parser* p, bool all_static) {
   } else if (consume(p, tok_struct)) { // Sub-structs
     expect(p, tok_ident, err_msg_expect_ident);
     static_name = ident_const(p, &p->prev);
-    write_2bc(p, bc_struct, static_name);
+    write_wide(p, bc_struct, static_name);
     sub_struct_decl(p, false);
     is_static = true;
   } else {
@@ -1197,7 +1534,7 @@ static void struct_body(Parser* p, bool all_static) {
   }
 
   if (is_static) {
-    write_2bc(p, bc_def_static, static_name);
+    write_wide(p, bc_def_static, static_name);
   }
 }
 
@@ -1219,10 +1556,10 @@ static void struct_decl(Parser* p, bool all_static) {
 
   expect(p, tok_ident, err_msg_expect_ident);
   Tok name = p->prev;
-  uint8_t name_const = ident_const(p, &name);
+  uint16_t name_const = ident_const(p, &name);
   decl_var(p, true);
 
-  write_2bc(p, bc_struct, name_const);
+  write_wide(p, bc_struct, name_const);
   mark_init(p);
   
   named_var(p, name, false);
@@ -1252,10 +1589,10 @@ static void struct_decl(Parser* p, bool all_static) {
   p->within_struct = false;
 }
 
-static void enum_body(Parser* p, uint8_t name_const) {
-  write_2bc(p, bc_enum, name_const);
+static void enum_body(Parser* p, uint16_t name_const) {
+  write_wide(p, bc_enum, name_const);
 
-  uint8_t enum_names[UINT8_MAX];
+  uint16_t enum_names[UINT8_MAX];
   int enumc = 0;
 
   expect(p, tok_lbrace, err_msg_expect("{"));
@@ -1265,7 +1602,7 @@ static void enum_body(Parser* p, uint8_t name_const) {
       err(p, err_msg_max_enum);
       return;
     }
-    uint8_t enum_name = ident_const(p, &p->prev);
+    uint16_t enum_name = ident_const(p, &p->prev);
     enum_names[enumc++] = enum_name;
     expect(p, tok_comma, err_msg_expect(","));
   }
@@ -1273,7 +1610,7 @@ static void enum_body(Parser* p, uint8_t name_const) {
 
   write_bc(p, enumc);
   for (int i = 0; i < enumc; i++) {
-    write_bc(p, enum_names[i]);
+    write_2bc(p, (enum_names[i] >> 8) & 0xFF, enum_names[i] & 0xFF);
   }
 }
 
@@ -1284,10 +1621,11 @@ static void enum_decl(Parser* p) {
 
   expect(p, tok_ident, err_msg_expect_ident);
   Tok name = p->prev;
-  uint8_t name_const = ident_const(p, &name);
+  uint16_t name_const = ident_const(p, &name);
   decl_var(p, true);
   mark_init(p);
 
+  p->compiler->locals[p->compiler->localc - 1].enum_at = cur_chunk(p)->len;
   enum_body(p, name_const);
 }
 
@@ -1341,7 +1679,14 @@ static void continue_stat(Parser* p) {
   }
 
   discard_locals(p, loop->scope);
-  write_loop(p, loop->start);
+  if (!loop->counted) {
+    write_loop(p, loop->start);
+  } else if (loop->continuec == uint8_count) {
+    err(p, err_msg_max_continues);
+    return;
+  } else {
+    loop->continues[loop->continuec++] = write_jmp(p, bc_jmp);
+  }
 
   expect(p, tok_semicolon, err_msg_expect(";"));
 }
@@ -1422,13 +1767,176 @@ static void while_stat(Parser* p) {
   end_loop(p);
 }
 
+// Operands of `bc_for_prep` and `bc_for_loop`
+typedef struct {
+  uint8_t slot; // The loop variable
+  uint8_t limit; // Local or constant, see `for_const_limit`
+  uint8_t flags;
+  uint8_t step; // Constant added to the loop variable
+} CountedLoop;
+
+static bool is_num_const(Parser* p, uint8_t index) {
+  return is_num(cur_chunk(p)->consts.items[index]);
+}
+
+// Whether the header just compiled has the form `i < limit; i += step`, where
+// `i` is `slot` and the limit is a local or a number. The condition starts at
+// `cond`, and the increment at `inc`
+static bool counted_loop(
+  Parser* p, int slot, int cond, int inc, CountedLoop* out
+) {
+  uint8_t* code = cur_chunk(p)->code;
+  int len = cur_chunk(p)->len;
+
+  // get_local i, get_local/const limit, compare, then the `bc_false_jmp`,
+  // `bc_pop` and `bc_jmp` to the body
+  if (slot == -1 || inc != cond + 12 || code[cond] != bc_get_local
+      || code[cond + 1] != slot) {
+    return false;
+  }
+  out->slot = slot;
+  out->limit = code[cond + 3];
+  if (code[cond + 2] == bc_const && is_num_const(p, out->limit)) {
+    out->flags = for_const_limit;
+  } else if (code[cond + 2] == bc_get_local) {
+    out->flags = 0;
+  } else {
+    return false;
+  }
+
+  switch (code[cond + 4]) {
+    case bc_lt: out->flags |= for_lt; break;
+    case bc_lte: out->flags |= for_lte; break;
+    case bc_gt: out->flags |= for_gt; break;
+    case bc_gte: out->flags |= for_gte; break;
+    default: return false;
+  }
+
+  // `i++`, `i--`, `i += step` and `i -= step` all compile to
+  // get_local i, const step, add/sub, set_local i, pop
+  if (len != inc + 8 || code[inc] != bc_get_local || code[inc + 1] != slot
+      || code[inc + 2] != bc_const || !is_num_const(p, code[inc + 3])
+      || (code[inc + 4] != bc_add && code[inc + 4] != bc_sub)
+      || code[inc + 5] != bc_set_local || code[inc + 6] != slot
+      || code[inc + 7] != bc_pop) {
+    return false;
+  }
+
+  out->step = code[inc + 3];
+  if (code[inc + 4] == bc_sub) {
+    double step = as_num(cur_chunk(p)->consts.items[out->step]);
+    int index = short_const(p, create_num(-step));
+    if (index == -1) {
+      return false;
+    }
+    out->step = index;
+  }
+  return true;
+}
+
+static void write_for_loop(Parser* p, CountedLoop* counted, int body) {
+  write_bc(p, bc_for_loop);
+  write_2bc(p, counted->slot, counted->limit);
+  write_2bc(p, counted->flags, counted->step);
+
+  int jmp = cur_chunk(p)->len - body + 2;
+  if (jmp > UINT16_MAX) {
+    err(p, err_msg_big_loop);
+  }
+  write_2bc(p, (jmp >> 8) & 0xFF, jmp & 0xFF);
+}
+
+// Whether the loop header starts like `k, v in`, looking ahead on a copy of
+// the lexer
+static bool check_for_in(Parser* p) {
+  if (!check(p, tok_ident)) {
+    return false;
+  }
+
+  Lexer lexer = p->lexer;
+  Tok tok = next_token(&lexer);
+  if (tok.type == tok_comma) {
+    if (next_token(&lexer).type != tok_ident) {
+      return false;
+    }
+    tok = next_token(&lexer);
+  }
+  return tok.type == tok_in;
+}
+
+// A local the code can't name, kept for the loop
+static void add_hidden_local(Parser* p) {
+  Tok name = p->prev;
+  name.start = "";
+  name.len = 0;
+  add_local(p, name, false);
+  mark_init(p);
+}
+
+// `for (x in seq)` and `for (k, v in seq)`. The value, a cursor and the loop
+// variables live in locals, which `bc_for_in` moves along on every step
+static void for_in_stat(Parser* p) {
+  Tok names[2];
+  int varc = 0;
+  do {
+    expect(p, tok_ident, err_msg_expect_ident);
+    names[varc++] = p->prev;
+  } while (varc < 2 && consume(p, tok_comma));
+  expect(p, tok_in, err_msg_expect("in"));
+
+  int slot = p->compiler->localc;
+  expr(p);
+  add_hidden_local(p);
+  write_bc(p, bc_null);
+  add_hidden_local(p);
+  for (int i = 0; i < varc; i++) {
+    p->prev = names[i];
+    decl_var(p, false);
+    mark_init(p);
+    write_bc(p, bc_null);
+  }
+  expect(p, tok_rparen, err_msg_expect(")"));
+
+  Loop loop;
+  begin_loop(p, &loop);
+  loop.is_for = true;
+
+  if (consume(p, tok_colon)) {
+    expect(p, tok_ident, err_msg_expect_ident);
+    loop.name = p->prev;
+  }
+
+  write_bc(p, bc_for_in);
+  write_2bc(p, (slot >> 8) & 0xFF, slot & 0xFF);
+  write_bc(p, varc);
+  int exit_jmp = cur_chunk(p)->len;
+  write_2bc(p, 0xFF, 0xFF);
+
+  stat(p);
+  write_loop(p, loop.start);
+  patch_jmp(p, exit_jmp);
+
+  end_scope(p);
+  end_loop(p);
+}
+
 static void for_stat(Parser* p) {
   begin_scope(p);
 
   // Loop variable
   expect(p, tok_lparen, err_msg_expect("("));
+  if (check_for_in(p)) {
+    for_in_stat(p);
+    return;
+  }
+
+  int slot = -1;
   if (!consume(p, tok_semicolon)) {
+    int localc = p->compiler->localc;
     var_decl(p, false);
+    if (p->compiler->localc == localc + 1) {
+      slot = localc;
+    }
   }
 
   Loop loop;
@@ -1436,6 +1944,7 @@ static void for_stat(Parser* p) {
   loop.is_for = true;
 
   // Loop condition
+  int cond = cur_chunk(p)->len;
   int exit_jmp = -1;
   if (!consume(p, tok_semicolon)) {
     expr(p);
@@ -1446,6 +1955,7 @@ static void for_stat(Parser* p) {
   }
 
   // Increment
+  CountedLoop counted = {0, 0, 0, 0};
   if (!consume(p, tok_rparen)) {
     int body_jmp = write_jmp(p, bc_jmp);
     int inc_start = cur_chunk(p)->len;
@@ -1454,9 +1964,20 @@ static void for_stat(Parser* p) {
     write_bc(p, bc_pop);
     expect(p, tok_rparen, err_msg_expect(")"));
 
-    write_loop(p, loop.start);
-    loop.start = inc_start;
-    patch_jmp(p, body_jmp);
+    // Counting loops are compiled again into two instructions, which keep
+    // the loop variable in its slot so the body can still change it
+    if (exit_jmp != -1 && counted_loop(p, slot, cond, inc_start, &counted)) {
+      cur_chunk(p)->len = cond;
+      loop.counted = true;
+      write_2bc(p, bc_for_prep, counted.slot);
+      write_2bc(p, counted.limit, counted.flags);
+      write_2bc(p, 0xFF, 0xFF);
+      exit_jmp = cur_chunk(p)->len - 2;
+    } else {
+      write_loop(p, loop.start);
+      loop.start = inc_start;
+      patch_jmp(p, body_jmp);
+    }
   }
 
   if (consume(p, tok_colon)) {
@@ -1464,12 +1985,23 @@ static void for_stat(Parser* p) {
     loop.name = p->prev;
   }
 
-  stat(p);
-  write_loop(p, loop.start);
+  if (loop.counted) {
+    int body = cur_chunk(p)->len;
+    stat(p);
 
-  if (exit_jmp != -1) {
+    for (int i = 0; i < loop.continuec; i++) {
+      patch_jmp(p, loop.continues[i]);
+    }
+    write_for_loop(p, &counted, body);
     patch_jmp(p, exit_jmp);
-    write_bc(p, bc_pop);
+  } else {
+    stat(p);
+    write_loop(p, loop.start);
+
+    if (exit_jmp != -1) {
+      patch_jmp(p, exit_jmp);
+      write_bc(p, bc_pop);
+    }
   }
 
   end_scope(p);
@@ -1482,7 +2014,55 @@ static void return_stat(Parser* p) {
   } else {
     expr(p);
     expect(p, tok_semicolon, err_msg_expect(";"));
-    write_bc(p, bc_ret);
+    write_ret_expr(p);
+  }
+}
+
+// The local an upvalue of `compiler` refers to, in whichever function it is
+static Local* upval_local(Compiler* compiler, int upval) {
+  while (!compiler->upvals[upval].is_local) {
+    upval = compiler->upvals[upval].index;
+    compiler = compiler->enclosing;
+  }
+  return &compiler->enclosing->locals[compiler->upvals[upval].index];
+}
+
+// A case like `Color.red` compiles to the member's number when `Color` is an
+// enum, so the switch can use a jump table. The label starts at `start`
+static void fold_enum_label(Parser* p, int start) {
+  Chunk* chunk = cur_chunk(p);
+  uint8_t* code = &chunk->code[start];
+  if (chunk->len != start + 5 || code[2] != bc_get_static) {
+    return;
+  }
+
+  Local* local;
+  Compiler* owner = p->compiler;
+  if (code[0] == bc_get_local) {
+    local = &p->compiler->locals[code[1]];
+  } else if (code[0] == bc_get_upval) {
+    local = upval_local(p->compiler, code[1]);
+    while (owner->enclosing != NULL) {
+      owner = owner->enclosing;
+    }
+  } else {
+    return;
+  }
+  if (local->enum_at == -1) {
+    return;
+  }
+
+  // Enums are only declared in the script, see `enum_decl`
+  Chunk* enum_chunk = &owner->fn->chunk;
+  uint8_t* enum_code = &enum_chunk->code[local->enum_at];
+  Val name = chunk->consts.items[(code[3] << 8) | code[4]];
+  for (int i = 0; i < enum_code[3]; i++) {
+    int member = (enum_code[4 + i * 2] << 8) | enum_code[5 + i * 2];
+    if (vals_eql(enum_chunk->consts.items[member], name)) {
+      chunk->len = start;
+      write_const(p, create_num(i));
+      return;
+    }
   }
 }
 
@@ -1494,7 +2074,9 @@ static void switch_body(Parser* p, SwitchCaseFn case_fn) {
 
   if (consume(p, tok_case)) {
     do {
+      int label = cur_chunk(p)->len;
       expr(p); // The value to switch on
+      fold_enum_label(p, label);
       int ineq_jmp = write_jmp(p, bc_ineq_jmp);
 
       write_bc(p, bc_pop); // switch expression
@@ -1662,6 +2244,9 @@ void mark_compiler_roots(Parser* p) {
   Compiler* compiler = p->compiler;
   while (compiler != NULL) {
     mark_obj(p->h, (GcObj*)compiler->fn);
+    for (int i = 0; i < compiler->long_consts.len; i++) {
+      mark_val(p->h, compiler->long_consts.items[i]);
+    }
     compiler = compiler->enclosing;
   }
 
@@ -0,0 +1,185 @@
+#include "slab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef hby_windows
+# include <malloc.h>
+# define alloc_page() _aligned_malloc(slab_page_size, slab_page_size)
+# define free_page(page) _aligned_free(page)
+#else
+# define alloc_page() aligned_alloc(slab_page_size, slab_page_size)
+# define free_page(page) free(page)
+#endif
+
+// Let AddressSanitizer catch uses of free cells
+#if defined(__SANITIZE_ADDRESS__)
+# include <sanitizer/asan_interface.h>
+# define poison(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+# define unpoison(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+# define poison(ptr, size) ((void)(ptr), (void)(size))
+# define unpoison(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+// Pages are aligned to their size, so a cell finds its page by masking
+struct SlabPage {
+  SlabPage* prev; // Neighbours in the partial list of the class
+  SlabPage* next;
+  void* free; // Free cells, each holding a pointer to the next one
+  int usedc;
+  int cellc;
+  int classi;
+};
+
+#define page_header_size \
+  ((sizeof(SlabPage) + slab_cell_align - 1) / slab_cell_align * slab_cell_align)
+#define page_of(ptr) ((SlabPage*)((uintptr_t)(ptr) & ~(uintptr_t)(slab_page_size - 1)))
+
+void init_slab(Slab* slab) {
+  for (int i = 0; i < slab_classc; i++) {
+    slab->classes[i].partial = NULL;
+    slab->classes[i].emptyc = 0;
+  }
+  slab->release_pages = true;
+  slab->pagec = 0;
+  slab->released_pagec = 0;
+  slab->used_cellc = 0;
+  slab->free_cellc = 0;
+}
+
+// Only pages with free cells are tracked, so this must run after every cell
+// has been freed
+void free_slab(Slab* slab) {
+  for (int i = 0; i < slab_classc; i++) {
+    SlabPage* page = slab->classes[i].partial;
+    while (page != NULL) {
+      SlabPage* next = page->next;
+      unpoison(page, slab_page_size);
+      free_page(page);
+      page = next;
+    }
+    slab->classes[i].partial = NULL;
+  }
+}
+
+size_t slab_cell_size(size_t size) {
+  if (size > slab_max_cell) {
+    return size;
+  }
+  return (size + slab_cell_align - 1) / slab_cell_align * slab_cell_align;
+}
+
+static void unlink_page(SlabClass* c, SlabPage* page) {
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    c->partial = page->next;
+  }
+  if (page->next != NULL) {
+    page->next->prev = page->prev;
+  }
+}
+
+static void link_page(SlabClass* c, SlabPage* page) {
+  page->prev = NULL;
+  page->next = c->partial;
+  if (c->partial != NULL) {
+    c->partial->prev = page;
+  }
+  c->partial = page;
+}
+
+static SlabPage* new_page(Slab* slab, int classi) {
+  SlabPage* page = (SlabPage*)alloc_page();
+  if (page == NULL) {
+    exit(1);
+  }
+
+  size_t cell_size = (classi + 1) * slab_cell_align;
+  page->usedc = 0;
+  page->cellc = (int)((slab_page_size - page_header_size) / cell_size);
+  page->classi = classi;
+
+  // Thread the free list through the cells, in address order
+  char* cells = (char*)page + page_header_size;
+  page->free = cells;
+  for (int i = 0; i < page->cellc; i++) {
+    char* cell = cells + i * cell_size;
+    *(void**)cell = i + 1 < page->cellc ? cell + cell_size : NULL;
+  }
+  poison(cells, page->cellc * cell_size);
+
+  link_page(&slab->classes[classi], page);
+  slab->classes[classi].emptyc++;
+  slab->pagec++;
+  slab->free_cellc += page->cellc;
+  return page;
+}
+
+void* slab_alloc(Slab* slab, size_t size) {
+  if (size > slab_max_cell) {
+    void* ptr = malloc(size);
+    if (ptr == NULL) {
+      exit(1);
+    }
+    return ptr;
+  }
+
+  int classi = (int)(slab_cell_size(size) / slab_cell_align) - 1;
+  SlabClass* c = &slab->classes[classi];
+  SlabPage* page = c->partial;
+  if (page == NULL) {
+    page = new_page(slab, classi);
+  }
+
+  void* cell = page->free;
+  unpoison(cell, (classi + 1) * slab_cell_align);
+  page->free = *(void**)cell;
+  if (page->usedc++ == 0) {
+    c->emptyc--;
+  }
+  if (page->free == NULL) {
+    unlink_page(c, page);
+  }
+
+  slab->used_cellc++;
+  slab->free_cellc--;
+  return cell;
+}
+
+void slab_free(Slab* slab, void* ptr, size_t size) {
+  if (size > slab_max_cell) {
+    free(ptr);
+    return;
+  }
+
+  SlabPage* page = page_of(ptr);
+  SlabClass* c = &slab->classes[page->classi];
+  if (page->free == NULL) {
+    link_page(c, page);
+  }
+
+  *(void**)ptr = page->free;
+  page->free = ptr;
+  poison(ptr, (page->classi + 1) * slab_cell_align);
+  slab->used_cellc--;
+  slab->free_cellc++;
+
+  if (--page->usedc > 0) {
+    return;
+  }
+
+  // Keep one empty page around, so a class at the edge of a page doesn't
+  // allocate and release a page over and over
+  if (slab->release_pages && c->emptyc > 0) {
+    unlink_page(c, page);
+    slab->pagec--;
+    slab->released_pagec++;
+    slab->free_cellc -= page->cellc;
+    unpoison(page, slab_page_size);
+    free_page(page);
+  } else {
+    c->emptyc++;
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef __HBY_SLAB_H
+#define __HBY_SLAB_H
+
+#include "common.h"
+
+// Small objects are carved out of pages, each page holding cells of one size
+#define slab_page_size (16 * 1024)
+#define slab_cell_align 8
+#define slab_max_cell 256
+#define slab_classc (slab_max_cell / slab_cell_align)
+
+typedef struct SlabPage SlabPage;
+
+typedef struct {
+  SlabPage* partial; // Pages with at least one free cell
+  int emptyc; // Pages without any used cells
+} SlabClass;
+
+typedef struct {
+  SlabClass classes[slab_classc];
+  bool release_pages; // Give empty pages back to the system?
+  size_t pagec;
+  size_t released_pagec;
+  size_t used_cellc;
+  size_t free_cellc;
+} Slab;
+
+void init_slab(Slab* slab);
+void free_slab(Slab* slab);
+
+// Bytes actually used to hold `size` bytes
+size_t slab_cell_size(size_t size);
+// Sizes too large for a cell fall back to the system allocator
+void* slab_alloc(Slab* slab, size_t size);
+void slab_free(Slab* slab, void* ptr, size_t size);
+
+#endif // __HBY_SLAB_H
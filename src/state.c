@@ -1,44 +1,123 @@
 #include "state.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include "errmsg.h"
 #include "tostr.h"
 #include "parser.h"
 #include "mem.h"
 #include "obj.h"
 #include "hby.h"
 #include "lib.h"
+#if defined(hby_print_quick) || defined(hby_profile_bc)
+# include "debug.h"
+#endif
+
+// Room kept past the limits, so the callback of a stack overflow error can
+// still be called
+#define unwind_frames 8
+#define unwind_slots 512
+
+static void set_stack_ends(hby_State* h) {
+  int frames = h->frames_max + 2 + (h->unwinding ? unwind_frames : 0);
+  int slots = h->stack_max + (h->unwinding ? unwind_slots : 0);
+  h->frame_end = h->frame_stack + (frames < h->frame_cap ? frames : h->frame_cap);
+  h->stack_end = h->stack + (slots < h->stack_cap ? slots : h->stack_cap);
+}
 
 hby_State* hby_create_state() {
-  hby_State* h = (hby_State*)malloc(sizeof(hby_State));
+  // Zeroed, since the collector can run during the first allocations below
+  hby_State* h = (hby_State*)calloc(1, sizeof(hby_State));
 
-  // FIXME: The frame stack should be interfaced with the same as the normal
-  // stack. This - 1 is hacky and shouldn't really exist.
-  h->frame = h->frame_stack - 1;
+  h->frame_stack = NULL;
+  h->frame_end = NULL;
+  h->frame_cap = 0;
+  h->frames_max = frames_max_default;
+  h->stack = NULL;
+  h->stack_end = NULL;
+  h->stack_cap = 0;
+  h->stack_max = stack_max_default;
+  h->unwinding = false;
 
-  h->parser = allocate(h, Parser, 1);
-  h->parser->compiler = NULL;
   h->pcall = NULL;
+  h->native = NULL;
+
+  h->next_shape = 1;
+#ifdef hby_ic_stats
+  h->ic_hits = 0;
+  h->ic_misses = 0;
+#endif
+#ifdef hby_profile_bc
+  h->bc_prev[0] = bc_count;
+  h->bc_prev[1] = bc_count;
+#endif
 
   h->gc.objs = NULL;
+  h->gc.young = NULL;
   h->gc.udata = NULL;
   h->gc.can_gc = true;
+  h->gc.minor = false;
+  h->gc.phase = gc_phase_idle;
+  h->gc.debt = 0;
+  h->gc.cycle_start = 0;
+  h->gc.sweeping = NULL;
   h->gc.alloced = 0;
   h->gc.next_gc = 1024 * 1024;
+  h->gc.young_alloced = 0;
   h->gc.grayc = 0;
+  h->gc.gray_old = 0;
   h->gc.gray_cap = 0;
   h->gc.gray_stack = NULL;
+  h->gc.rememberedc = 0;
+  h->gc.remembered_cap = 0;
+  h->gc.remembered = NULL;
+  h->gc.minor_gcs = 0;
+  h->gc.major_gcs = 0;
+  h->gc.pausec = 0;
+  h->gc.max_pause = 0;
+  init_slab(&h->gc.slab);
+  memset(h->gc.pauses, 0, sizeof(h->gc.pauses));
+
+  // FIXME: The frame stack should be interfaced with the same as the normal
+  // stack. This - 1 is hacky and shouldn't really exist.
+  h->frame_stack = allocate(h, CallFrame, frames_initial);
+  h->frame_cap = frames_initial;
+  h->frame = h->frame_stack - 1;
+  h->stack = allocate(h, Val, stack_initial);
+  h->stack_cap = stack_initial;
+  h->top = h->stack;
+  set_stack_ends(h);
+
+  h->parser = allocate(h, Parser, 1);
+  h->parser->compiler = NULL;
+
+  // The main fiber stands for the stacks above while other fibers run
+  h->fiber = create_fiber(h, create_null());
+  h->fiber->status = fiber_running;
+  h->yielding = false;
+
+  h->budget = INT_MAX;
+  h->budget_frame = -1;
+  h->budget_fiber = NULL;
+  h->budget_callback.hby = NULL;
+  h->suspended = false;
 
   h->registry = create_map(h);
   h->args = create_arr(h);
 
-  init_table(&h->globals);
+  init_table(&h->global_slots);
+  h->globalc = 0;
+  h->global_cap = 0;
+  h->globals = NULL;
   init_table(&h->global_consts);
   init_table(&h->strs);
   init_table(&h->files);
   reset_stack(h);
+  h->iter_str = copy_str(h, "iter", 4);
+  h->next_str = copy_str(h, "next", 4);
 
   srand(time(NULL));
 
@@ -49,22 +128,58 @@ hby_State* hby_create_state() {
   hby_open_lib(h, open_map);
   hby_open_lib(h, open_core);
   hby_open_lib(h, open_ease);
+  hby_open_lib(h, open_fiber);
   hby_open_lib(h, open_io);
   hby_open_lib(h, open_math);
   hby_open_lib(h, open_rng);
   hby_open_lib(h, open_str);
   hby_open_lib(h, open_sys);
+  h->array_shape = h->array_struct->shape;
+  h->string_shape = h->string_struct->shape;
 
   return h;
 }
 
+#ifdef hby_print_quick
+static void print_fns(hby_State* h, GcObj* list) {
+  for (GcObj* obj = list; obj != NULL; obj = obj->next) {
+    if (obj->type == obj_fn) {
+      GcFn* fn = (GcFn*)obj;
+      print_chunk(
+        h, &fn->chunk, fn->name != NULL ? fn->name->chars : "<script>");
+    }
+  }
+}
+#endif
+
 void hby_free_state(hby_State* h) {
+#ifdef hby_print_quick
+  print_fns(h, h->gc.objs);
+  print_fns(h, h->gc.sweeping);
+  print_fns(h, h->gc.young);
+#endif
+
+#ifdef hby_ic_stats
+  size_t lookups = h->ic_hits + h->ic_misses;
+  printf(
+    "INLINE CACHES: %zu HITS, %zu MISSES (%.1f%% HIT RATE)\n",
+    h->ic_hits, h->ic_misses,
+    lookups == 0 ? 0.0 : 100.0 * h->ic_hits / lookups);
+#endif
+#ifdef hby_profile_bc
+  print_bc_profile(h);
+#endif
+
   release(h, Parser, h->parser);
-  free_table(h, &h->globals);
+  free_table(h, &h->global_slots);
+  release_arr(h, Global, h->globals, h->global_cap);
   free_table(h, &h->global_consts);
   free_table(h, &h->strs);
   free_table(h, &h->files);
   free_objs(h);
+  release_arr(h, CallFrame, h->frame_stack, h->frame_cap);
+  release_arr(h, Val, h->stack, h->stack_cap);
+  free_slab(&h->gc.slab);
   free(h);
 }
 
@@ -81,8 +196,156 @@ void hby_cli_args(hby_State* h, int argc, const char** args) {
   }
 }
 
+int find_global(hby_State* h, GcStr* name) {
+  Val slot;
+  if (get_table(&h->global_slots, name, &slot)) {
+    return (int)as_num(slot);
+  }
+
+  push(h, create_obj(name));
+  if (h->global_cap < h->globalc + 1) {
+    int old_cap = h->global_cap;
+    h->global_cap = grow_cap(old_cap);
+    h->globals = grow_arr(h, Global, h->globals, old_cap, h->global_cap);
+  }
+
+  Global* global = &h->globals[h->globalc];
+  global->name = name;
+  global->val = create_null();
+  global->defined = false;
+  set_table(h, &h->global_slots, name, create_num(h->globalc));
+  pop(h);
+  return h->globalc++;
+}
+
 void reset_stack(hby_State* h) {
   h->top = h->stack;
   h->frame = h->frame_stack;
+  h->frame->base = h->stack;
   h->open_upvals = NULL;
+  h->unwinding = false;
+  set_stack_ends(h);
+}
+
+void grow_stacks(hby_State* h, int slots) {
+  // Finalizers run in the middle of an instruction, where the interpreter
+  // holds pointers into the stacks. The slack left by `reserve_call` has to do
+  if (!h->gc.can_gc) {
+    return;
+  }
+
+  int framec = h->frame - h->frame_stack + 1;
+  int used = h->top - h->stack;
+  int needed = used + slots + stack_slack;
+  int extra_frames = h->unwinding ? unwind_frames : 0;
+  int extra_slots = h->unwinding ? unwind_slots : 0;
+  if (framec > h->frames_max + extra_frames
+      || needed > h->stack_max + extra_slots) {
+    if (h->unwinding) {
+      // The error callback itself overflowed, nothing is left to report to
+      fprintf(stderr, "Stack overflow while handling an error\n");
+      exit(1);
+    }
+    hby_err(h, err_msg_stack_overflow);
+  }
+
+  // Capacity is clamped to what unwinding may use, so it is never grown
+  // while an error is being reported
+  if (framec + 2 > h->frame_cap) {
+    int cap = h->frame_cap * 2;
+    if (cap > h->frames_max + unwind_frames + 2) {
+      cap = h->frames_max + unwind_frames + 2;
+    }
+    h->frame_stack = grow_arr(h, CallFrame, h->frame_stack, h->frame_cap, cap);
+    h->frame = h->frame_stack + framec - 1;
+    h->frame_cap = cap;
+  }
+
+  if (needed > h->stack_cap) {
+    int cap = h->stack_cap;
+    while (cap < needed) {
+      cap *= 2;
+    }
+    if (cap > h->stack_max + unwind_slots) {
+      cap = h->stack_max + unwind_slots;
+    }
+
+    Val* old = h->stack;
+    h->stack = grow_arr(h, Val, h->stack, h->stack_cap, cap);
+    h->stack_cap = cap;
+
+    // Everything pointing into the old stack has to follow it
+    h->top = h->stack + used;
+    for (CallFrame* frame = h->frame_stack; frame <= h->frame; frame++) {
+      frame->base = h->stack + (frame->base - old);
+    }
+    for (GcUpval* upval = h->open_upvals; upval != NULL; upval = upval->next) {
+      upval->loc = h->stack + (upval->loc - old);
+    }
+  }
+
+  set_stack_ends(h);
+}
+
+void unwind_stacks(hby_State* h, int slots) {
+  h->unwinding = true;
+  set_stack_ends(h);
+  if (h->top + slots + stack_slack > h->stack_end) {
+    grow_stacks(h, slots);
+  }
+}
+
+void save_fiber(hby_State* h, GcFiber* fiber) {
+  fiber->frame_stack = h->frame_stack;
+  fiber->frame = h->frame;
+  fiber->frame_cap = h->frame_cap;
+  fiber->stack = h->stack;
+  fiber->top = h->top;
+  fiber->stack_cap = h->stack_cap;
+  fiber->open_upvals = h->open_upvals;
+  // The stacks were written without the write barrier while they were roots
+  barrier_back(h, &fiber->obj);
+}
+
+void load_fiber(hby_State* h, GcFiber* fiber) {
+  if (fiber->stack == NULL) {
+    fiber->frame_stack = allocate(h, CallFrame, fiber_frames_initial);
+    fiber->frame_cap = fiber_frames_initial;
+    fiber->stack = allocate(h, Val, fiber_stack_initial);
+    fiber->stack_cap = fiber_stack_initial;
+    fiber->top = fiber->stack;
+    fiber->frame = fiber->frame_stack;
+    fiber->frame->base = fiber->stack;
+  }
+
+  h->frame_stack = fiber->frame_stack;
+  h->frame = fiber->frame;
+  h->frame_cap = fiber->frame_cap;
+  h->stack = fiber->stack;
+  h->top = fiber->top;
+  h->stack_cap = fiber->stack_cap;
+  h->open_upvals = fiber->open_upvals;
+  set_stack_ends(h);
+
+  // Only the state has the stacks of the running fiber, so the collector
+  // doesn't read them from here while they change
+  fiber->frame_stack = NULL;
+  fiber->frame = NULL;
+  fiber->frame_cap = 0;
+  fiber->stack = NULL;
+  fiber->top = NULL;
+  fiber->stack_cap = 0;
+  fiber->open_upvals = NULL;
+}
+
+void hby_stack_limits(hby_State* h, int max_frames, int max_slots) {
+  h->frames_max = max_frames;
+  h->stack_max = max_slots;
+  set_stack_ends(h);
+}
+
+void hby_reserve(hby_State* h, int slots) {
+  if (h->top + slots + stack_slack > h->stack_end) {
+    grow_stacks(h, slots);
+  }
 }
@@ -7,9 +7,22 @@
 #include "val.h"
 #include "obj.h"
 #include "parser.h"
-
-#define frames_max 64
-#define stack_size (frames_max * uint8_count)
+#include "slab.h"
+
+// Both stacks start small and double as calls need more room, up to a limit
+// that can be changed with `hby_stack_limits`
+#define frames_initial 16
+#define frames_max_default (1 << 17)
+#define stack_initial 1024
+#define stack_max_default (1 << 20)
+// Free values a C function gets above its arguments, see `hby_reserve`
+#define c_fn_slots 20
+// Kept free on top of what a call reserves, for finalizers that run in the
+// middle of an instruction where the stacks can't move
+#define stack_slack 16
+// Fibers start with much smaller stacks, since there can be many of them
+#define fiber_frames_initial 4
+#define fiber_stack_initial 32
 
 typedef enum {
   call_type_c, // This is a C function
@@ -17,7 +30,7 @@ typedef enum {
   call_type_hby, // This is called from other Hobby code
 } CallType;
 
-typedef struct {
+typedef struct CallFrame {
   GcAnyFn fn;
   uint8_t* ip;
   Val* base;
@@ -27,28 +40,86 @@ typedef struct {
 typedef struct PCall {
   struct PCall* prev;
   GcAnyFn callback;
+  GcFiber* fiber; // If set, errors end this fiber instead of calling back
   jmp_buf buf;
 } PCall;
 
+typedef enum {
+  gc_phase_idle, // No major cycle is running
+  gc_phase_mark, // Marking incrementally
+  gc_phase_sweep, // Sweeping old objects incrementally
+} GcPhase;
+
+// Number of buckets in the pause time histogram
+#define gc_pause_buckets 312
+
 typedef struct {
   bool can_gc;
+  bool minor; // Is the running collection a minor one?
+  GcPhase phase;
   size_t alloced;
   size_t next_gc;
-  GcObj* objs;
+  size_t young_alloced; // Bytes allocated since the last collection
+  size_t debt; // Bytes allocated since the last step of the cycle
+  size_t cycle_start; // Bytes allocated when the cycle started
+  GcObj* objs; // Old objects
+  GcObj* sweeping; // Old objects the sweep phase hasn't reached yet
+  GcObj* young; // Objects that haven't survived a collection yet
   GcObj* udata;
   int grayc;
   int gray_cap;
   GcObj** gray_stack;
+  int gray_old; // How many at the bottom of `gray_stack` are known to be old
+  // Old objects that may point to young ones
+  int rememberedc;
+  int remembered_cap;
+  GcObj** remembered;
+  size_t minor_gcs;
+  size_t major_gcs;
+  // Pause times, see `hby_gc_pauses`
+  size_t pausec;
+  uint64_t max_pause;
+  size_t pauses[gc_pause_buckets];
+  Slab slab; // Memory of objects
 } GcState;
 
+// A global variable. Compiled code refers to it by its slot, which stays the
+// same for as long as the state lives
+typedef struct {
+  GcStr* name;
+  Val val;
+  bool defined; // Reading a global that was never set is an error
+} Global;
+
 struct hby_State {
-  CallFrame frame_stack[frames_max];
+  CallFrame* frame_stack;
   CallFrame* frame;
+  CallFrame* frame_end; // End of the capacity or the limit, whichever is first
+  int frame_cap;
+  int frames_max;
 
-  Val stack[stack_size];
+  Val* stack;
   Val* top;
-
-  Table globals;
+  Val* stack_end;
+  int stack_cap;
+  int stack_max;
+  bool unwinding; // Lets an error callback run past the limits
+
+  GcCFn* native; // The running fast native, which has no frame of its own
+  GcFiber* fiber; // The running fiber. Its stacks are the ones above
+  bool yielding; // Set by `Fiber:yield` to stop the interpreter
+
+  // Calls and loop iterations left until a budgeted call suspends
+  int budget;
+  int budget_frame; // Depth of the budgeted call's frame, -1 if there is none
+  GcFiber* budget_fiber;
+  GcAnyFn budget_callback; // Protects the call again when it's resumed
+  bool suspended;
+
+  Table global_slots; // Name to slot in `globals`
+  int globalc;
+  int global_cap;
+  Global* globals;
   Table global_consts;
   Table strs;
   Table files;
@@ -65,14 +136,53 @@ struct hby_State {
   GcStruct* array_struct;
   GcStruct* map_struct;
   GcStruct* udata_struct;
+  GcStruct* fiber_struct;
+  GcStruct* math_struct;
+  // Shapes of the builtin structs once the libraries are open.
+  // `bc_invoke_len` skips the call only while their methods stay the same
+  uint32_t array_shape;
+  uint32_t string_shape;
+  // Methods a for-in loop calls to iterate an instance
+  GcStr* iter_str;
+  GcStr* next_str;
 
   GcState gc;
   PCall* pcall;
 
+  uint32_t next_shape;
+#ifdef hby_ic_stats
+  size_t ic_hits;
+  size_t ic_misses;
+#endif
+#ifdef hby_profile_bc
+  size_t bc_counts[bc_count];
+  size_t bc_pairs[bc_count][bc_count];
+  size_t bc_triples[bc_count][bc_count][bc_count];
+  int bc_prev[2]; // The last two instructions run, `bc_count` if none yet
+#endif
+
   Parser* parser;
 };
 
 void reset_stack(hby_State* h);
+void grow_stacks(hby_State* h, int slots);
+// Lift the limits for the callback of an error, with room for `slots` values
+void unwind_stacks(hby_State* h, int slots);
+// Keep the running stacks in `fiber`, to switch to another one
+void save_fiber(hby_State* h, GcFiber* fiber);
+// Run on the stacks of `fiber`, making them first if it hasn't run yet
+void load_fiber(hby_State* h, GcFiber* fiber);
+// Get the slot of the global `name`, adding an undefined one if there is none
+int find_global(hby_State* h, GcStr* name);
+
+// Make room for a call that uses up to `slots` values. Growing moves both
+// stacks, so pointers into them must be reloaded after calls
+static inline void reserve_call(hby_State* h, int slots) {
+  if (h->frame + 2 >= h->frame_end
+      || h->top + slots + stack_slack > h->stack_end) {
+    grow_stacks(h, slots);
+  }
+}
 
 inline void push(hby_State* h, Val val) {
   *h->top = val;
@@ -14,6 +14,7 @@ void init_table(Table* table) {
   table->itemc = 0;
   table->item_cap = 0;
   table->items = NULL;
+  table->obj = NULL;
 }
 
 void free_table(hby_State* h, Table* table) {
@@ -96,6 +97,11 @@ bool set_table(hby_State* h, Table* table, GcStr* k, Val v) {
 
   item->key = k;
   item->val = v;
+
+  if (table->obj != NULL) {
+    gc_barrier(h, table->obj, create_obj(k));
+    gc_barrier(h, table->obj, v);
+  }
   return is_new;
 }
 
@@ -157,7 +163,7 @@ void mark_table(hby_State* h, Table* table) {
 void rem_black_table(hby_State* h, Table* table) {
   for (int i = 0; i < table->item_cap; i++) {
     TableItem* item = &table->items[i];
-    if (item->key != NULL && !item->key->obj.marked) {
+    if (item->key != NULL && unreached(h, &item->key->obj)) {
       rem_table(table, item->key);
     }
   }
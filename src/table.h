@@ -14,6 +14,7 @@ typedef struct {
   int itemc;
   int item_cap;
   TableItem* items;
+  GcObj* obj; // Object that owns this table, for the write barrier
 } Table;
 
 void init_table(Table* table);
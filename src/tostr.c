@@ -16,66 +16,111 @@ static GcStr* fn_to_str(hby_State* h, GcFn* fn) {
   return str_fmt(h, "<fn @>", fn->name);
 }
 
-static GcStr* arr_to_str(hby_State* h, GcArr* arr, int depth) {
-  if (depth > 2) {
-    return copy_str(h, "[...]", 5);
+void init_strbuf(StrBuf* buf) {
+  buf->chars = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
+
+void free_strbuf(hby_State* h, StrBuf* buf) {
+  release_arr(h, char, buf->chars, buf->cap);
+  init_strbuf(buf);
+}
+
+void reserve_strbuf(hby_State* h, StrBuf* buf, int extra) {
+  if (buf->len + extra <= buf->cap) {
+    return;
   }
-  int cap = 8;
-  int len = 0;
-  char* chars = allocate(h, char, cap);
 
-  chars[len++] = '[';
-  for (int i = 0; i < arr->varr.len; i++) {
-    bool add_quotes = false;
-    GcStr* str = NULL;
-    if (is_arr(arr->varr.items[i])) {
-      str = arr_to_str(h, as_arr(arr->varr.items[i]), depth + 1);
-    } else {
-      add_quotes = is_str(arr->varr.items[i]);
-      str = to_str(h, arr->varr.items[i]);
-    }
-    push(h, create_obj(str));
+  int cap = buf->cap;
+  while (buf->len + extra > cap) {
+    cap = grow_cap(cap);
+  }
+  buf->chars = grow_arr(h, char, buf->chars, buf->cap, cap);
+  buf->cap = cap;
+}
 
-    int add_len = str->len + 2; // + 2 is for comma and space
-    if (add_quotes) {
-      add_len += 2;
-    }
-    if (len + add_len > cap) {
-      int old_cap = cap;
-      while (len + add_len > cap) {
-        cap = grow_cap(cap);
-      }
-      chars = grow_arr(h, char, chars, old_cap, cap);
-    }
+void append_strbuf(hby_State* h, StrBuf* buf, const char* chars, int len) {
+  reserve_strbuf(h, buf, len);
+  memcpy(buf->chars + buf->len, chars, len);
+  buf->len += len;
+}
 
-    pop(h);
+void append_char_strbuf(hby_State* h, StrBuf* buf, char c) {
+  reserve_strbuf(h, buf, 1);
+  buf->chars[buf->len++] = c;
+}
 
-    if (add_quotes) {
-      chars[len++] = '"';
-    }
+void append_num_strbuf(hby_State* h, StrBuf* buf, double n) {
+  if (isnan(n)) {
+    append_strbuf(h, buf, "nan", 3);
+  } else if (isinf(n)) {
+    append_strbuf(h, buf, n > 0 ? "inf" : "-inf", n > 0 ? 3 : 4);
+  } else {
+    // `num_fmt` never needs more than 32 characters
+    reserve_strbuf(h, buf, 32);
+    buf->len += snprintf(buf->chars + buf->len, 32, num_fmt, n);
+  }
+}
 
-    memcpy(chars + len, str->chars, str->len);
-    len += str->len;
+static void append_arr_strbuf(
+    hby_State* h, StrBuf* buf, GcArr* arr, int depth) {
+  if (depth > 2) {
+    append_strbuf(h, buf, "[...]", 5);
+    return;
+  }
 
-    if (add_quotes) {
-      chars[len++] = '"';
+  append_char_strbuf(h, buf, '[');
+  for (int i = 0; i < arr->varr.len; i++) {
+    Val item = arr->varr.items[i];
+    if (is_arr(item)) {
+      append_arr_strbuf(h, buf, as_arr(item), depth + 1);
+    } else if (is_str(item)) {
+      append_char_strbuf(h, buf, '"');
+      append_strbuf(h, buf, as_str(item)->chars, as_str(item)->len);
+      append_char_strbuf(h, buf, '"');
+    } else {
+      append_val_strbuf(h, buf, item);
     }
 
     if (i != arr->varr.len - 1) {
-      chars[len++] = ',';
-      chars[len++] = ' ';
+      append_strbuf(h, buf, ", ", 2);
     }
   }
+  append_char_strbuf(h, buf, ']');
+}
 
-  // We know the string has enough space left in it because we added 2 for the
-  // comma and space after elements, which isn't present on the last element
-  chars[len++] = ']';
+void append_val_strbuf(hby_State* h, StrBuf* buf, Val val) {
+  if (is_str(val)) {
+    append_strbuf(h, buf, as_str(val)->chars, as_str(val)->len);
+    return;
+  } else if (is_num(val)) {
+    append_num_strbuf(h, buf, as_num(val));
+    return;
+  } else if (is_arr(val)) {
+    append_arr_strbuf(h, buf, as_arr(val), 1);
+    return;
+  }
 
-  GcStr* copy = copy_str(h, chars, len);
-  release_arr(h, char, chars, cap);
-  return copy;
+  // Growing the buffer can collect the string
+  GcStr* str = to_str(h, val);
+  push(h, create_obj(str));
+  append_strbuf(h, buf, str->chars, str->len);
+  pop(h);
 }
 
+GcStr* build_strbuf(hby_State* h, StrBuf* buf) {
+  return copy_str(h, buf->chars == NULL ? "" : buf->chars, buf->len);
+}
+
+static GcStr* arr_to_str(hby_State* h, GcArr* arr) {
+  StrBuf buf;
+  init_strbuf(&buf);
+  append_arr_strbuf(h, &buf, arr, 1);
+  GcStr* str = build_strbuf(h, &buf);
+  free_strbuf(h, &buf);
+  return str;
+}
 
 GcStr* to_str(hby_State* h, Val val) {
   if (is_str(val)) {
@@ -87,11 +132,13 @@ GcStr* to_str(hby_State* h, Val val) {
   } else if (is_null(val)) {
     return copy_str(h, "null", 4);
   } else if (is_arr(val)) {
-    return arr_to_str(h, as_arr(val), 1);
+    return arr_to_str(h, as_arr(val));
   } else if (is_udata(val)) {
     return copy_str(h, "<userdata>", 10);
   } else if (is_map(val)) {
     return copy_str(h, "<map>", 5);
+  } else if (is_fiber(val)) {
+    return copy_str(h, "<fiber>", 7);
   } else if (is_fn(val)) {
     return fn_to_str(h, as_fn(val));
   } else if (is_closure(val)) {
@@ -134,10 +181,10 @@ GcStr* num_to_str(hby_State* h, double n) {
     }
   }
 
-  int len = snprintf(NULL, 0, num_fmt, n);
-  char* str = allocate(h, char, len + 1);
-  snprintf(str, len + 1, num_fmt, n);
-  return take_str(h, str, len);
+  // `num_fmt` never needs more than 32 characters
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), num_fmt, n);
+  return copy_str(h, buf, len);
 }
 
 GcStr* bool_to_str(hby_State* h, bool b) {
@@ -5,6 +5,26 @@
 #include "state.h"
 #include "val.h"
 
+// Growable buffer for assembling a string, without interning the pieces
+typedef struct {
+  char* chars;
+  int len;
+  int cap;
+} StrBuf;
+
+void init_strbuf(StrBuf* buf);
+void free_strbuf(hby_State* h, StrBuf* buf);
+// Make room for `extra` more characters
+void reserve_strbuf(hby_State* h, StrBuf* buf, int extra);
+// `chars` must not belong to a string the GC can't reach, since this allocates
+void append_strbuf(hby_State* h, StrBuf* buf, const char* chars, int len);
+void append_char_strbuf(hby_State* h, StrBuf* buf, char c);
+void append_num_strbuf(hby_State* h, StrBuf* buf, double n);
+// Append `val` formatted like `to_str` does. The caller keeps `val` reachable
+void append_val_strbuf(hby_State* h, StrBuf* buf, Val val);
+// Intern the contents as a string. The buffer is left as it is
+GcStr* build_strbuf(hby_State* h, StrBuf* buf);
+
 GcStr* to_str(hby_State* h, Val val);
 GcStr* num_to_str(hby_State* h, double n);
 GcStr* bool_to_str(hby_State* h, bool b);
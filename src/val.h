@@ -1,6 +1,7 @@
 #ifndef __HBY_VAL_H
 #define __HBY_VAL_H
 
+#include <string.h>
 #include "common.h"
 
 typedef struct GcObj GcObj;
@@ -8,8 +9,6 @@ typedef struct GcStr GcStr;
 
 #ifdef nan_boxing
 
-#include <string.h>
-
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
 #define QNAN     ((uint64_t)0x7ffc000000000000)
 
@@ -84,4 +83,20 @@ typedef struct {
 
 bool vals_eql(Val a, Val b);
 
+// Only null and false fail a condition
+static inline bool is_false(Val val) {
+  return is_null(val) || (is_bool(val) && !as_bool(val));
+}
+
+// Whether two constants can share an entry. Numbers are compared by their
+// bits, so 0 and -0 stay apart
+static inline bool same_const(Val a, Val b) {
+  if (is_num(a) && is_num(b)) {
+    double x = as_num(a);
+    double y = as_num(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return !is_num(a) && !is_num(b) && vals_eql(a, b);
+}
+
 #endif // __HBY_VAL_H
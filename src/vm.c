@@ -1,5 +1,6 @@
 #include "vm.h"
 
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -22,6 +23,16 @@
 # include "debug.h"
 #endif
 
+// Ticks until a budgeted call checks again, when it ran out in a nested call
+#define budget_retry 64
+
+// Frames of a stack trace kept from the innermost and outermost calls
+#define trace_head 10
+#define trace_tail 11
+
+static hby_Res protected_call(
+    hby_State* h, GcAnyFn callback, GcFiber* fiber, Val val, int argc);
+
 static int fmt_frame(hby_State* h, CallFrame* frame, char* out, int len) {
   switch (frame->type) {
     case call_type_c:
@@ -29,19 +40,19 @@ static int fmt_frame(hby_State* h, CallFrame* frame, char* out, int len) {
     case call_type_hby:
     case call_type_capi: {
       GcFn* fn = frame->fn.hby->fn;
-      size_t bc = frame->ip - fn->chunk.code - 1;
+      int line = get_line_chunk(&fn->chunk, frame->ip - fn->chunk.code - 1);
 
       if (fn->name != NULL) {
         return snprintf(
           out, len,
           "%s:%d in %s()",
-          fn->path->chars, fn->chunk.lines[bc], fn->name->chars);
+          fn->path->chars, line, fn->name->chars);
       }
 
       return snprintf(
         out, len,
         "%s:%d in script",
-        fn->path->chars, fn->chunk.lines[bc]);
+        fn->path->chars, line);
     }
   }
 
@@ -50,6 +61,8 @@ static int fmt_frame(hby_State* h, CallFrame* frame, char* out, int len) {
 
 void hby_err(hby_State* h, const char* fmt, ...) {
   bool unprotected = true;
+  GcCFn* native = h->native;
+  h->native = NULL;
 
   if (h->pcall != NULL && h->pcall->callback.hby != NULL) {
     unprotected = false;
@@ -68,16 +81,50 @@ void hby_err(hby_State* h, const char* fmt, ...) {
   vsnprintf(err_chars, err_len + 1, fmt, args);
   va_end(args);
 
+  if (h->pcall != NULL && h->pcall->fiber != NULL) {
+    // The error ends the fiber, and its resumer raises it again. Error
+    // callbacks in the fiber share it, so the outermost one is the resume
+    GcFiber* fiber = h->pcall->fiber;
+    PCall* resume = h->pcall;
+    for (PCall* pcall = resume->prev; pcall != NULL; pcall = pcall->prev) {
+      if (pcall->fiber == fiber) {
+        resume = pcall;
+      }
+    }
+
+    GcStr* err = take_str(h, err_chars, err_len);
+    fiber->err = err;
+    gc_barrier(h, &fiber->obj, create_obj(err));
+    h->pcall = resume;
+    longjmp(resume->buf, hby_res_runtime_err);
+  }
+
   if (unprotected) {
     fprintf(stderr, "Unprotected call to C API: %s\n", err_chars);
     release_arr(h, char, err_chars, err_len + 1);
     return;
   }
 
+  unwind_stacks(h, trace_head + trace_tail + 2);
   push(h, create_obj(take_str(h, err_chars, err_len)));
 
   int argc = 1;
+  if (native != NULL) {
+    push(h, create_obj(str_fmt(h, "[C] @()", native->name)));
+    argc++;
+  }
+
+  // Deep recursion would make for a huge trace, so only its ends are kept
+  int depth = h->frame - h->frame_stack;
   for (CallFrame* frame = h->frame; frame > h->frame_stack; frame--) {
+    int i = h->frame - frame;
+    if (i == trace_head && depth > trace_head + trace_tail) {
+      push(h, create_obj(copy_str(h, "...", 3)));
+      argc++;
+      frame = h->frame_stack + trace_tail + 1;
+      continue;
+    }
+
     int len = fmt_frame(h, frame, NULL, 0);
     char* chars = allocate(h, char, len + 1);
     fmt_frame(h, frame, chars, len + 1);
@@ -89,10 +136,12 @@ void hby_err(hby_State* h, const char* fmt, ...) {
 
   GcAnyFn callback;
   callback.hby = NULL;
+  GcFiber* fiber = NULL;
   if (h->pcall->prev != NULL) {
     callback = h->pcall->prev->callback;
+    fiber = h->pcall->prev->fiber;
   }
-  vm_pcall(h, callback, create_obj(h->pcall->callback.hby), argc);
+  protected_call(h, callback, fiber, create_obj(h->pcall->callback.hby), argc);
 
   reset_stack(h);
 
@@ -128,12 +177,8 @@ static bool call_fn(hby_State* h, GcClosure* closure, int argc) {
     hby_err(h, err_msg_bad_argc, closure->fn->arity, argc);
     return false;
   }
-  
-  if (h->frame - h->frame_stack == frames_max) {
-    hby_err(h, err_msg_stack_overflow);
-    return false;
-  }
 
+  reserve_call(h, closure->fn->slots);
   CallFrame* frame = ++h->frame;
   frame->fn.hby = closure;
   frame->ip = closure->fn->chunk.code;
@@ -148,11 +193,18 @@ static bool call_c(hby_State* h, GcCFn* c_fn, int argc) {
     return false;
   }
 
-  if (h->frame - h->frame_stack == frames_max) {
-    hby_err(h, err_msg_stack_overflow);
-    return false;
+  if (c_fn->fast != NULL) {
+    h->native = c_fn;
+    Val val = c_fn->fast(h, h->top - argc, argc);
+    h->native = NULL;
+
+    h->top -= argc + 1;
+    push(h, val);
+    return true;
   }
 
+  reserve_call(h, c_fn_slots);
+
   // TODO: To support pcalls, remove this error handling?
   // All errors should now jump straight to some point with the result
   
@@ -167,7 +219,8 @@ static bool call_c(hby_State* h, GcCFn* c_fn, int argc) {
   push(h, val);
   h->frame--;
 
-  return true;
+  // Yielding stops the interpreter like an error would, see `vm_resume`
+  return !h->yielding;
 }
 
 bool call_val(hby_State* h, Val val, int argc) {
@@ -207,7 +260,7 @@ bool invoke(hby_State* h, GcStr* name, int argc) {
         GcInst* inst = as_inst(reciever);
 
         Val val;
-        if (get_table(&inst->fields, name, &val)) {
+        if (get_field(inst, name, &val)) {
           h->top[-argc - 1] = val;
           return call_val(h, val, argc);
         }
@@ -229,6 +282,8 @@ bool invoke(hby_State* h, GcStr* name, int argc) {
         return builtin_invoke(h, h->map_struct, name, argc);
       case obj_str:
         return builtin_invoke(h, h->string_struct, name, argc);
+      case obj_fiber:
+        return builtin_invoke(h, h->fiber_struct, name, argc);
       case obj_udata: {
         GcUData* udata = as_udata(reciever);
         
@@ -254,16 +309,12 @@ bool invoke(hby_State* h, GcStr* name, int argc) {
   return false;
 }
 
-static bool static_access(hby_State* h, Val val, GcStr* prop) {
+static bool static_access(hby_State* h, Val val, GcStr* prop, Val* out) {
   if (is_obj(val)) {
     switch (obj_type(val)) {
       case obj_struct: {
         GcStruct* s = as_struct(val);
-
-        Val val;
-        if (get_table(&s->staticm, prop, &val)) {
-          pop(h); // Struct
-          push(h, val);
+        if (get_table(&s->staticm, prop, out)) {
           return true;
         }
 
@@ -272,11 +323,7 @@ static bool static_access(hby_State* h, Val val, GcStr* prop) {
       }
       case obj_enum: {
         GcEnum* e = as_enum(val);
-
-        Val val;
-        if (get_table(&e->vals, prop, &val)) {
-          pop(h); // Enum
-          push(h, val);
+        if (get_table(&e->vals, prop, out)) {
           return true;
         }
 
@@ -370,6 +417,7 @@ static bool subscript_set(hby_State* h, Val container, Val k, Val val) {
           return false;
         }
         arr->varr.items[index] = val;
+        gc_barrier(h, &arr->obj, val);
         return true;
       }
       case obj_map: {
@@ -386,13 +434,8 @@ static bool subscript_set(hby_State* h, Val container, Val k, Val val) {
   return false;
 }
 
-static bool bind_method(hby_State* h, GcStruct* _struct, GcStr* name) {
-  Val val;
-  if (!get_table(&_struct->methods, name, &val)) {
-    hby_err(h, err_msg_undef_prop, name->chars);
-    return false;
-  }
-
+// Replace the receiver on top of the stack with `val` bound to it
+static void bind_val(hby_State* h, Val val) {
   GcMethod* method = NULL;
   if (is_closure(val)) {
     method = create_method(h, peek(h, 0), as_closure(val));
@@ -401,9 +444,89 @@ static bool bind_method(hby_State* h, GcStruct* _struct, GcStr* name) {
   }
   pop(h);
   push(h, create_obj(method));
+}
+
+static bool bind_method(hby_State* h, GcStruct* _struct, GcStr* name) {
+  Val val;
+  if (!get_table(&_struct->methods, name, &val)) {
+    hby_err(h, err_msg_undef_prop, name->chars);
+    return false;
+  }
+
+  bind_val(h, val);
   return true;
 }
 
+// Resolve `name` on a receiver of struct `s` and remember it in `cache`. Only
+// instances have fields, anything else is resolved against the methods.
+static bool fill_cache(
+    hby_State* h, InlineCache* cache, GcStruct* s, bool is_inst,
+    GcStr* name, CacheEntry* out) {
+#ifdef hby_ic_stats
+  h->ic_misses++;
+#endif
+
+  CacheEntry entry;
+  entry.shape = s->shape;
+  entry.slot = is_inst ? member_slot(s, name) : -1;
+  entry.method = create_null();
+  if (entry.slot == -1 && !get_table(&s->methods, name, &entry.method)) {
+    return false;
+  }
+
+  // Once every way is taken the site is megamorphic and stays on this path
+  for (int i = 0; i < cache_ways; i++) {
+    if (cache->entries[i].shape == 0) {
+      cache->entries[i] = entry;
+      break;
+    }
+  }
+
+  *out = entry;
+  return true;
+}
+
+// A field entry's slot may still be missing from instances made before the
+// member was added, so callers check it against `fieldc`
+static inline bool lookup_cache(
+    hby_State* h, InlineCache* cache, GcStruct* s, bool is_inst,
+    GcStr* name, CacheEntry* out) {
+  // Entries are filled in order, so the first one is the monomorphic case
+  for (int i = 0; i < cache_ways; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if (entry->shape == s->shape) {
+#ifdef hby_ic_stats
+      h->ic_hits++;
+#endif
+      *out = *entry;
+      return true;
+    }
+
+    if (entry->shape == 0) {
+      break;
+    }
+  }
+
+  return fill_cache(h, cache, s, is_inst, name, out);
+}
+
+// The struct whose methods `invoke` searches for this receiver, or NULL
+static GcStruct* invoke_struct(hby_State* h, Val reciever) {
+  if (is_obj(reciever)) {
+    switch (obj_type(reciever)) {
+      case obj_inst: return as_inst(reciever)->_struct;
+      case obj_arr: return h->array_struct;
+      case obj_map: return h->map_struct;
+      case obj_str: return h->string_struct;
+      case obj_fiber: return h->fiber_struct;
+      case obj_udata: return as_udata(reciever)->metastruct;
+      default: break;
+    }
+  }
+
+  return NULL;
+}
+
 static GcUpval* capture_upval(hby_State* h, Val* local) {
   // Check if we already have this value captured
   GcUpval* prev_up = NULL;
@@ -420,6 +543,7 @@ static GcUpval* capture_upval(hby_State* h, Val* local) {
   // We don't already have this upvalue, create a new one
   GcUpval* new_upval = create_upval(h, local);
   new_upval->next = upval;
+  new_upval->fiber = h->fiber;
 
   if (prev_up == NULL) {
     h->open_upvals = new_upval;
@@ -435,19 +559,67 @@ static void close_upvals(hby_State* h, Val* last) {
     GcUpval* upval = h->open_upvals;
     upval->closed = *upval->loc;
     upval->loc = &upval->closed;
+    gc_barrier(h, &upval->obj, upval->closed);
     h->open_upvals = upval->next;
   }
 }
 
+// Call `callee` with the arguments on top of the stack in place of the
+// running frame, which moves them down to its base. False if the interpreter
+// should stop, like after `call_val`
+static bool tail_call(hby_State* h, Val callee, int argc) {
+  CallFrame* frame = h->frame;
+  Val* base = frame->base;
+  close_upvals(h, base);
+
+  // The callee or receiver and the arguments take the place of this frame
+  memmove(base, h->top - argc - 1, sizeof(Val) * (argc + 1));
+  h->top = base + argc + 1;
+
+  if (is_closure(callee)) {
+    GcClosure* closure = as_closure(callee);
+    if (!closure->fn->variadic && closure->fn->arity == argc) {
+      // Just switch the frame over to the callee
+      reserve_call(h, closure->fn->slots);
+      h->frame->fn.hby = closure;
+      h->frame->ip = closure->fn->chunk.code;
+      return true;
+    }
+  }
+
+  CallType type = frame->type;
+  int depth = h->frame - h->frame_stack;
+  h->frame--;
+
+  if (!call_val(h, callee, argc)) {
+    return false;
+  }
+
+  if (h->frame - h->frame_stack == depth) {
+    // A Hobby function, which returns to wherever this one would have
+    h->frame->type = type;
+  } else if (type == call_type_capi) {
+    // A C function already returned
+    return false;
+  }
+  return true;
+}
+
 static void define_method(hby_State* h, GcStr* name) {
   Val method = peek(h, 0);
   GcStruct* s = as_struct(peek(h, 1));
   set_table(h, &s->methods, name, method);
+  reshape_struct(h, s);
   pop(h);
 }
 
-static bool is_false(Val val) {
-  return is_null(val) || (is_bool(val) && !as_bool(val));
+static inline bool for_cmp(uint8_t flags, double i, double limit) {
+  switch (flags & for_cmp_mask) {
+    case for_lt: return i < limit;
+    case for_lte: return i <= limit;
+    case for_gt: return i > limit;
+    default: return i >= limit;
+  }
 }
 
 GcStruct* vm_get_typestruct(hby_State* h, Val val) {
@@ -465,6 +637,8 @@ GcStruct* vm_get_typestruct(hby_State* h, Val val) {
     return h->string_struct;
   } else if (is_struct(val)) {
     return as_struct(val);
+  } else if (is_fiber(val)) {
+    return h->fiber_struct;
   } else if (is_udata(val)) {
     GcUData* udata = as_udata(val);
     if (udata->metastruct == NULL) {
@@ -482,14 +656,16 @@ void vm_concat(hby_State* h) {
   GcStr* a = to_str(h, peek(h, 2));
   push(h, create_obj(a));
 
+  // Short results are built on the C stack and copied into the string
   int len = a->len + b->len;
-  char* chars = allocate(h, char, len + 1);
+  char buf[str_adopt_len];
+  char* chars = len < str_adopt_len ? buf : allocate(h, char, len + 1);
   memcpy(chars, a->chars, a->len);
   memcpy(chars + a->len, b->chars, b->len);
   chars[len] = '\0';
 
-  GcStr* res = take_str(h, chars, len);
-  
+  GcStr* res = chars == buf ? copy_str(h, chars, len) : take_str(h, chars, len);
+
   pop(h); // Str A
   pop(h); // Str B
   pop(h); // Val A
@@ -518,7 +694,7 @@ static bool get_property(hby_State* h, Val owner, GcStr* name) {
         GcInst* inst = as_inst(owner);
 
         Val val;
-        if (get_table(&inst->fields, name, &val)) {
+        if (get_field(inst, name, &val)) {
           pop(h);
           push(h, val);
           return true;
@@ -575,434 +751,1126 @@ static bool get_property(hby_State* h, Val owner, GcStr* name) {
 #define op_div(a, b) (a / b)
 #define op_mod(a, b) fmod(a, b)
 
+// Called when the budget counts down to zero. Only the interpreter that the
+// budgeted call started can stop there, anything nested has to return first
+static bool out_of_budget(hby_State* h) {
+  if (h->budget_frame < 0) {
+    h->budget = INT_MAX;
+    return false;
+  }
+
+  CallFrame* budget_frame = h->frame_stack + h->budget_frame;
+  if (h->fiber != h->budget_fiber) {
+    h->budget = budget_retry;
+    return false;
+  }
+  for (CallFrame* frame = h->frame; frame > budget_frame; frame--) {
+    if (frame->type != call_type_hby) {
+      h->budget = budget_retry;
+      return false;
+    }
+  }
+
+  h->suspended = true;
+  return true;
+}
+
 static void run(hby_State* h) {
-#define read_byte() (*h->frame->ip++)
-#define read_short() \
-  (h->frame->ip += 2, (uint16_t)((h->frame->ip[-2] << 8) | h->frame->ip[-1]))
-#define read_const() (h->frame->fn.hby->fn->chunk.consts.items[read_byte()])
-#define read_str() as_str(read_const())
+  // The hot interpreter state lives in locals so the compiler can keep it in
+  // registers. It must be written back with `spill()` before anything that can
+  // allocate (and therefore collect), call into another function, or raise an
+  // error, and reloaded afterwards if the callee may have moved it.
+  CallFrame* frame;
+  register uint8_t* ip;
+  register Val* top;
+  Val* base;
+  Val* consts;
+  InlineCache* caches;
+
+#define load_frame() \
+  do { \
+    frame = h->frame; \
+    ip = frame->ip; \
+    base = frame->base; \
+    consts = frame->fn.hby->fn->chunk.consts.items; \
+    caches = frame->fn.hby->fn->chunk.caches; \
+  } while (false)
+#define spill() (frame->ip = ip, h->top = top)
+#define reload_top() (top = h->top)
+
+#define vm_push(v) (*top++ = (v))
+#define vm_pop() (*--top)
+#define vm_peek(dist) (top[-1 - (dist)])
+
+#define read_byte() (*ip++)
+#define read_short() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define read_const() (consts[read_byte()])
+// Names and functions take 16 bits, so they aren't limited to the first 256
+#define read_wide() (consts[read_short()])
+#define read_str() as_str(read_wide())
+#define read_cache() (&caches[read_short()])
+#define for_limit(flags, index) \
+  ((flags) & for_const_limit ? consts[index] : base[index])
+
+// Counts calls and loop iterations against the budget, and suspends the
+// budgeted call if it ran out. The interpreter is at an instruction boundary
+#define tick() \
+  do { \
+    if (--h->budget == 0 && out_of_budget(h)) { \
+      spill(); \
+      return; \
+    } \
+  } while (false)
+
+#define runtime_err(...) \
+  do { \
+    spill(); \
+    hby_err(h, __VA_ARGS__); \
+    return; \
+  } while (false)
+
 #define bin_op(op) \
-    do { \
-        if (!is_num(peek(h, 0)) || !is_num(peek(h, 1))) { \
-          hby_err(h, err_msg_bad_operands("numbers")); \
-          return; \
-        } \
-        double b = as_num(pop(h)); \
-        double a = as_num(pop(h)); \
-        push(h, create_num(op(a, b))); \
-    } while (false)
-
-  while (true) {
+  do { \
+    if (!is_num(vm_peek(0)) || !is_num(vm_peek(1))) { \
+      runtime_err(err_msg_bad_operands("numbers")); \
+    } \
+    double b = as_num(vm_pop()); \
+    double a = as_num(vm_peek(0)); \
+    top[-1] = create_num(op(a, b)); \
+  } while (false)
+// A comparison that is followed by a jump becomes `quick`, which does both
+#define cmp_op(op, quick) \
+  do { \
+    if (!is_num(vm_peek(0)) || !is_num(vm_peek(1))) { \
+      runtime_err(err_msg_bad_operands("numbers")); \
+    } \
+    double b = as_num(vm_pop()); \
+    double a = as_num(vm_peek(0)); \
+    top[-1] = create_bool(a op b); \
+    if (*ip == bc_false_jmp) { \
+      ip[-1] = quick; \
+    } \
+  } while (false)
+// Runs the quickened instruction again as `generic`, for when its guard fails
+#define unquicken(generic) \
+  do { \
+    ip[-1] = generic; \
+    ip--; \
+    dispatch(); \
+  } while (false)
+// A `bc_get_local`, `b`, a comparison and `bc_false_jmp` in one. `b` is the
+// operand of the second instruction
+#define cmp_local_jmp(op, b) \
+  do { \
+    Val a = base[ip[0]]; \
+    if (!is_num(a) || !is_num(b)) { \
+      unquicken(bc_get_local); \
+    } \
+    bool res = as_num(a) op as_num(b); \
+    vm_push(create_bool(res)); \
+    ip += 7; \
+    if (!res) { \
+      ip += (uint16_t)((ip[-2] << 8) | ip[-1]); \
+    } \
+  } while (false)
+// The `bc_false_jmp` stays in the code, its opcode is skipped
+#define cmp_jmp_op(op, generic) \
+  do { \
+    if (!is_num(vm_peek(0)) || !is_num(vm_peek(1))) { \
+      unquicken(generic); \
+    } \
+    double b = as_num(vm_pop()); \
+    bool res = as_num(vm_peek(0)) op b; \
+    top[-1] = create_bool(res); \
+    ip++; \
+    uint16_t jmp = read_short(); \
+    if (!res) { \
+      ip += jmp; \
+    } \
+  } while (false)
+
 #ifdef hby_trace_exec
-    printf("        ");
-    for (Val* slot = h->stack; slot < h->top; slot++) {
-      printf("[ ");
-      printf("%s", to_str(h, *slot)->chars);
-      printf(" ]");
-    }
-    printf("\n");
-    print_bc(
-      h, &h->frame->fn.hby->fn->chunk,
-      (int)(h->frame->ip - h->frame->fn.hby->fn->chunk.code));
+# define trace_exec() \
+  do { \
+    spill(); \
+    printf("        "); \
+    for (Val* slot = h->stack; slot < h->top; slot++) { \
+      printf("[ "); \
+      printf("%s", to_str(h, *slot)->chars); \
+      printf(" ]"); \
+    } \
+    printf("\n"); \
+    print_bc( \
+      h, &frame->fn.hby->fn->chunk, \
+      (int)(ip - frame->fn.hby->fn->chunk.code)); \
+  } while (false)
+#else
+# define trace_exec() do {} while (false)
 #endif
 
-    uint8_t bc;
+#ifdef hby_profile_bc
+# define profile_exec() \
+  do { \
+    int bc = *ip; \
+    int* prev = h->bc_prev; \
+    h->bc_counts[bc]++; \
+    if (prev[1] != bc_count) { \
+      h->bc_pairs[prev[1]][bc]++; \
+    } \
+    if (prev[0] != bc_count) { \
+      h->bc_triples[prev[0]][prev[1]][bc]++; \
+    } \
+    prev[0] = prev[1]; \
+    prev[1] = bc; \
+  } while (false)
+#else
+# define profile_exec() do {} while (false)
+#endif
 
-    switch (bc = read_byte()) {
-      case bc_pop: pop(h); break;
-      case bc_close_upval:
-        close_upvals(h, h->top - 1);
-        pop(h);
-        break;
-      case bc_get_global: {
-        GcStr* name = read_str();
-        Val v;
-        if (!get_table(&h->globals, name, &v)) {
-          hby_err(h, err_msg_undef_var, name->chars);
-          return;
-        }
-        push(h, v);
-        break;
-      }
-      case bc_get_local: {
-        uint8_t slot = read_byte();
-        push(h, h->frame->base[slot]);
-        break;
+#ifdef hby_computed_goto
+  // One indirect jump per handler instead of a single shared one lets the
+  // branch predictor learn opcode sequences. `bc_break` is always patched away
+  // by the compiler, so it has no entry.
+  static void* dispatch_table[] = {
+    [bc_pop] = &&op_bc_pop,
+    [bc_get_global] = &&op_bc_get_global,
+    [bc_get_local] = &&op_bc_get_local,
+    [bc_set_local] = &&op_bc_set_local,
+    [bc_get_local_long] = &&op_bc_get_local_long,
+    [bc_set_local_long] = &&op_bc_set_local_long,
+    [bc_get_upval] = &&op_bc_get_upval,
+    [bc_set_upval] = &&op_bc_set_upval,
+    [bc_close_upval] = &&op_bc_close_upval,
+    [bc_push_prop] = &&op_bc_push_prop,
+    [bc_get_prop] = &&op_bc_get_prop,
+    [bc_set_prop] = &&op_bc_set_prop,
+    [bc_get_subscript] = &&op_bc_get_subscript,
+    [bc_set_subscript] = &&op_bc_set_subscript,
+    [bc_push_subscript] = &&op_bc_push_subscript,
+    [bc_destruct_array] = &&op_bc_destruct_array,
+    [bc_get_static] = &&op_bc_get_static,
+    [bc_init_prop] = &&op_bc_init_prop,
+    [bc_const] = &&op_bc_const,
+    [bc_const_long] = &&op_bc_const_long,
+    [bc_null] = &&op_bc_null,
+    [bc_true] = &&op_bc_true,
+    [bc_false] = &&op_bc_false,
+    [bc_array] = &&op_bc_array,
+    [bc_array_item] = &&op_bc_array_item,
+    [bc_map] = &&op_bc_map,
+    [bc_map_item] = &&op_bc_map_item,
+    [bc_add] = &&op_bc_add,
+    [bc_sub] = &&op_bc_sub,
+    [bc_mul] = &&op_bc_mul,
+    [bc_div] = &&op_bc_div,
+    [bc_mod] = &&op_bc_mod,
+    [bc_eql] = &&op_bc_eql,
+    [bc_neql] = &&op_bc_neql,
+    [bc_gt] = &&op_bc_gt,
+    [bc_lt] = &&op_bc_lt,
+    [bc_gte] = &&op_bc_gte,
+    [bc_lte] = &&op_bc_lte,
+    [bc_cat] = &&op_bc_cat,
+    [bc_is] = &&op_bc_is,
+    [bc_neg] = &&op_bc_neg,
+    [bc_not] = &&op_bc_not,
+    [bc_ineq_jmp] = &&op_bc_ineq_jmp,
+    [bc_switch_table] = &&op_bc_switch_table,
+    [bc_false_jmp] = &&op_bc_false_jmp,
+    [bc_jmp] = &&op_bc_jmp,
+    [bc_loop] = &&op_bc_loop,
+    [bc_call] = &&op_bc_call,
+    [bc_tail_call] = &&op_bc_tail_call,
+    [bc_invoke] = &&op_bc_invoke,
+    [bc_tail_invoke] = &&op_bc_tail_invoke,
+    [bc_intrinsic] = &&op_bc_intrinsic,
+    [bc_invoke_len] = &&op_bc_invoke_len,
+    [bc_for_prep] = &&op_bc_for_prep,
+    [bc_for_loop] = &&op_bc_for_loop,
+    [bc_for_in] = &&op_bc_for_in,
+    [bc_closure] = &&op_bc_closure,
+    [bc_ret] = &&op_bc_ret,
+    [bc_struct] = &&op_bc_struct,
+    [bc_method] = &&op_bc_method,
+    [bc_def_static] = &&op_bc_def_static,
+    [bc_member] = &&op_bc_member,
+    [bc_enum] = &&op_bc_enum,
+    [bc_inst] = &&op_bc_inst,
+    [bc_err] = &&op_bc_err,
+    [bc_lt_nn_jmp] = &&op_bc_lt_nn_jmp,
+    [bc_gt_nn_jmp] = &&op_bc_gt_nn_jmp,
+    [bc_lte_nn_jmp] = &&op_bc_lte_nn_jmp,
+    [bc_gte_nn_jmp] = &&op_bc_gte_nn_jmp,
+    [bc_get_subscript_arr] = &&op_bc_get_subscript_arr,
+    [bc_set_subscript_arr] = &&op_bc_set_subscript_arr,
+    [bc_get_local2] = &&op_bc_get_local2,
+    [bc_get_local_const] = &&op_bc_get_local_const,
+    [bc_get_local_prop] = &&op_bc_get_local_prop,
+    [bc_add_ll] = &&op_bc_add_ll,
+    [bc_lt_ll_jmp] = &&op_bc_lt_ll_jmp,
+    [bc_gt_ll_jmp] = &&op_bc_gt_ll_jmp,
+    [bc_lte_ll_jmp] = &&op_bc_lte_ll_jmp,
+    [bc_gte_ll_jmp] = &&op_bc_gte_ll_jmp,
+    [bc_lt_lc_jmp] = &&op_bc_lt_lc_jmp,
+    [bc_gt_lc_jmp] = &&op_bc_gt_lc_jmp,
+    [bc_lte_lc_jmp] = &&op_bc_lte_lc_jmp,
+    [bc_gte_lc_jmp] = &&op_bc_gte_lc_jmp,
+    [bc_set_local_pop] = &&op_bc_set_local_pop,
+    [bc_pop_jmp] = &&op_bc_pop_jmp,
+    [bc_pop_loop] = &&op_bc_pop_loop,
+  };
+
+# define interpret_loop dispatch();
+# define vm_case(name) op_##name
+# define dispatch() \
+  do { \
+    trace_exec(); \
+    profile_exec(); \
+    goto *dispatch_table[read_byte()]; \
+  } while (false)
+#else
+# define interpret_loop \
+  loop: \
+    trace_exec(); \
+    profile_exec(); \
+    switch (read_byte())
+# define vm_case(name) case name
+# define dispatch() goto loop
+#endif
+
+  load_frame();
+  top = h->top;
+
+  interpret_loop
+  {
+    vm_case(bc_pop):
+      top--;
+      dispatch();
+    vm_case(bc_close_upval):
+      close_upvals(h, top - 1);
+      top--;
+      dispatch();
+    vm_case(bc_get_global): {
+      int* slots = frame->fn.hby->fn->chunk.globals;
+      Global* global = &h->globals[slots[read_short()]];
+      if (!global->defined) {
+        runtime_err(err_msg_undef_var, global->name->chars);
       }
-      case bc_set_local: {
-        uint8_t slot = read_byte();
-        h->frame->base[slot] = peek(h, 0);
-        break;
+      vm_push(global->val);
+      dispatch();
+    }
+    vm_case(bc_get_local): {
+      uint8_t slot = read_byte();
+      vm_push(base[slot]);
+      dispatch();
+    }
+    vm_case(bc_set_local): {
+      uint8_t slot = read_byte();
+      base[slot] = vm_peek(0);
+      dispatch();
+    }
+    vm_case(bc_get_local_long): {
+      uint16_t slot = read_short();
+      vm_push(base[slot]);
+      dispatch();
+    }
+    vm_case(bc_set_local_long): {
+      uint16_t slot = read_short();
+      base[slot] = vm_peek(0);
+      dispatch();
+    }
+    vm_case(bc_get_local2): {
+      uint8_t a = read_byte();
+      ip++; // The second `bc_get_local`
+      uint8_t b = read_byte();
+      vm_push(base[a]);
+      vm_push(base[b]);
+      dispatch();
+    }
+    vm_case(bc_get_local_const): {
+      uint8_t slot = read_byte();
+      ip++; // `bc_const`
+      vm_push(base[slot]);
+      vm_push(read_const());
+      dispatch();
+    }
+    vm_case(bc_get_local_prop): {
+      uint8_t slot = read_byte();
+      ip++; // `bc_get_prop`, which runs next with the local on top
+      vm_push(base[slot]);
+      goto get_prop_op;
+    }
+    vm_case(bc_set_local_pop): {
+      uint8_t slot = read_byte();
+      ip++; // `bc_pop`
+      base[slot] = vm_pop();
+      dispatch();
+    }
+    vm_case(bc_get_upval): {
+      uint8_t slot = read_byte();
+      vm_push(*frame->fn.hby->upvals[slot]->loc);
+      dispatch();
+    }
+    vm_case(bc_set_upval): {
+      uint8_t slot = read_byte();
+      GcUpval* upval = frame->fn.hby->upvals[slot];
+      *upval->loc = vm_peek(0);
+      gc_barrier(h, &upval->obj, vm_peek(0));
+      // Open, but on the stack of a fiber that isn't running
+      if (upval->fiber != h->fiber && upval->loc != &upval->closed) {
+        barrier_back(h, &upval->fiber->obj);
       }
-      case bc_get_upval: {
-        uint8_t slot = read_byte();
-        push(h, *h->frame->fn.hby->upvals[slot]->loc);
-        break;
+      dispatch();
+    }
+    vm_case(bc_push_prop): {
+      // Difference between push_prop and get_prop is that this one leaves the
+      // struct on the stack
+      if (!is_inst(vm_peek(0))) {
+        runtime_err(err_msg_bad_prop_access);
       }
-      case bc_set_upval: {
-        uint8_t slot = read_byte();
-        *h->frame->fn.hby->upvals[slot]->loc = peek(h, 0);
-        break;
+
+      GcInst* inst = as_inst(vm_peek(0));
+      GcStr* name = read_str();
+      InlineCache* cache = read_cache();
+
+      CacheEntry entry;
+      if (!lookup_cache(h, cache, inst->_struct, true, name, &entry)
+          || entry.slot >= inst->fieldc) {
+        runtime_err(err_msg_undef_prop, name->chars);
       }
-      case bc_push_prop: {
-        // Difference between push_prop and get_prop is that this one leaves the
-        // struct on the stack
-        if (!is_inst(peek(h, 0))) {
-          hby_err(h, err_msg_bad_prop_access);
-          return;
-        }
 
-        GcInst* inst = as_inst(peek(h, 0));
-        GcStr* name = read_str();
+      if (entry.slot != -1) {
+        vm_push(inst->fields[entry.slot]);
+        dispatch();
+      }
 
-        Val val;
-        if (get_table(&inst->fields, name, &val)) {
-          push(h, val);
-          break;
+      spill();
+      bind_val(h, entry.method);
+      dispatch();
+    }
+    vm_case(bc_get_prop):
+    get_prop_op: {
+      GcStr* name = read_str();
+      InlineCache* cache = read_cache();
+
+      if (is_inst(vm_peek(0))) {
+        GcInst* inst = as_inst(vm_peek(0));
+
+        CacheEntry entry;
+        if (!lookup_cache(h, cache, inst->_struct, true, name, &entry)
+            || entry.slot >= inst->fieldc) {
+          runtime_err(err_msg_undef_prop, name->chars);
         }
 
-        if (!bind_method(h, inst->_struct, name)) {
-          return;
+        if (entry.slot != -1) {
+          top[-1] = inst->fields[entry.slot];
+          dispatch();
         }
-        break;
+
+        spill();
+        bind_val(h, entry.method);
+        dispatch();
       }
-      case bc_get_prop: {
-        Val val = peek(h, 0);
-        GcStr* name = read_str();
-        if (!get_property(h, val, name)) {
-          return;
-        }
-        break;
+
+      spill();
+      if (!get_property(h, vm_peek(0), name)) {
+        return;
+      }
+      reload_top();
+      dispatch();
+    }
+    vm_case(bc_set_prop): {
+      if (!is_inst(vm_peek(1))) {
+        runtime_err(err_msg_bad_prop_access);
       }
-      case bc_set_prop: {
-        if (!is_inst(peek(h, 1))) {
-          hby_err(h, err_msg_bad_prop_access);
-          return;
-        }
 
-        GcInst* inst = as_inst(peek(h, 1));
-        GcStr* name = read_str();
-        if (set_table(h, &inst->fields, name, peek(h, 0))) {
-          hby_err(h, err_msg_undef_prop, name->chars);;
-          return;
-        }
+      GcInst* inst = as_inst(vm_peek(1));
+      GcStr* name = read_str();
+      InlineCache* cache = read_cache();
 
-        Val val = pop(h); // Value assigned
-        pop(h); // Instance
-        push(h, val);
+      // Methods can't be assigned to, so they count as undefined here
+      CacheEntry entry;
+      if (!lookup_cache(h, cache, inst->_struct, true, name, &entry)
+          || entry.slot == -1 || entry.slot >= inst->fieldc) {
+        runtime_err(err_msg_undef_prop, name->chars);
+      }
+      inst->fields[entry.slot] = vm_peek(0);
+      gc_barrier(h, &inst->obj, vm_peek(0));
 
-        break;
+      // Replace the instance with the assigned value
+      top[-2] = top[-1];
+      top--;
+      dispatch();
+    }
+    vm_case(bc_init_prop): {
+      // This value being an instance is already verified by `bc_inst`
+      GcInst* inst = as_inst(vm_peek(1));
+      GcStr* name = read_str();
+
+      int slot = member_slot(inst->_struct, name);
+      if (slot == -1 || slot >= inst->fieldc) {
+        runtime_err(err_msg_undef_prop, name->chars);
       }
-      case bc_init_prop: {
-        // This value being an instance is already verified by `bc_inst`
-        GcInst* inst = as_inst(peek(h, 1));
-        GcStr* name = read_str();
-        if (set_table(h, &inst->fields, name, peek(h, 0))) {
-          hby_err(h, err_msg_undef_prop, name->chars);
-          return;
-        }
-        pop(h);
-        break;
+      inst->fields[slot] = vm_peek(0);
+      gc_barrier(h, &inst->obj, vm_peek(0));
+      top--;
+      dispatch();
+    }
+    vm_case(bc_get_subscript): {
+      if (is_arr(vm_peek(1)) && is_num(vm_peek(0))) {
+        ip[-1] = bc_get_subscript_arr;
       }
-      case bc_get_subscript: {
-        Val k = pop(h);
-        Val container = pop(h);
-        if (!subscript_get(h, container, k)) {
-          return;
-        }
-        break;
+
+      // The operands stay on the stack while `subscript_get` runs so they're
+      // still rooted if it allocates.
+      spill();
+      if (!subscript_get(h, vm_peek(1), vm_peek(0))) {
+        return;
       }
-      case bc_set_subscript: {
-        Val val = pop(h);
-        Val k = pop(h);
-        Val container = pop(h);
-        if (!subscript_set(h, container, k, val)) {
-          return;
-        }
-        push(h, val);
-        break;
+      reload_top();
+      top[-3] = top[-1];
+      top -= 2;
+      dispatch();
+    }
+    vm_case(bc_set_subscript): {
+      if (is_arr(vm_peek(2)) && is_num(vm_peek(1))) {
+        ip[-1] = bc_set_subscript_arr;
       }
-      case bc_push_subscript: {
-        Val k = peek(h, 0);
-        Val container = peek(h, 1);
-        if (!subscript_get(h, container, k)) {
-          return;
-        }
-        break;
+
+      spill();
+      if (!subscript_set(h, vm_peek(2), vm_peek(1), vm_peek(0))) {
+        return;
+      }
+      top[-3] = top[-1];
+      top -= 2;
+      dispatch();
+    }
+    vm_case(bc_get_subscript_arr): {
+      if (!is_arr(vm_peek(1)) || !is_num(vm_peek(0))) {
+        unquicken(bc_get_subscript);
       }
-      case bc_destruct_array: {
-        int index = read_byte();
 
-        if (is_null(peek(h, 0))) {
-          push(h, create_null());
-          break;
-        }
+      GcArr* arr = as_arr(vm_peek(1));
+      int index = (int)as_num(vm_peek(0));
+      if (index < 0) {
+        index += arr->varr.len;
+      }
+      if (index < 0 || index >= arr->varr.len) {
+        runtime_err(err_msg_index_out_of_bounds);
+      }
+      top[-2] = arr->varr.items[index];
+      top--;
+      dispatch();
+    }
+    vm_case(bc_set_subscript_arr): {
+      if (!is_arr(vm_peek(2)) || !is_num(vm_peek(1))) {
+        unquicken(bc_set_subscript);
+      }
 
-        if (!is_arr(peek(h, 0))) {
-          hby_err(h, err_msg_bad_destruct_val);
-          return;
-        }
+      GcArr* arr = as_arr(vm_peek(2));
+      int index = (int)as_num(vm_peek(1));
+      if (index < 0) {
+        index += arr->varr.len;
+      }
+      if (index < 0 || index >= arr->varr.len) {
+        runtime_err(err_msg_index_out_of_bounds);
+      }
+      arr->varr.items[index] = vm_peek(0);
+      gc_barrier(h, &arr->obj, vm_peek(0));
+      top[-3] = top[-1];
+      top -= 2;
+      dispatch();
+    }
+    vm_case(bc_push_subscript): {
+      spill();
+      if (!subscript_get(h, vm_peek(1), vm_peek(0))) {
+        return;
+      }
+      reload_top();
+      dispatch();
+    }
+    vm_case(bc_destruct_array): {
+      int index = read_byte();
 
-        GcArr* arr = as_arr(peek(h, 0));
+      if (is_null(vm_peek(0))) {
+        vm_push(create_null());
+        dispatch();
+      }
 
-        if (index >= arr->varr.len) {
-          hby_err(h, err_msg_bad_destruct_len);
-          return;
-        }
+      if (!is_arr(vm_peek(0))) {
+        runtime_err(err_msg_bad_destruct_val);
+      }
 
-        push(h, arr->varr.items[index]);
-        break;
+      GcArr* arr = as_arr(vm_peek(0));
+
+      if (index >= arr->varr.len) {
+        runtime_err(err_msg_bad_destruct_len);
       }
-      case bc_get_static: {
-        if (!static_access(h, peek(h, 0), read_str())) {
-          return;
-        }
-        break;
+
+      vm_push(arr->varr.items[index]);
+      dispatch();
+    }
+    vm_case(bc_get_static): {
+      GcStr* name = read_str();
+      spill();
+      if (!static_access(h, vm_peek(0), name, &top[-1])) {
+        return;
       }
-      case bc_const: {
-        push(h, read_const());
-        break;
+      dispatch();
+    }
+    vm_case(bc_const):
+      vm_push(read_const());
+      dispatch();
+    vm_case(bc_const_long): {
+      int index = read_byte() << 16;
+      index |= read_short();
+      vm_push(consts[index]);
+      dispatch();
+    }
+    vm_case(bc_true):
+      vm_push(create_bool(true));
+      dispatch();
+    vm_case(bc_false):
+      vm_push(create_bool(false));
+      dispatch();
+    vm_case(bc_null):
+      vm_push(create_null());
+      dispatch();
+    vm_case(bc_array): {
+      spill();
+      GcArr* arr = create_arr(h);
+      vm_push(create_obj(arr));
+      dispatch();
+    }
+    vm_case(bc_array_item): {
+      // Compiler ensures this is an array
+      GcArr* arr = as_arr(vm_peek(1));
+      spill();
+      push_varr(h, &arr->varr, vm_peek(0));
+      top--;
+      dispatch();
+    }
+    vm_case(bc_map): {
+      spill();
+      GcMap* map = create_map(h);
+      vm_push(create_obj(map));
+      dispatch();
+    }
+    vm_case(bc_map_item): {
+      GcMap* map = as_map(vm_peek(2));
+      spill();
+      set_map(h, map, vm_peek(1), vm_peek(0));
+      top -= 2;
+      dispatch();
+    }
+    vm_case(bc_add): bin_op(op_add); dispatch();
+    vm_case(bc_sub): bin_op(op_sub); dispatch();
+    vm_case(bc_mul): bin_op(op_mul); dispatch();
+    vm_case(bc_div): bin_op(op_div); dispatch();
+    vm_case(bc_mod): bin_op(op_mod); dispatch();
+    vm_case(bc_eql): {
+      Val b = vm_pop();
+      top[-1] = create_bool(vals_eql(top[-1], b));
+      dispatch();
+    }
+    vm_case(bc_neql): {
+      Val b = vm_pop();
+      top[-1] = create_bool(!vals_eql(top[-1], b));
+      dispatch();
+    }
+    vm_case(bc_gte): cmp_op(>=, bc_gte_nn_jmp); dispatch();
+    vm_case(bc_lte): cmp_op(<=, bc_lte_nn_jmp); dispatch();
+    vm_case(bc_gt): cmp_op(>, bc_gt_nn_jmp); dispatch();
+    vm_case(bc_lt): cmp_op(<, bc_lt_nn_jmp); dispatch();
+    vm_case(bc_gte_nn_jmp): cmp_jmp_op(>=, bc_gte); dispatch();
+    vm_case(bc_lte_nn_jmp): cmp_jmp_op(<=, bc_lte); dispatch();
+    vm_case(bc_gt_nn_jmp): cmp_jmp_op(>, bc_gt); dispatch();
+    vm_case(bc_lt_nn_jmp): cmp_jmp_op(<, bc_lt); dispatch();
+    vm_case(bc_lt_ll_jmp): cmp_local_jmp(<, base[ip[2]]); dispatch();
+    vm_case(bc_gt_ll_jmp): cmp_local_jmp(>, base[ip[2]]); dispatch();
+    vm_case(bc_lte_ll_jmp): cmp_local_jmp(<=, base[ip[2]]); dispatch();
+    vm_case(bc_gte_ll_jmp): cmp_local_jmp(>=, base[ip[2]]); dispatch();
+    vm_case(bc_lt_lc_jmp): cmp_local_jmp(<, consts[ip[2]]); dispatch();
+    vm_case(bc_gt_lc_jmp): cmp_local_jmp(>, consts[ip[2]]); dispatch();
+    vm_case(bc_lte_lc_jmp): cmp_local_jmp(<=, consts[ip[2]]); dispatch();
+    vm_case(bc_gte_lc_jmp): cmp_local_jmp(>=, consts[ip[2]]); dispatch();
+    vm_case(bc_add_ll): {
+      Val a = base[ip[0]];
+      Val b = base[ip[2]];
+      if (!is_num(a) || !is_num(b)) {
+        unquicken(bc_get_local);
       }
-      case bc_true:  push(h, create_bool(true)); break;
-      case bc_false: push(h, create_bool(false)); break;
-      case bc_null:  push(h, create_null()); break;
-      case bc_array: {
-        GcArr* arr = create_arr(h);
-        push(h, create_obj(arr));
-        break;
+      ip += 4;
+      vm_push(create_num(op_add(as_num(a), as_num(b))));
+      dispatch();
+    }
+    vm_case(bc_cat):
+      spill();
+      vm_concat(h);
+      reload_top();
+      dispatch();
+    vm_case(bc_is): {
+      if (!is_struct(vm_peek(0))) {
+        runtime_err(err_msg_bad_operands("type"));
       }
-      case bc_array_item: {
-        // Compiler ensures this is an array
-        GcArr* arr = as_arr(peek(h, 1));
-        push_varr(h, &arr->varr, peek(h, 0));
-        pop(h);
-        break;
+      spill();
+      bool res = vm_isop(h);
+      reload_top();
+      vm_push(create_bool(res));
+      dispatch();
+    }
+    vm_case(bc_neg):
+      if (!is_num(vm_peek(0))) {
+        runtime_err(err_msg_bad_operand("number"));
       }
-      case bc_map: {
-        GcMap* map = create_map(h);
-        push(h, create_obj(map));
-        break;
+      top[-1] = create_num(-as_num(top[-1]));
+      dispatch();
+    vm_case(bc_not):
+      top[-1] = create_bool(is_false(top[-1]));
+      dispatch();
+    vm_case(bc_ineq_jmp): {
+      uint16_t jmp = read_short();
+      Val b = vm_pop();
+      Val a = vm_peek(0);
+      if (!vals_eql(a, b)) {
+        ip += jmp;
       }
-      case bc_map_item: {
-        GcMap* map = as_map(peek(h, 2));
-        Val val = peek(h, 0);
-        Val key = peek(h, 1);
-        set_map(h, map, key, val);
-        pop(h); // val
-        pop(h); // key
-        break;
+      dispatch();
+    }
+    vm_case(bc_switch_table): {
+      GcMap* table = as_map(consts[read_short()]);
+      uint16_t jmp = read_short();
+      Val val = vm_peek(0);
+      Val offset;
+      if (get_map(table, val, &offset)) {
+        ip += (int)as_num(offset);
+      } else {
+        ip += jmp;
       }
-      case bc_add: bin_op(op_add); break;
-      case bc_sub: bin_op(op_sub); break;
-      case bc_mul: bin_op(op_mul); break;
-      case bc_div: bin_op(op_div); break;
-      case bc_mod: bin_op(op_mod); break;
-      case bc_eql: {
-        Val b = pop(h);
-        Val a = pop(h);
-        push(h, create_bool(vals_eql(a, b)));
-        break;
+      dispatch();
+    }
+    vm_case(bc_false_jmp): {
+      uint16_t jmp = read_short();
+      if (is_false(vm_peek(0))) {
+        ip += jmp;
       }
-      case bc_neql: {
-        Val b = pop(h);
-        Val a = pop(h);
-        push(h, create_bool(!vals_eql(a, b)));
-        break;
+      dispatch();
+    }
+    vm_case(bc_jmp): {
+      uint16_t jmp = read_short();
+      ip += jmp;
+      dispatch();
+    }
+    vm_case(bc_loop): {
+      uint16_t jmp = read_short();
+      ip -= jmp;
+      tick();
+      dispatch();
+    }
+    vm_case(bc_for_prep): {
+      uint8_t slot = read_byte();
+      uint8_t limit_index = read_byte();
+      uint8_t flags = read_byte();
+      uint16_t jmp = read_short();
+
+      Val i = base[slot];
+      Val limit = for_limit(flags, limit_index);
+      if (!is_num(i) || !is_num(limit)) {
+        runtime_err(err_msg_bad_operands("numbers"));
       }
-      case bc_gte: {
-        if (!is_num(peek(h, 0)) || !is_num(peek(h, 1))) {
-          hby_err(h, err_msg_bad_operands("numbers"));
-          return;
-        }
-        double b = as_num(pop(h));
-        double a = as_num(pop(h));
-        push(h, create_bool(a >= b));
-        break;
+      if (!for_cmp(flags, as_num(i), as_num(limit))) {
+        ip += jmp;
       }
-      case bc_lte: {
-        if (!is_num(peek(h, 0)) || !is_num(peek(h, 1))) {
-          hby_err(h, err_msg_bad_operands("numbers"));
-          return;
-        }
-        double b = as_num(pop(h));
-        double a = as_num(pop(h));
-        push(h, create_bool(a <= b));
-        break;
+      dispatch();
+    }
+    vm_case(bc_for_loop): {
+      uint8_t slot = read_byte();
+      uint8_t limit_index = read_byte();
+      uint8_t flags = read_byte();
+      double step = as_num(read_const());
+      uint16_t jmp = read_short();
+
+      // The body may have changed both, like it could in the loop this was
+      // compiled from
+      Val i = base[slot];
+      if (!is_num(i)) {
+        runtime_err(err_msg_bad_operands("numbers"));
       }
-      case bc_gt: {
-        if (!is_num(peek(h, 0)) || !is_num(peek(h, 1))) {
-          hby_err(h, err_msg_bad_operands("numbers"));
-          return;
-        }
-        double b = as_num(pop(h));
-        double a = as_num(pop(h));
-        push(h, create_bool(a > b));
-        break;
+      double next = as_num(i) + step;
+      base[slot] = create_num(next);
+
+      Val limit = for_limit(flags, limit_index);
+      if (!is_num(limit)) {
+        runtime_err(err_msg_bad_operands("numbers"));
       }
-      case bc_lt: {
-        if (!is_num(peek(h, 0)) || !is_num(peek(h, 1))) {
-          hby_err(h, err_msg_bad_operands("numbers"));
-          return;
-        }
-        double b = as_num(pop(h));
-        double a = as_num(pop(h));
-        push(h, create_bool(a < b));
-        break;
+      if (for_cmp(flags, next, as_num(limit))) {
+        ip -= jmp;
+        tick();
       }
-      case bc_cat:
-        vm_concat(h);
-        break;
-      case bc_is:
-        if (!is_struct(peek(h, 0))) {
-          hby_err(h, err_msg_bad_operands("type"));
-          return;
-        }
-        push(h, create_bool(vm_isop(h)));
-        break;
-      case bc_neg:
-        if (!is_num(peek(h, 0))) {
-          hby_err(h, err_msg_bad_operand("number"));
-          return;
-        }
-        push(h, create_num(-as_num(pop(h))));
-        break;
-      case bc_not: push(h, create_bool(is_false(pop(h)))); break;
-      case bc_ineq_jmp: {
-        uint16_t jmp = read_short();
-        Val b = pop(h);
-        Val a = peek(h, 0);
-        if (!vals_eql(a, b)) {
-          h->frame->ip += jmp;
-        }
-        break;
+      dispatch();
+    }
+    vm_case(bc_for_in): {
+      // The iterated value, the cursor and the loop variables are locals in
+      // this order. The cursor is null before the first step, then how far
+      // it got. Instances are iterated by calling their methods, which return
+      // here with the result on the stack. While one runs the cursor is -1
+      // for `iter`, or -2 - n for the `next` after n values
+      uint8_t* start = ip - 1;
+      Val* slots = &base[read_short()];
+      uint8_t varc = read_byte();
+      uint16_t jmp = read_short();
+
+      if (is_num(slots[1]) && as_num(slots[1]) == -1) {
+        // `iter` returned what to iterate instead
+        slots[0] = vm_pop();
+        slots[1] = create_num(0);
+        ip = start;
+        dispatch();
       }
-      case bc_false_jmp: {
-        uint16_t jmp = read_short();
-        if (is_false(peek(h, 0))) {
-          h->frame->ip += jmp;
+
+      Val seq = slots[0];
+      int i = is_num(slots[1]) ? (int)as_num(slots[1]) : 0;
+      Val key;
+      Val val;
+      if (is_arr(seq)) {
+        VArr* varr = &as_arr(seq)->varr;
+        if (i >= varr->len) {
+          ip += jmp;
+          dispatch();
         }
-        break;
-      }
-      case bc_jmp: {
-        uint16_t jmp = read_short();
-        h->frame->ip += jmp;
-        break;
-      }
-      case bc_loop: {
-        uint16_t jmp = read_short();
-        h->frame->ip -= jmp;
-        break;
-      }
-      case bc_call: {
-        int argc = read_byte();
-        if (!call_val(h, peek(h, argc), argc)) {
-          return;
+        key = create_num(i);
+        val = varr->items[i++];
+      } else if (is_map(seq)) {
+        // Empty slots and tombstones both have a null key
+        GcMap* map = as_map(seq);
+        while (i < map->item_cap && is_null(map->items[i].key)) {
+          i++;
         }
-        break;
-      }
-      case bc_invoke: {
-        GcStr* name = read_str();
-        int argc = read_byte();
-        if (!invoke(h, name, argc)) {
-          return;
+        if (i >= map->item_cap) {
+          ip += jmp;
+          dispatch();
         }
-        break;
-      }
-      case bc_closure: {
-        GcFn* fn = as_fn(read_const());
-        GcClosure* closure = create_closure(h, fn);
-        push(h, create_obj(closure));
-        
-        for (int i = 0; i < fn->upvalc; i++) {
-          uint8_t is_local = read_byte();
-          uint8_t index = read_byte();
-          if (is_local) {
-            closure->upvals[i] = capture_upval(h, h->frame->base + index);
+        key = map->items[i].key;
+        val = map->items[i++].val;
+      } else if (is_str(seq)) {
+        GcStr* str = as_str(seq);
+        if (i >= str->len) {
+          ip += jmp;
+          dispatch();
+        }
+        spill();
+        key = create_num(i);
+        val = create_obj(copy_str(h, &str->chars[i++], 1));
+      } else if (is_inst(seq)) {
+        if (i < -1) {
+          val = vm_pop();
+          if (is_null(val)) {
+            ip += jmp;
+            dispatch();
+          }
+          i = -i - 2;
+          key = create_num(i++);
+        } else {
+          Val method;
+          GcStr* name = h->next_str;
+          if (is_null(slots[1]) && get_table(
+              &as_inst(seq)->_struct->methods, h->iter_str, &method)) {
+            name = h->iter_str;
+            slots[1] = create_num(-1);
           } else {
-            closure->upvals[i] = h->frame->fn.hby->upvals[index];
+            slots[1] = create_num(-2 - i);
           }
+
+          vm_push(seq);
+          ip = start;
+          spill();
+          if (!invoke(h, name, 0)) {
+            return;
+          }
+          load_frame();
+          reload_top();
+          tick();
+          dispatch();
         }
-        break;
+      } else {
+        runtime_err(err_msg_bad_iter);
       }
-      case bc_ret: {
-        Val res = pop(h);
-        close_upvals(h, h->frame->base);
-
-        h->top = h->frame->base;
-        push(h, res);
 
-        CallFrame* frame = h->frame--;
-        if (frame->type == call_type_capi) {
-          return;
+      // A single variable gets the keys of maps and the values of the rest
+      slots[1] = create_num(i);
+      if (varc == 1) {
+        slots[2] = is_map(seq) ? key : val;
+      } else {
+        slots[2] = key;
+        slots[3] = val;
+      }
+      dispatch();
+    }
+    vm_case(bc_pop_jmp): {
+      top--;
+      ip++; // `bc_jmp`
+      uint16_t jmp = read_short();
+      ip += jmp;
+      dispatch();
+    }
+    vm_case(bc_pop_loop): {
+      top--;
+      ip++; // `bc_loop`
+      uint16_t jmp = read_short();
+      ip -= jmp;
+      tick();
+      dispatch();
+    }
+    vm_case(bc_call): {
+      int argc = read_byte();
+      spill();
+      if (!call_val(h, vm_peek(argc), argc)) {
+        return;
+      }
+      load_frame();
+      reload_top();
+      tick();
+      dispatch();
+    }
+    vm_case(bc_tail_call): {
+      int argc = read_byte();
+      spill();
+      if (!tail_call(h, vm_peek(argc), argc)) {
+        return;
+      }
+      load_frame();
+      reload_top();
+      tick();
+      dispatch();
+    }
+    vm_case(bc_intrinsic): {
+      Intrinsic id = (Intrinsic)read_byte();
+      GcStr* name = read_str();
+      int argc = read_byte();
+
+      Val* args = top - argc;
+      if (is_obj(args[-1]) && as_obj(args[-1]) == (GcObj*)h->math_struct
+          && argc == intrinsic_infos[id].argc
+          && is_num(args[0]) && (argc == 1 || is_num(args[1]))) {
+        double a = as_num(args[0]);
+        double res = 0;
+        switch (id) {
+          case intrinsic_abs: res = fabs(a); break;
+          case intrinsic_sqrt: res = sqrt(a); break;
+          case intrinsic_floor: res = floor(a); break;
+          case intrinsic_min: res = fmin(a, as_num(args[1])); break;
+          case intrinsic_max: res = fmax(a, as_num(args[1])); break;
+          case intrinsic_sin: res = sin(a); break;
+          case intrinsic_cos: res = cos(a); break;
+          default: break;
         }
+        top = args - 1;
+        vm_push(create_num(res));
+        dispatch();
+      }
 
-        break;
+      // `math` was replaced or the arguments are wrong, so do what
+      // `bc_get_static` and `bc_call` would have
+      spill();
+      if (!static_access(h, args[-1], name, &args[-1])
+          || !call_val(h, args[-1], argc)) {
+        return;
       }
-      case bc_struct: {
-        push(h, create_obj(create_struct(h, read_str())));
-        break;
+      load_frame();
+      reload_top();
+      tick();
+      dispatch();
+    }
+    vm_case(bc_invoke_len): {
+      Val reciever = vm_peek(0);
+      if (is_arr(reciever) && h->array_struct->shape == h->array_shape) {
+        ip += 5; // Same operands as `bc_invoke`
+        top[-1] = create_num(as_arr(reciever)->varr.len);
+        dispatch();
       }
-      case bc_def_static: {
-        Val val = peek(h, 0);
-        GcStruct* s = as_struct(peek(h, 1));
-        set_table(h, &s->staticm, read_str(), val);
-        pop(h);
-        break;
+      if (is_str(reciever) && h->string_struct->shape == h->string_shape) {
+        ip += 5;
+        top[-1] = create_num(as_str(reciever)->len);
+        dispatch();
       }
-      case bc_method: {
-        define_method(h, read_str());
-        break;
+      goto invoke_op;
+    }
+    vm_case(bc_invoke):
+    vm_case(bc_tail_invoke):
+    invoke_op: {
+      bool tail = ip[-1] == bc_tail_invoke;
+      GcStr* name = read_str();
+      int argc = read_byte();
+      InlineCache* cache = read_cache();
+
+      Val reciever = vm_peek(argc);
+      GcStruct* s = invoke_struct(h, reciever);
+      if (s == NULL) {
+        // Let the uncached path report the error
+        spill();
+        invoke(h, name, argc);
+        return;
       }
-      case bc_member: {
-        Val val = peek(h, 0);
-        GcStruct* s = as_struct(peek(h, 1));
-        set_table(h, &s->members, read_str(), val);
-        pop(h);
-        break;
+
+      GcInst* inst = is_inst(reciever) ? as_inst(reciever) : NULL;
+      CacheEntry entry;
+      if (!lookup_cache(h, cache, s, inst != NULL, name, &entry)
+          || (inst != NULL && entry.slot >= inst->fieldc)) {
+        runtime_err(err_msg_undef_prop, name->chars);
       }
-      case bc_enum: {
-        GcStr* name = read_str();
-        push(h, create_obj(name));
-        GcEnum* _enum = create_enum(h, name);
-        pop(h);
-        push(h, create_obj(_enum));
-
-        uint8_t count = read_byte();
-        for (int i = 0; i < count; i++) {
-          GcStr* name = read_str();
-          push(h, create_obj(name));
-          if (!set_table(h, &_enum->vals, name, create_num(i))) {
-            hby_err(h, err_msg_shadow_prev_enum, name->chars);
-            return;
-          }
-          pop(h);
+
+      spill();
+      bool ok;
+      if (entry.slot != -1) {
+        Val val = inst->fields[entry.slot];
+        top[-argc - 1] = val;
+        ok = tail ? tail_call(h, val, argc) : call_val(h, val, argc);
+      } else if (tail) {
+        ok = tail_call(h, entry.method, argc);
+      } else if (is_c_fn(entry.method)) {
+        ok = call_c(h, as_c_fn(entry.method), argc);
+      } else {
+        ok = call_fn(h, as_closure(entry.method), argc);
+      }
+
+      if (!ok) {
+        return;
+      }
+      load_frame();
+      reload_top();
+      tick();
+      dispatch();
+    }
+    vm_case(bc_closure): {
+      GcFn* fn = as_fn(read_wide());
+      spill();
+      GcClosure* closure = create_closure(h, fn);
+      vm_push(create_obj(closure));
+      // Capturing allocates, so the closure must be rooted
+      h->top = top;
+
+      for (int i = 0; i < fn->upvalc; i++) {
+        // The top bit is set for locals
+        uint16_t index = read_short();
+        if (index & 0x8000) {
+          closure->upvals[i] = capture_upval(h, base + (index & 0x7FFF));
+        } else {
+          closure->upvals[i] = frame->fn.hby->upvals[index];
         }
+        // Capturing can promote the closure before its upvalues are filled
+        gc_barrier(h, &closure->obj, create_obj(closure->upvals[i]));
+      }
+      dispatch();
+    }
+    vm_case(bc_ret): {
+      Val res = vm_pop();
+      close_upvals(h, base);
 
-        break;
+      top = base;
+      vm_push(res);
+
+      h->frame--;
+      if (frame->type == call_type_capi) {
+        h->top = top;
+        return;
       }
-      case bc_inst: {
-        if (!is_struct(peek(h, 0))) {
-          hby_err(h, err_msg_bad_inst);
+
+      load_frame();
+      dispatch();
+    }
+    vm_case(bc_struct): {
+      GcStr* name = read_str();
+      spill();
+      vm_push(create_obj(create_struct(h, name)));
+      dispatch();
+    }
+    vm_case(bc_def_static): {
+      GcStruct* s = as_struct(vm_peek(1));
+      GcStr* name = read_str();
+      spill();
+      set_table(h, &s->staticm, name, vm_peek(0));
+      top--;
+      dispatch();
+    }
+    vm_case(bc_method): {
+      GcStr* name = read_str();
+      spill();
+      define_method(h, name);
+      reload_top();
+      dispatch();
+    }
+    vm_case(bc_member): {
+      GcStruct* s = as_struct(vm_peek(1));
+      GcStr* name = read_str();
+      spill();
+      add_struct_member(h, s, name, vm_peek(0));
+      top--;
+      dispatch();
+    }
+    vm_case(bc_enum): {
+      GcStr* name = read_str();
+      spill();
+      push(h, create_obj(name));
+      GcEnum* _enum = create_enum(h, name);
+      pop(h);
+      push(h, create_obj(_enum));
+
+      uint8_t count = read_byte();
+      for (int i = 0; i < count; i++) {
+        GcStr* name = read_str();
+        push(h, create_obj(name));
+        if (!set_table(h, &_enum->vals, name, create_num(i))) {
+          frame->ip = ip;
+          hby_err(h, err_msg_shadow_prev_enum, name->chars);
           return;
         }
-
-        GcStruct* s = as_struct(peek(h, 0));
-        h->top[-1] = create_obj(create_inst(h, s));
-        break;
+        pop(h);
       }
-      case bc_err: {
-        GcStr* msg = read_str();
-        hby_err(h, "%s", msg->chars);
-        return;
+
+      reload_top();
+      dispatch();
+    }
+    vm_case(bc_inst): {
+      if (!is_struct(vm_peek(0))) {
+        runtime_err(err_msg_bad_inst);
       }
+
+      GcStruct* s = as_struct(vm_peek(0));
+      spill();
+      top[-1] = create_obj(create_inst(h, s));
+      dispatch();
+    }
+    vm_case(bc_err): {
+      GcStr* msg = read_str();
+      runtime_err("%s", msg->chars);
     }
   }
 
-#undef bin_op
+#undef load_frame
+#undef spill
+#undef reload_top
+#undef vm_push
+#undef vm_pop
+#undef vm_peek
 #undef read_byte
 #undef read_short
 #undef read_const
+#undef read_wide
 #undef read_str
+#undef read_cache
+#undef for_limit
+#undef tick
+#undef runtime_err
+#undef bin_op
+#undef cmp_op
+#undef unquicken
+#undef cmp_jmp_op
+#undef cmp_local_jmp
+#undef trace_exec
+#undef profile_exec
+#undef interpret_loop
+#undef vm_case
+#undef dispatch
 }
 
 void vm_invoke(hby_State* h, GcStr* name, int argc) {
@@ -1024,12 +1892,21 @@ void vm_call(hby_State* h, Val val, int argc) {
 }
 
 hby_Res vm_pcall(hby_State* h, GcAnyFn callback, Val val, int argc) {
+  return protected_call(h, callback, NULL, val, argc);
+}
+
+static hby_Res protected_call(
+    hby_State* h, GcAnyFn callback, GcFiber* fiber, Val val, int argc) {
   PCall jmp;
   jmp.prev = h->pcall;
   jmp.callback = callback;
+  jmp.fiber = fiber;
   h->pcall = &jmp;
 
-  CallFrame* old_frame = h->frame;
+  // The stacks can move while calling. Errors reset the value stack, so its
+  // top is put back below the callee from this
+  int old_frame = h->frame - h->frame_stack;
+  int base = h->top - h->stack - argc - 1;
 
   hby_Res res;
   if ((res = setjmp(jmp.buf)) == 0) {
@@ -1046,10 +1923,183 @@ hby_Res vm_pcall(hby_State* h, GcAnyFn callback, Val val, int argc) {
   }
 
   // Error
-  h->frame = old_frame;
+  h->frame = h->frame_stack + old_frame;
+  h->top = h->stack + base;
   h->pcall = jmp.prev;
 
   push(h, create_null());
   return res;
 }
 
+
+// Run a budgeted call from its start, or from where it was suspended
+static hby_Res run_budgeted(hby_State* h, bool start, Val val, int argc) {
+  // Where the call's value goes, kept as an offset since the stack can move.
+  // Errors reset the stack, so it's put back from this
+  Val* callee = start
+    ? h->top - argc - 1
+    : h->frame_stack[h->budget_frame].base;
+  int base = callee - h->stack;
+
+  PCall jmp;
+  jmp.prev = h->pcall;
+  jmp.callback = h->budget_callback;
+  jmp.fiber = NULL;
+  h->pcall = &jmp;
+
+  hby_Res res = setjmp(jmp.buf);
+  if (res == 0) {
+    if (!start) {
+      run(h);
+    } else if (call_val(h, val, argc)
+        && h->frame - h->frame_stack == h->budget_frame) {
+      h->frame->type = call_type_capi;
+      run(h);
+    }
+    res = h->suspended ? hby_res_suspended : hby_res_ok;
+  } else {
+    h->frame = h->frame_stack + h->budget_frame - 1;
+    h->top = h->stack + base;
+    push(h, create_null());
+  }
+
+  h->pcall = jmp.prev;
+  if (res != hby_res_suspended) {
+    h->budget = INT_MAX;
+    h->budget_frame = -1;
+    h->budget_fiber = NULL;
+    h->budget_callback.hby = NULL;
+  }
+  return res;
+}
+
+hby_Res vm_pcall_budget(
+    hby_State* h, GcAnyFn callback, Val val, int argc, int budget) {
+  if (h->budget_frame >= 0) {
+    hby_err(h, err_msg_budget_running);
+    return hby_res_runtime_err;
+  }
+
+  h->budget = budget > 0 ? budget : 1;
+  h->budget_frame = h->frame - h->frame_stack + 1;
+  h->budget_fiber = h->fiber;
+  h->budget_callback = callback;
+  return run_budgeted(h, true, val, argc);
+}
+
+hby_Res vm_resume_budget(hby_State* h, int budget) {
+  if (!h->suspended) {
+    hby_err(h, err_msg_not_suspended);
+    return hby_res_runtime_err;
+  }
+
+  h->suspended = false;
+  h->budget = budget > 0 ? budget : 1;
+  return run_budgeted(h, false, create_null(), 0);
+}
+
+void vm_resume(hby_State* h, GcFiber* fiber, int argc) {
+  GcFiber* caller = h->fiber;
+  Val* args = h->top - argc;
+
+  // The arguments stay on the stack of the caller, which doesn't move while
+  // another fiber runs
+  save_fiber(h, caller);
+  caller->status = fiber_normal;
+  fiber->caller = caller;
+  gc_barrier(h, &fiber->obj, create_obj(caller));
+  fiber->status = fiber_running;
+  h->fiber = fiber;
+  load_fiber(h, fiber);
+
+  // Errors in the fiber come back here, to be raised again by the caller
+  PCall jmp;
+  jmp.prev = h->pcall;
+  jmp.callback.hby = NULL;
+  jmp.fiber = fiber;
+  h->pcall = &jmp;
+
+  bool failed = setjmp(jmp.buf) != 0;
+  if (!failed) {
+    if (!is_null(fiber->fn)) {
+      // First resume, call the function with the arguments
+      hby_reserve(h, argc + 1);
+      Val fn = fiber->fn;
+      push(h, fn);
+      for (int i = 0; i < argc; i++) {
+        push(h, args[i]);
+      }
+      fiber->fn = create_null();
+
+      CallFrame* frame = h->frame;
+      if (call_val(h, fn, argc) && h->frame > frame) {
+        h->frame->type = call_type_capi;
+        run(h);
+      }
+    } else {
+      // The value is what the pending `Fiber.yield()` returns
+      h->top[-1] = argc > 0 ? args[0] : create_null();
+      if (h->frame > h->frame_stack) {
+        run(h);
+      }
+    }
+  }
+
+  h->pcall = jmp.prev;
+
+  Val res = create_null();
+  if (failed) {
+    fiber->status = fiber_done;
+  } else if (h->yielding) {
+    h->yielding = false;
+    fiber->status = fiber_suspended;
+    res = h->top[-1];
+  } else {
+    fiber->status = fiber_done;
+    res = h->top[-1];
+  }
+
+  CallFrame* frames = h->frame_stack;
+  int frame_cap = h->frame_cap;
+  Val* stack = h->stack;
+  int stack_cap = h->stack_cap;
+  if (fiber->status == fiber_done) {
+    // Nothing will run on these stacks again
+    close_upvals(h, h->stack);
+  } else {
+    save_fiber(h, fiber);
+  }
+
+  fiber->caller = NULL;
+  h->fiber = caller;
+  caller->status = fiber_running;
+  load_fiber(h, caller);
+  push(h, res);
+
+  if (fiber->status == fiber_done) {
+    release_arr(h, CallFrame, frames, frame_cap);
+    release_arr(h, Val, stack, stack_cap);
+  }
+
+  if (failed) {
+    hby_err(h, "%s", fiber->err->chars);
+  }
+}
+
+void vm_yield(hby_State* h) {
+  if (h->fiber->caller == NULL) {
+    hby_err(h, err_msg_yield_main);
+    return;
+  }
+
+  // The interpreter that runs the fiber stops, so it must be the only one
+  // between here and `vm_resume`
+  for (CallFrame* frame = h->frame - 1; frame > h->frame_stack + 1; frame--) {
+    if (frame->type != call_type_hby) {
+      hby_err(h, err_msg_yield_c);
+      return;
+    }
+  }
+
+  h->yielding = true;
+}
@@ -11,6 +11,15 @@ bool vm_isop(hby_State* h);
 void vm_call(hby_State* h, Val val, int argc);
 hby_Res vm_pcall(hby_State* h, GcAnyFn callback, Val val, int argc);
 void vm_invoke(hby_State* h, GcStr* name, int argc);
+// Like `vm_pcall`, but suspends after `budget` calls and loop iterations
+hby_Res vm_pcall_budget(
+  hby_State* h, GcAnyFn callback, Val val, int argc, int budget);
+hby_Res vm_resume_budget(hby_State* h, int budget);
+// Run `fiber` until it yields or ends, passing it the `argc` values on top of
+// the stack. Pushes what it yielded or returned
+void vm_resume(hby_State* h, GcFiber* fiber, int argc);
+// Stop the running fiber once the C function calling this returns
+void vm_yield(hby_State* h);
 hby_Res vm_interp(hby_State* h, const char* path, const char* c);
 
 #endif // __HBY_VM_H